@@ -0,0 +1,987 @@
+#include <algorithm>
+#include "Apu.h"
+#include "AudioSink.h"
+#include "Memory.h"
+#include "SaveState.h"
+
+namespace {
+
+const uint8_t lengthTable[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+const uint8_t dutyTable[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1}
+};
+
+const uint8_t triangleTable[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+// Timer periods in CPU cycles (NTSC)
+const uint16_t noisePeriods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+const uint16_t dmcPeriods[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// What a frame counter step does
+const uint8_t quarterFrame = 0x01;
+const uint8_t halfFrame = 0x02;
+const uint8_t frameIrq = 0x04;
+const uint8_t sequenceEnd = 0x08;
+
+struct FrameStep {
+    uint32_t cycle;         // CPU cycles from the start of the sequence
+    uint8_t actions;
+};
+
+// The last step of each sequence is the first of the next. The frame IRQ
+// is raised on three cycles in a row, so reading $4015 in between doesn't
+// lose it.
+const FrameStep fourStepSequence[] = {
+    {7457, quarterFrame},
+    {14913, quarterFrame | halfFrame},
+    {22371, quarterFrame},
+    {29828, frameIrq},
+    {29829, quarterFrame | halfFrame | frameIrq},
+    {29830, frameIrq | sequenceEnd}
+};
+
+const FrameStep fiveStepSequence[] = {
+    {7457, quarterFrame},
+    {14913, quarterFrame | halfFrame},
+    {22371, quarterFrame},
+    {37281, quarterFrame | halfFrame},
+    {37282, sequenceEnd}
+};
+
+// Longest stretch of CPU time one audio frame covers; longer runs between
+// Apu::endFrame() calls are split
+const uint32_t maxAudioFrameCycles = 0x10000;
+
+// Full scale of the mixer's output, leaving a little headroom
+const double outputScale = 30000;
+
+// The mixer's nonlinear response, looked up by the sum of the pulse outputs
+// and by 3 * triangle + 2 * noise + DMC
+struct MixerTables {
+    int32_t pulse[31];
+    int32_t tnd[203];
+};
+
+MixerTables makeMixerTables()
+{
+    MixerTables tables{};
+    for (uint32_t i = 1; i < 31; ++i)
+    {
+        tables.pulse[i] = static_cast<int32_t>(95.52 / (8128.0 / i + 100) * outputScale);
+    }
+    for (uint32_t i = 1; i < 203; ++i)
+    {
+        tables.tnd[i] = static_cast<int32_t>(163.67 / (24329.0 / i + 100) * outputScale);
+    }
+    return tables;
+}
+
+const MixerTables& getMixerTables()
+{
+    static const MixerTables tables = makeMixerTables();
+    return tables;
+}
+
+// The noise shift register is a linear map over GF(2), so 2^k steps of it
+// are a 15x15 bit matrix, kept as the image of each bit
+const uint32_t noiseBits = 15;
+const uint32_t noiseJumps = 64;
+
+struct NoiseJumps {
+    uint16_t columns[2][noiseJumps][noiseBits];
+};
+
+uint16_t stepNoise(uint16_t value, bool shortMode)
+{
+    const uint16_t feedback = (value ^ (value >> (shortMode ? 6 : 1))) & 1;
+    return static_cast<uint16_t>((value >> 1) | (feedback << 14));
+}
+
+uint16_t applyJump(const uint16_t* columns, uint16_t value)
+{
+    uint16_t result = 0;
+    for (uint32_t bit = 0; bit < noiseBits; ++bit)
+    {
+        if (value & (1u << bit))
+        {
+            result ^= columns[bit];
+        }
+    }
+    return result;
+}
+
+NoiseJumps makeNoiseJumps()
+{
+    NoiseJumps jumps{};
+    for (uint32_t mode = 0; mode < 2; ++mode)
+    {
+        for (uint32_t bit = 0; bit < noiseBits; ++bit)
+        {
+            jumps.columns[mode][0][bit] = stepNoise(static_cast<uint16_t>(1u << bit), mode != 0);
+        }
+        for (uint32_t k = 1; k < noiseJumps; ++k)
+        {
+            for (uint32_t bit = 0; bit < noiseBits; ++bit)
+            {
+                const uint16_t half = applyJump(jumps.columns[mode][k - 1], static_cast<uint16_t>(1u << bit));
+                jumps.columns[mode][k][bit] = applyJump(jumps.columns[mode][k - 1], half);
+            }
+        }
+    }
+    return jumps;
+}
+
+const NoiseJumps& getNoiseJumps()
+{
+    static const NoiseJumps jumps = makeNoiseJumps();
+    return jumps;
+}
+
+// Below this many steps the noise register is stepped one at a time
+const uint64_t noiseJumpThreshold = 32;
+
+void save(std::ostream& out, const NesApu::Envelope& envelope)
+{
+    SaveState::write(out, envelope.volume);
+    SaveState::write(out, envelope.constant);
+    SaveState::write(out, envelope.loop);
+    SaveState::write(out, envelope.start);
+    SaveState::write(out, envelope.divider);
+    SaveState::write(out, envelope.decay);
+}
+
+bool load(std::istream& in, NesApu::Envelope& envelope)
+{
+    return SaveState::read(in, envelope.volume) && SaveState::read(in, envelope.constant)
+        && SaveState::read(in, envelope.loop) && SaveState::read(in, envelope.start)
+        && SaveState::read(in, envelope.divider) && SaveState::read(in, envelope.decay);
+}
+
+void save(std::ostream& out, const NesApu::LengthCounter& length)
+{
+    SaveState::write(out, length.count);
+    SaveState::write(out, length.halt);
+    SaveState::write(out, length.enabled);
+}
+
+bool load(std::istream& in, NesApu::LengthCounter& length)
+{
+    return SaveState::read(in, length.count) && SaveState::read(in, length.halt)
+        && SaveState::read(in, length.enabled);
+}
+
+void save(std::ostream& out, const NesApu::Pulse& pulse)
+{
+    save(out, pulse.envelope);
+    save(out, pulse.length);
+    SaveState::write(out, pulse.duty);
+    SaveState::write(out, pulse.step);
+    SaveState::write(out, pulse.period);
+    SaveState::write(out, pulse.sweepEnabled);
+    SaveState::write(out, pulse.sweepPeriod);
+    SaveState::write(out, pulse.sweepNegate);
+    SaveState::write(out, pulse.sweepShift);
+    SaveState::write(out, pulse.sweepReload);
+    SaveState::write(out, pulse.sweepDivider);
+    SaveState::write(out, pulse.nextClock);
+}
+
+bool load(std::istream& in, NesApu::Pulse& pulse)
+{
+    return load(in, pulse.envelope) && load(in, pulse.length)
+        && SaveState::read(in, pulse.duty) && SaveState::read(in, pulse.step)
+        && SaveState::read(in, pulse.period) && SaveState::read(in, pulse.sweepEnabled)
+        && SaveState::read(in, pulse.sweepPeriod) && SaveState::read(in, pulse.sweepNegate)
+        && SaveState::read(in, pulse.sweepShift) && SaveState::read(in, pulse.sweepReload)
+        && SaveState::read(in, pulse.sweepDivider) && SaveState::read(in, pulse.nextClock);
+}
+
+void save(std::ostream& out, const NesApu::Triangle& triangle)
+{
+    save(out, triangle.length);
+    SaveState::write(out, triangle.step);
+    SaveState::write(out, triangle.period);
+    SaveState::write(out, triangle.linearCounter);
+    SaveState::write(out, triangle.linearReload);
+    SaveState::write(out, triangle.linearReloadFlag);
+    SaveState::write(out, triangle.nextClock);
+}
+
+bool load(std::istream& in, NesApu::Triangle& triangle)
+{
+    return load(in, triangle.length)
+        && SaveState::read(in, triangle.step) && SaveState::read(in, triangle.period)
+        && SaveState::read(in, triangle.linearCounter) && SaveState::read(in, triangle.linearReload)
+        && SaveState::read(in, triangle.linearReloadFlag) && SaveState::read(in, triangle.nextClock);
+}
+
+void save(std::ostream& out, const NesApu::Noise& noise)
+{
+    save(out, noise.envelope);
+    save(out, noise.length);
+    SaveState::write(out, noise.shortMode);
+    SaveState::write(out, noise.periodIndex);
+    SaveState::write(out, noise.shiftRegister);
+    SaveState::write(out, noise.nextClock);
+}
+
+bool load(std::istream& in, NesApu::Noise& noise)
+{
+    return load(in, noise.envelope) && load(in, noise.length)
+        && SaveState::read(in, noise.shortMode) && SaveState::read(in, noise.periodIndex)
+        && SaveState::read(in, noise.shiftRegister) && SaveState::read(in, noise.nextClock);
+}
+
+void save(std::ostream& out, const NesApu::Dmc& dmc)
+{
+    SaveState::write(out, dmc.irqEnabled);
+    SaveState::write(out, dmc.loop);
+    SaveState::write(out, dmc.rateIndex);
+    SaveState::write(out, dmc.level);
+    SaveState::write(out, dmc.sampleAddress);
+    SaveState::write(out, dmc.sampleLength);
+    SaveState::write(out, dmc.currentAddress);
+    SaveState::write(out, dmc.bytesRemaining);
+    SaveState::write(out, dmc.buffer);
+    SaveState::write(out, dmc.bufferFull);
+    SaveState::write(out, dmc.shift);
+    SaveState::write(out, dmc.bitsRemaining);
+    SaveState::write(out, dmc.silence);
+    SaveState::write(out, dmc.irqFlag);
+    SaveState::write(out, dmc.nextClock);
+}
+
+bool load(std::istream& in, NesApu::Dmc& dmc)
+{
+    return SaveState::read(in, dmc.irqEnabled) && SaveState::read(in, dmc.loop)
+        && SaveState::read(in, dmc.rateIndex) && SaveState::read(in, dmc.level)
+        && SaveState::read(in, dmc.sampleAddress) && SaveState::read(in, dmc.sampleLength)
+        && SaveState::read(in, dmc.currentAddress) && SaveState::read(in, dmc.bytesRemaining)
+        && SaveState::read(in, dmc.buffer) && SaveState::read(in, dmc.bufferFull)
+        && SaveState::read(in, dmc.shift) && SaveState::read(in, dmc.bitsRemaining)
+        && SaveState::read(in, dmc.silence) && SaveState::read(in, dmc.irqFlag)
+        && SaveState::read(in, dmc.nextClock);
+}
+
+}
+
+/////////////////////////////////////
+// Channel units
+/////////////////////////////////////
+
+void NesApu::Envelope::clock()
+{
+    if (start)
+    {
+        start = false;
+        decay = 15;
+        divider = volume;
+    }
+    else if (divider == 0)
+    {
+        divider = volume;
+        if (decay)
+        {
+            --decay;
+        }
+        else if (loop)
+        {
+            decay = 15;
+        }
+    }
+    else
+    {
+        --divider;
+    }
+}
+
+void NesApu::LengthCounter::load(uint8_t index)
+{
+    if (enabled)
+    {
+        count = lengthTable[index & 31];
+    }
+}
+
+uint32_t NesApu::Pulse::sweepTarget() const
+{
+    const uint32_t change = period >> sweepShift;
+    if (!sweepNegate)
+    {
+        return period + change;
+    }
+    const uint32_t subtract = change + (onesComplement ? 1 : 0);
+    return subtract > period ? 0 : period - subtract;
+}
+
+uint8_t NesApu::Pulse::output() const
+{
+    if (length.count == 0 || muted() || !dutyTable[duty][step])
+    {
+        return 0;
+    }
+    return envelope.output();
+}
+
+void NesApu::Pulse::clockSweep()
+{
+    if (sweepDivider == 0 && sweepEnabled && sweepShift > 0 && !muted())
+    {
+        period = static_cast<uint16_t>(sweepTarget());
+    }
+    if (sweepDivider == 0 || sweepReload)
+    {
+        sweepDivider = sweepPeriod;
+        sweepReload = false;
+    }
+    else
+    {
+        --sweepDivider;
+    }
+}
+
+uint8_t NesApu::Triangle::output() const
+{
+    return triangleTable[step];
+}
+
+void NesApu::Triangle::clockLinearCounter()
+{
+    if (linearReloadFlag)
+    {
+        linearCounter = linearReload;
+    }
+    else if (linearCounter)
+    {
+        --linearCounter;
+    }
+    // The halt flag doubles as the linear counter's control flag
+    if (!length.halt)
+    {
+        linearReloadFlag = false;
+    }
+}
+
+uint32_t NesApu::Noise::clockPeriod() const
+{
+    return noisePeriods[periodIndex & 15];
+}
+
+uint8_t NesApu::Noise::output() const
+{
+    return (length.count == 0 || (shiftRegister & 1)) ? 0 : envelope.output();
+}
+
+void NesApu::Noise::clockTimer(uint64_t count)
+{
+    if (count < noiseJumpThreshold)
+    {
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            shiftRegister = stepNoise(shiftRegister, shortMode);
+        }
+        return;
+    }
+    const NoiseJumps& jumps = getNoiseJumps();
+    for (uint32_t k = 0; count != 0; ++k, count >>= 1)
+    {
+        if (count & 1)
+        {
+            shiftRegister = applyJump(jumps.columns[shortMode ? 1 : 0][k], shiftRegister);
+        }
+    }
+}
+
+uint32_t NesApu::Dmc::clockPeriod() const
+{
+    return dmcPeriods[rateIndex & 15];
+}
+
+/////////////////////////////////////
+// APU
+/////////////////////////////////////
+
+NesApu::Apu::Apu() : pulse{}
+    , triangle{}
+    , noise{}
+    , dmc{}
+    , fiveStepMode{}
+    , irqInhibit{}
+    , frameIrqFlag{}
+    , frameStep{}
+    , sequenceStart{}
+    , time{}
+    , stallCycles{}
+    , clockCycles{}
+    , memory{}
+    , sink{}
+    , blip{}
+    , audioFrameStart{}
+    , lastLevel{}
+{
+    reset();
+}
+
+void NesApu::Apu::reset()
+{
+    time = clockCycles ? *clockCycles : 0;
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        pulse[i] = Pulse{};
+        pulse[i].onesComplement = (i == 0);
+        pulse[i].nextClock = time + pulse[i].clockPeriod();
+    }
+    triangle = Triangle{};
+    triangle.nextClock = time + triangle.clockPeriod();
+    noise = Noise{};
+    noise.shiftRegister = 1;
+    noise.nextClock = time + noise.clockPeriod();
+    dmc = Dmc{};
+    dmc.silence = true;
+    dmc.bitsRemaining = 8;
+    dmc.nextClock = time + dmc.clockPeriod();
+
+    // As if $4017 was written with 0
+    fiveStepMode = false;
+    irqInhibit = false;
+    frameIrqFlag = false;
+    frameStep = 0;
+    sequenceStart = time;
+    stallCycles = 0;
+
+    audioFrameStart = time;
+    lastLevel = mix();
+}
+
+void NesApu::Apu::setSink(AudioSink* sink)
+{
+    if (this->sink)
+    {
+        flushAudio();
+    }
+    this->sink = sink;
+    if (sink)
+    {
+        blip.setRates(cpuClockRate, sink->getSampleRate(), maxAudioFrameCycles);
+        audioFrameStart = time;
+        lastLevel = mix();
+    }
+}
+
+uint8_t NesApu::Apu::readStatus()
+{
+    const uint8_t value = static_cast<uint8_t>((pulse[0].length.count ? 0x01 : 0)
+        | (pulse[1].length.count ? 0x02 : 0)
+        | (triangle.length.count ? 0x04 : 0)
+        | (noise.length.count ? 0x08 : 0)
+        | (dmc.bytesRemaining ? 0x10 : 0)
+        | (frameIrqFlag ? 0x40 : 0)
+        | (dmc.irqFlag ? 0x80 : 0));
+    frameIrqFlag = false;
+    return value;
+}
+
+void NesApu::Apu::writeRegister(uint16_t address, uint8_t value)
+{
+    switch (address)
+    {
+    case 0x4000:
+    case 0x4004:
+    {
+        Pulse& channel = pulse[(address >> 2) & 1];
+        channel.duty = value >> 6;
+        channel.envelope.loop = channel.length.halt = (value & 0x20) != 0;
+        channel.envelope.constant = (value & 0x10) != 0;
+        channel.envelope.volume = value & 0x0F;
+        break;
+    }
+    case 0x4001:
+    case 0x4005:
+    {
+        Pulse& channel = pulse[(address >> 2) & 1];
+        channel.sweepEnabled = (value & 0x80) != 0;
+        channel.sweepPeriod = (value >> 4) & 7;
+        channel.sweepNegate = (value & 0x08) != 0;
+        channel.sweepShift = value & 7;
+        channel.sweepReload = true;
+        break;
+    }
+    case 0x4002:
+    case 0x4006:
+    {
+        Pulse& channel = pulse[(address >> 2) & 1];
+        channel.period = static_cast<uint16_t>((channel.period & 0x700) | value);
+        break;
+    }
+    case 0x4003:
+    case 0x4007:
+    {
+        // Restarts the note: the sequence goes back to its start and the
+        // envelope to full volume
+        Pulse& channel = pulse[(address >> 2) & 1];
+        channel.period = static_cast<uint16_t>((channel.period & 0xFF) | ((value & 7) << 8));
+        channel.length.load(value >> 3);
+        channel.step = 0;
+        channel.envelope.start = true;
+        break;
+    }
+    case 0x4008:
+        triangle.length.halt = (value & 0x80) != 0;
+        triangle.linearReload = value & 0x7F;
+        break;
+    case 0x400A:
+        triangle.period = static_cast<uint16_t>((triangle.period & 0x700) | value);
+        break;
+    case 0x400B:
+        triangle.period = static_cast<uint16_t>((triangle.period & 0xFF) | ((value & 7) << 8));
+        triangle.length.load(value >> 3);
+        triangle.linearReloadFlag = true;
+        break;
+    case 0x400C:
+        noise.envelope.loop = noise.length.halt = (value & 0x20) != 0;
+        noise.envelope.constant = (value & 0x10) != 0;
+        noise.envelope.volume = value & 0x0F;
+        break;
+    case 0x400E:
+        noise.shortMode = (value & 0x80) != 0;
+        noise.periodIndex = value & 0x0F;
+        break;
+    case 0x400F:
+        noise.length.load(value >> 3);
+        noise.envelope.start = true;
+        break;
+    case dmcControlRegister:
+        dmc.irqEnabled = (value & 0x80) != 0;
+        dmc.loop = (value & 0x40) != 0;
+        dmc.rateIndex = value & 0x0F;
+        if (!dmc.irqEnabled)
+        {
+            dmc.irqFlag = false;
+        }
+        break;
+    case 0x4011:
+        dmc.level = value & 0x7F;
+        break;
+    case 0x4012:
+        dmc.sampleAddress = static_cast<uint16_t>(0xC000 | (value << 6));
+        break;
+    case 0x4013:
+        dmc.sampleLength = static_cast<uint16_t>((value << 4) | 1);
+        break;
+    case statusRegister:
+    {
+        LengthCounter* lengths[4] = {&pulse[0].length, &pulse[1].length, &triangle.length, &noise.length};
+        for (uint32_t i = 0; i < 4; ++i)
+        {
+            lengths[i]->enabled = (value & (1u << i)) != 0;
+            if (!lengths[i]->enabled)
+            {
+                lengths[i]->count = 0;
+            }
+        }
+        // Enabling the DMC starts its sample over only once it has finished
+        if (value & 0x10)
+        {
+            if (dmc.bytesRemaining == 0)
+            {
+                dmc.restart();
+            }
+            fetchDmcSample();
+        }
+        else
+        {
+            dmc.bytesRemaining = 0;
+        }
+        dmc.irqFlag = false;
+        break;
+    }
+    case frameCounterRegister:
+        // Restarts the sequence. The five-step sequence has no IRQ and
+        // clocks everything straight away.
+        fiveStepMode = (value & 0x80) != 0;
+        irqInhibit = (value & 0x40) != 0;
+        if (irqInhibit)
+        {
+            frameIrqFlag = false;
+        }
+        frameStep = 0;
+        sequenceStart = time;
+        if (fiveStepMode)
+        {
+            clockQuarterFrame();
+            clockHalfFrame();
+        }
+        break;
+    default:
+        // $4009 and $400D are unused
+        break;
+    }
+    updateOutput();
+}
+
+void NesApu::Apu::runTo(uint64_t cycle)
+{
+    if (cycle <= time)
+    {
+        return;
+    }
+    for (;;)
+    {
+        const uint64_t step = nextFrameStepCycle();
+        const uint64_t end = std::min(cycle, step);
+        runChannels(end);
+        time = end;
+        if (step > cycle)
+        {
+            break;
+        }
+        clockFrameStep();
+    }
+}
+
+uint64_t NesApu::Apu::nextSyncCycle() const
+{
+    uint64_t next = UINT64_MAX;
+    if (!fiveStepMode && !irqInhibit && !frameIrqFlag)
+    {
+        for (uint32_t i = frameStep; ; ++i)
+        {
+            if (fourStepSequence[i].actions & frameIrq)
+            {
+                next = sequenceStart + fourStepSequence[i].cycle;
+                break;
+            }
+        }
+    }
+    if (dmc.bytesRemaining != 0)
+    {
+        // The buffer is full until the shift register next empties
+        next = std::min(next, dmc.nextClock + static_cast<uint64_t>(dmc.bitsRemaining - 1) * dmc.clockPeriod());
+    }
+    return next;
+}
+
+void NesApu::Apu::endFrame()
+{
+    catchUp();
+    if (sink)
+    {
+        flushAudio();
+    }
+}
+
+template<typename Channel>
+void NesApu::Apu::skipTimer(Channel& channel, uint64_t cycle)
+{
+    if (channel.nextClock <= cycle)
+    {
+        const uint32_t period = channel.clockPeriod();
+        const uint64_t count = (cycle - channel.nextClock) / period + 1;
+        channel.clockTimer(count);
+        channel.nextClock += count * period;
+    }
+}
+
+void NesApu::Apu::runChannels(uint64_t cycle)
+{
+    if (sink)
+    {
+        synthesize(cycle);
+        return;
+    }
+    skipTimer(pulse[0], cycle);
+    skipTimer(pulse[1], cycle);
+    skipTimer(triangle, cycle);
+    skipTimer(noise, cycle);
+    runDmc(cycle);
+}
+
+void NesApu::Apu::synthesize(uint64_t cycle)
+{
+    // Channels that can't change level until the next register write or
+    // frame counter step jump straight to the end
+    const bool pulse0 = !pulse[0].silent();
+    const bool pulse1 = !pulse[1].silent();
+    const bool triangleOn = !triangle.silent();
+    const bool noiseOn = !noise.silent();
+    const bool dmcOn = !dmc.idle();
+    if (!pulse0)
+    {
+        skipTimer(pulse[0], cycle);
+    }
+    if (!pulse1)
+    {
+        skipTimer(pulse[1], cycle);
+    }
+    if (!triangleOn)
+    {
+        skipTimer(triangle, cycle);
+    }
+    if (!noiseOn)
+    {
+        skipTimer(noise, cycle);
+    }
+    if (!dmcOn)
+    {
+        runDmc(cycle);
+    }
+
+    // The rest step together, so the mixer sees every combination of
+    // outputs at the cycle it starts
+    for (;;)
+    {
+        uint64_t next = cycle + 1;
+        next = pulse0 ? std::min(next, pulse[0].nextClock) : next;
+        next = pulse1 ? std::min(next, pulse[1].nextClock) : next;
+        next = triangleOn ? std::min(next, triangle.nextClock) : next;
+        next = noiseOn ? std::min(next, noise.nextClock) : next;
+        next = dmcOn ? std::min(next, dmc.nextClock) : next;
+        if (next > cycle)
+        {
+            break;
+        }
+
+        for (uint32_t i = 0; i < 2; ++i)
+        {
+            if ((i == 0 ? pulse0 : pulse1) && pulse[i].nextClock == next)
+            {
+                pulse[i].clockTimer(1);
+                pulse[i].nextClock += pulse[i].clockPeriod();
+            }
+        }
+        if (triangleOn && triangle.nextClock == next)
+        {
+            triangle.clockTimer(1);
+            triangle.nextClock += triangle.clockPeriod();
+        }
+        if (noiseOn && noise.nextClock == next)
+        {
+            noise.clockTimer(1);
+            noise.nextClock += noise.clockPeriod();
+        }
+        if (dmcOn && dmc.nextClock == next)
+        {
+            clockDmc();
+            dmc.nextClock += dmc.clockPeriod();
+        }
+        time = next;
+        updateOutput();
+    }
+}
+
+void NesApu::Apu::runDmc(uint64_t cycle)
+{
+    while (dmc.nextClock <= cycle)
+    {
+        if (dmc.idle())
+        {
+            // Only the bit counter moves, wrapping from 1 back to 8
+            const uint32_t period = dmc.clockPeriod();
+            const uint64_t count = (cycle - dmc.nextClock) / period + 1;
+            dmc.bitsRemaining = static_cast<uint8_t>((dmc.bitsRemaining + 7 - count % 8) % 8 + 1);
+            dmc.nextClock += count * period;
+            break;
+        }
+        clockDmc();
+        dmc.nextClock += dmc.clockPeriod();
+    }
+}
+
+void NesApu::Apu::clockDmc()
+{
+    if (!dmc.silence)
+    {
+        if (dmc.shift & 1)
+        {
+            if (dmc.level <= 125)
+            {
+                dmc.level += 2;
+            }
+        }
+        else if (dmc.level >= 2)
+        {
+            dmc.level -= 2;
+        }
+    }
+    dmc.shift >>= 1;
+    if (--dmc.bitsRemaining == 0)
+    {
+        // Start the next byte from the buffer, and refill it
+        dmc.bitsRemaining = 8;
+        dmc.silence = !dmc.bufferFull;
+        if (dmc.bufferFull)
+        {
+            dmc.shift = dmc.buffer;
+            dmc.bufferFull = false;
+            fetchDmcSample();
+        }
+    }
+}
+
+void NesApu::Apu::fetchDmcSample()
+{
+    if (dmc.bufferFull || dmc.bytesRemaining == 0 || !memory)
+    {
+        return;
+    }
+    dmc.buffer = memory->read(dmc.currentAddress);
+    dmc.bufferFull = true;
+    stallCycles += dmcFetchCycles;
+    // Addresses wrap from $FFFF to $8000
+    dmc.currentAddress = (dmc.currentAddress == 0xFFFF) ? 0x8000 : dmc.currentAddress + 1;
+    if (--dmc.bytesRemaining == 0)
+    {
+        if (dmc.loop)
+        {
+            dmc.restart();
+        }
+        else if (dmc.irqEnabled)
+        {
+            dmc.irqFlag = true;
+        }
+    }
+}
+
+uint64_t NesApu::Apu::nextFrameStepCycle() const
+{
+    const FrameStep* sequence = fiveStepMode ? fiveStepSequence : fourStepSequence;
+    return sequenceStart + sequence[frameStep].cycle;
+}
+
+void NesApu::Apu::clockFrameStep()
+{
+    const FrameStep& step = (fiveStepMode ? fiveStepSequence : fourStepSequence)[frameStep];
+    if (step.actions & quarterFrame)
+    {
+        clockQuarterFrame();
+    }
+    if (step.actions & halfFrame)
+    {
+        clockHalfFrame();
+    }
+    if ((step.actions & frameIrq) && !irqInhibit)
+    {
+        frameIrqFlag = true;
+    }
+    if (step.actions & sequenceEnd)
+    {
+        sequenceStart += step.cycle;
+        frameStep = 0;
+    }
+    else
+    {
+        ++frameStep;
+    }
+    updateOutput();
+}
+
+void NesApu::Apu::clockQuarterFrame()
+{
+    pulse[0].envelope.clock();
+    pulse[1].envelope.clock();
+    noise.envelope.clock();
+    triangle.clockLinearCounter();
+}
+
+void NesApu::Apu::clockHalfFrame()
+{
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        pulse[i].length.clock();
+        pulse[i].clockSweep();
+    }
+    triangle.length.clock();
+    noise.length.clock();
+}
+
+int32_t NesApu::Apu::mix() const
+{
+    const MixerTables& tables = getMixerTables();
+    return tables.pulse[pulse[0].output() + pulse[1].output()]
+        + tables.tnd[3 * triangle.output() + 2 * noise.output() + dmc.level];
+}
+
+void NesApu::Apu::updateOutput()
+{
+    if (!sink)
+    {
+        return;
+    }
+    if (time - audioFrameStart >= maxAudioFrameCycles)
+    {
+        flushAudio();
+    }
+    const int32_t level = mix();
+    if (level != lastLevel)
+    {
+        blip.addDelta(static_cast<uint32_t>(time - audioFrameStart), level - lastLevel);
+        lastLevel = level;
+    }
+}
+
+void NesApu::Apu::flushAudio()
+{
+    int16_t samples[1024];
+    while (time != audioFrameStart)
+    {
+        const uint64_t length = std::min<uint64_t>(time - audioFrameStart, maxAudioFrameCycles);
+        blip.endFrame(static_cast<uint32_t>(length));
+        audioFrameStart += length;
+        while (uint32_t count = blip.readSamples(samples, 1024))
+        {
+            sink->write(samples, count);
+        }
+    }
+}
+
+void NesApu::Apu::saveState(std::ostream& out) const
+{
+    save(out, pulse[0]);
+    save(out, pulse[1]);
+    save(out, triangle);
+    save(out, noise);
+    save(out, dmc);
+    SaveState::write(out, fiveStepMode);
+    SaveState::write(out, irqInhibit);
+    SaveState::write(out, frameIrqFlag);
+    SaveState::write(out, frameStep);
+    SaveState::write(out, sequenceStart);
+    SaveState::write(out, time);
+    SaveState::write(out, stallCycles);
+}
+
+bool NesApu::Apu::loadState(std::istream& in)
+{
+    // Samples up to now are played out; the level steps to the loaded one
+    if (sink)
+    {
+        flushAudio();
+    }
+    const bool ok = load(in, pulse[0]) && load(in, pulse[1]) && load(in, triangle)
+        && load(in, noise) && load(in, dmc)
+        && SaveState::read(in, fiveStepMode) && SaveState::read(in, irqInhibit)
+        && SaveState::read(in, frameIrqFlag) && SaveState::read(in, frameStep)
+        && SaveState::read(in, sequenceStart) && SaveState::read(in, time)
+        && SaveState::read(in, stallCycles);
+    // A step past the end of the sequence would come from a bad state
+    const uint32_t steps = fiveStepMode ? sizeof(fiveStepSequence) / sizeof(FrameStep) : sizeof(fourStepSequence) / sizeof(FrameStep);
+    frameStep = static_cast<uint8_t>(frameStep % steps);
+    audioFrameStart = time;
+    updateOutput();
+    return ok;
+}
@@ -0,0 +1,290 @@
+#ifndef APU_HXX
+#define APU_HXX
+
+#include <stdint.h>
+#include <istream>
+#include <ostream>
+#include "BlipBuffer.h"
+
+class Memory;
+class AudioSink;
+
+namespace NesApu
+{
+
+// Channel registers are $4000-$4013; $4015 is enable/status and $4017 the
+// frame counter
+static const uint16_t registerStart = 0x4000;
+static const uint16_t registerEnd = 0x4013;
+static const uint16_t dmcControlRegister = 0x4010;
+static const uint16_t statusRegister = 0x4015;
+static const uint16_t frameCounterRegister = 0x4017;
+
+// NTSC CPU clock
+static const double cpuClockRate = 1789773.0;
+
+static const uint32_t defaultSampleRate = 44100;
+
+// A DMC sample fetch halts the CPU for this many cycles
+static const uint32_t dmcFetchCycles = 4;
+
+// Volume (0-15) from a constant or a decaying envelope, clocked every
+// quarter frame
+struct Envelope {
+    uint8_t volume;         // Constant volume, or the envelope's period
+    bool constant;
+    bool loop;              // Also the length counter halt flag
+    bool start;
+    uint8_t divider;
+    uint8_t decay;
+
+    uint8_t output() const { return constant ? volume : decay; }
+    void clock();
+};
+
+// Counts notes down every half frame; the channel is silent at zero.
+// Loads are ignored while the channel is disabled in $4015.
+struct LengthCounter {
+    uint8_t count;
+    bool halt;
+    bool enabled;
+
+    void load(uint8_t index);
+    void clock() { if (!halt && count) --count; }
+};
+
+struct Pulse {
+    Envelope envelope;
+    LengthCounter length;
+    uint8_t duty;
+    uint8_t step;           // Position in the duty sequence, counting down
+    uint16_t period;        // Timer reload; the timer runs at half CPU rate
+
+    // Sweep unit ($4001)
+    bool sweepEnabled;
+    uint8_t sweepPeriod;
+    bool sweepNegate;
+    uint8_t sweepShift;
+    bool sweepReload;
+    uint8_t sweepDivider;
+
+    // Pulse 1 negates in ones' complement, pulse 2 in twos'
+    bool onesComplement;
+
+    uint64_t nextClock;
+
+    // The period the sweep would set. Targets past $7FF mute the channel
+    // even with the sweep disabled.
+    uint32_t sweepTarget() const;
+    bool muted() const { return period < 8 || sweepTarget() > 0x7FF; }
+
+    uint32_t clockPeriod() const { return (period + 1u) * 2; }
+    uint8_t output() const;
+
+    // Output can't change however the timer runs
+    bool silent() const { return length.count == 0 || envelope.output() == 0 || muted(); }
+
+    void clockTimer(uint64_t count) { step = static_cast<uint8_t>((step - count) & 7); }
+    void clockSweep();
+};
+
+struct Triangle {
+    LengthCounter length;
+    uint8_t step;           // Position in the 32-step sequence
+    uint16_t period;
+    uint8_t linearCounter;
+    uint8_t linearReload;
+    bool linearReloadFlag;
+
+    uint64_t nextClock;
+
+    uint32_t clockPeriod() const { return period + 1u; }
+    uint8_t output() const;
+
+    // The sequencer stops with either counter at zero. Periods under 2
+    // would step it above 500 kHz, which only ever serves to silence it,
+    // so they hold it too.
+    bool silent() const { return length.count == 0 || linearCounter == 0 || period < 2; }
+
+    void clockTimer(uint64_t count)
+    {
+        if (!silent())
+        {
+            step = static_cast<uint8_t>((step + count) & 31);
+        }
+    }
+    void clockLinearCounter();
+};
+
+struct Noise {
+    Envelope envelope;
+    LengthCounter length;
+    bool shortMode;         // Feedback from bit 6 instead of bit 1
+    uint8_t periodIndex;
+    uint16_t shiftRegister;
+
+    uint64_t nextClock;
+
+    uint32_t clockPeriod() const;
+    uint8_t output() const;
+    bool silent() const { return length.count == 0 || envelope.output() == 0; }
+
+    // Step the shift register count times. Long runs jump in O(log count).
+    void clockTimer(uint64_t count);
+};
+
+// Delta modulation channel: plays 1-bit deltas read from CPU memory
+struct Dmc {
+    bool irqEnabled;
+    bool loop;
+    uint8_t rateIndex;
+    uint8_t level;          // 7-bit output
+    uint16_t sampleAddress;
+    uint16_t sampleLength;
+    uint16_t currentAddress;
+    uint16_t bytesRemaining;
+    uint8_t buffer;
+    bool bufferFull;
+    uint8_t shift;
+    uint8_t bitsRemaining;
+    bool silence;           // Nothing in the shift register this cycle
+    bool irqFlag;
+
+    uint64_t nextClock;
+
+    uint32_t clockPeriod() const;
+
+    // Nothing to play and nothing left to fetch
+    bool idle() const { return silence && !bufferFull && bytesRemaining == 0; }
+
+    void restart()
+    {
+        currentAddress = sampleAddress;
+        bytesRemaining = sampleLength;
+    }
+};
+
+// The 2A03's sound hardware: two pulse channels, triangle, noise and DMC,
+// the frame counter that clocks their envelopes, sweeps and length
+// counters, and the frame and DMC IRQs.
+//
+// Like the PPU it runs behind the CPU and catches up when the CPU touches
+// it, at the console's stops and at the end of each frame. The CPU stops at
+// nextSyncCycle() so IRQs and DMC fetches land on time. Timers advance in
+// closed form unless a channel is audible and a sink is attached, so
+// headless runs only pay for frame counter steps and DMC fetches, and
+// reach the same state as runs with sound.
+//
+// With a sink, the mixer's output level is fed to a BlipBuffer as steps at
+// the cycle each channel changes, and each frame's samples go to the sink
+// at the output rate.
+class Apu {
+
+public:
+    Apu();
+
+    Apu(const Apu&) = delete;
+    Apu& operator=(const Apu&) = delete;
+
+    // The CPU's cycle count, and the bus DMC samples are read from
+    void setClock(const uint64_t* cycles) { clockCycles = cycles; }
+    void setMemory(Memory* memory) { this->memory = memory; }
+
+    // Send audio to sink at its sample rate, or stop producing samples with
+    // null (the default)
+    void setSink(AudioSink* sink);
+
+    // Power on at the CPU's current cycle
+    void reset();
+
+    // $4015: length counters playing, DMC active, frame and DMC IRQs.
+    // Reading clears the frame IRQ.
+    uint8_t readStatus();
+
+    // $4000-$4013, $4015 and $4017. The APU has to be caught up first.
+    void writeRegister(uint16_t address, uint8_t value);
+
+    // Do the work due up to the CPU's current cycle
+    void catchUp() { runTo(*clockCycles); }
+
+    void runTo(uint64_t cycle);
+
+    // The next cycle the IRQ line or a DMC fetch is due on without a
+    // register write, or UINT64_MAX
+    uint64_t nextSyncCycle() const;
+
+    bool irqAsserted() const { return frameIrqFlag || dmc.irqFlag; }
+
+    // CPU cycles lost to DMC fetches since the last call
+    uint32_t takeStallCycles()
+    {
+        const uint32_t cycles = stallCycles;
+        stallCycles = 0;
+        return cycles;
+    }
+
+    // Catch up and send the samples so far to the sink
+    void endFrame();
+
+    void saveState(std::ostream& out) const;
+    bool loadState(std::istream& in);
+
+private:
+    // Run the channels up to cycle, with no frame counter step before it
+    void runChannels(uint64_t cycle);
+
+    // Lockstep the audible channels, adding each change of level
+    void synthesize(uint64_t cycle);
+
+    // Bring a timer to the first clock after cycle in one jump
+    template<typename Channel>
+    static void skipTimer(Channel& channel, uint64_t cycle);
+
+    // Bring the DMC up to cycle, one bit at a time while it has something
+    // to play
+    void runDmc(uint64_t cycle);
+    void clockDmc();
+    void fetchDmcSample();
+
+    uint64_t nextFrameStepCycle() const;
+    void clockFrameStep();
+    void clockQuarterFrame();
+    void clockHalfFrame();
+
+    // Mixer output for the channels' current outputs, and the step from
+    // the last level at the current time
+    int32_t mix() const;
+    void updateOutput();
+
+    // Send what the BlipBuffer has to the sink and start a new audio frame
+    void flushAudio();
+
+    Pulse pulse[2];
+    Triangle triangle;
+    Noise noise;
+    Dmc dmc;
+
+    // Frame counter ($4017): the sequence started on sequenceStart and its
+    // next step
+    bool fiveStepMode;
+    bool irqInhibit;
+    bool frameIrqFlag;
+    uint8_t frameStep;
+    uint64_t sequenceStart;
+
+    // Cycle all work is done up to
+    uint64_t time;
+    uint32_t stallCycles;
+
+    const uint64_t* clockCycles;
+    Memory* memory;
+
+    AudioSink* sink;
+    BlipBuffer blip;
+    uint64_t audioFrameStart;
+    int32_t lastLevel;
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <algorithm>
+#include "AudioSink.h"
+#include "SaveState.h"
+
+namespace {
+
+const uint32_t wavHeaderSize = 44;
+const uint16_t pcmFormat = 1;
+const uint16_t channels = 1;
+const uint16_t bitsPerSample = 16;
+
+// Size fields of a WAV that's still being streamed
+const uint32_t unknownSize = 0xFFFFFFFF;
+
+void writeLittle(char* out, uint32_t value, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; ++i)
+    {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+bool endsWith(const std::string& text, const std::string& suffix)
+{
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}
+
+AudioSink::AudioSink() : out{}
+    , wav{}
+    , sampleRate{}
+    , samplesWritten{}
+    , hash{SaveState::hash(nullptr, 0)}
+{
+}
+
+AudioSink::~AudioSink()
+{
+    close();
+}
+
+bool AudioSink::open(const std::string& path, uint32_t sampleRate)
+{
+    close();
+    out.open(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cout << "Error opening audio file " << path << '\n';
+        return false;
+    }
+    wav = endsWith(path, ".wav");
+    this->sampleRate = sampleRate;
+    samplesWritten = 0;
+    hash = SaveState::hash(nullptr, 0);
+    if (wav)
+    {
+        writeWavHeader(unknownSize);
+    }
+    return true;
+}
+
+void AudioSink::close()
+{
+    if (!out.is_open())
+    {
+        return;
+    }
+    if (wav)
+    {
+        // Pipes can't seek back; their header keeps the placeholders
+        const uint64_t dataBytes = samplesWritten * sizeof(int16_t);
+        out.seekp(0);
+        if (out && dataBytes <= unknownSize - wavHeaderSize)
+        {
+            writeWavHeader(static_cast<uint32_t>(dataBytes));
+        }
+        out.clear();
+    }
+    out.close();
+}
+
+void AudioSink::write(const int16_t* samples, size_t count)
+{
+    // WAV and raw output are both little-endian, as is every host this
+    // builds for
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(samples);
+    out.write(reinterpret_cast<const char*>(bytes), static_cast<std::streamsize>(count * sizeof(int16_t)));
+    samplesWritten += count;
+    hash = SaveState::hash(bytes, count * sizeof(int16_t), hash);
+}
+
+void AudioSink::writeWavHeader(uint32_t dataBytes)
+{
+    const uint32_t blockAlign = channels * bitsPerSample / 8;
+    char header[wavHeaderSize];
+    std::copy_n("RIFF", 4, header);
+    writeLittle(header + 4, dataBytes == unknownSize ? unknownSize : dataBytes + wavHeaderSize - 8, 4);
+    std::copy_n("WAVEfmt ", 8, header + 8);
+    writeLittle(header + 16, 16, 4);
+    writeLittle(header + 20, pcmFormat, 2);
+    writeLittle(header + 22, channels, 2);
+    writeLittle(header + 24, sampleRate, 4);
+    writeLittle(header + 28, sampleRate * blockAlign, 4);
+    writeLittle(header + 32, blockAlign, 2);
+    writeLittle(header + 34, bitsPerSample, 2);
+    std::copy_n("data", 4, header + 36);
+    writeLittle(header + 40, dataBytes, 4);
+    out.write(header, wavHeaderSize);
+}
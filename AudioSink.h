@@ -0,0 +1,49 @@
+#ifndef AUDIOSINK_HXX
+#define AUDIOSINK_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fstream>
+#include <string>
+
+// Streams mono 16-bit PCM as it's produced, a frame's worth at a time. A
+// path ending in .wav gets a WAV header; anything else gets raw
+// little-endian samples, e.g. for a named pipe into a player. The WAV
+// header's sizes are filled in on close when the file can seek; until then
+// they're the streaming placeholder, so a reader can start on the data
+// while it's still being written.
+class AudioSink {
+
+public:
+    AudioSink();
+    ~AudioSink();
+
+    AudioSink(const AudioSink&) = delete;
+    AudioSink& operator=(const AudioSink&) = delete;
+
+    // Start writing to path. Returns false if it can't be opened.
+    bool open(const std::string& path, uint32_t sampleRate);
+
+    // Finish the header and close the file
+    void close();
+
+    void write(const int16_t* samples, size_t count);
+
+    uint32_t getSampleRate() const { return sampleRate; }
+
+    uint64_t getSamplesWritten() const { return samplesWritten; }
+
+    // Hash of every sample written, to compare runs
+    uint64_t getHash() const { return hash; }
+
+private:
+    void writeWavHeader(uint32_t dataBytes);
+
+    std::ofstream out;
+    bool wav;
+    uint32_t sampleRate;
+    uint64_t samplesWritten;
+    uint64_t hash;
+};
+
+#endif
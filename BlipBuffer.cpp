@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cmath>
+#include "BlipBuffer.h"
+
+namespace {
+
+const double pi = 3.14159265358979323846;
+
+// Cutoff as a fraction of the sample rate, a little under Nyquist so the
+// short kernel has room to roll off
+const double cutoff = 0.45;
+
+struct Kernel {
+    int32_t taps[NesApu::BlipBuffer::numPhases][NesApu::BlipBuffer::kernelWidth];
+};
+
+Kernel makeKernel()
+{
+    const uint32_t width = NesApu::BlipBuffer::kernelWidth;
+    const double halfWidth = width / 2.0;
+    const int32_t unit = 1 << NesApu::BlipBuffer::kernelBits;
+
+    Kernel kernel{};
+    for (uint32_t phase = 0; phase < NesApu::BlipBuffer::numPhases; ++phase)
+    {
+        // Tap i is i + 1 - halfWidth samples from the centre of the impulse,
+        // less the step's fraction of a sample
+        const double fraction = static_cast<double>(phase) / NesApu::BlipBuffer::numPhases;
+        double values[width];
+        double sum = 0;
+        for (uint32_t i = 0; i < width; ++i)
+        {
+            const double x = i + 1 - halfWidth - fraction;
+            const double sinc = (x == 0) ? 2 * cutoff : std::sin(2 * pi * cutoff * x) / (pi * x);
+            // Blackman window over the kernel's span
+            const double w = (x + halfWidth) / width;
+            const double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+            values[i] = sinc * window;
+            sum += values[i];
+        }
+
+        // Round each tap and give the rounding error to the largest, so the
+        // phase sums to exactly one
+        int32_t total = 0;
+        uint32_t largest = 0;
+        for (uint32_t i = 0; i < width; ++i)
+        {
+            kernel.taps[phase][i] = static_cast<int32_t>(std::lround(values[i] / sum * unit));
+            total += kernel.taps[phase][i];
+            if (kernel.taps[phase][i] > kernel.taps[phase][largest])
+            {
+                largest = i;
+            }
+        }
+        kernel.taps[phase][largest] += unit - total;
+    }
+    return kernel;
+}
+
+const Kernel& getKernel()
+{
+    static const Kernel kernel = makeKernel();
+    return kernel;
+}
+
+}
+
+NesApu::BlipBuffer::BlipBuffer() : factor{}
+    , offset{}
+    , integrator{}
+    , sampleRate{}
+    , samples{}
+{
+}
+
+void NesApu::BlipBuffer::setRates(double clockRate, uint32_t sampleRate, uint32_t maxFrameClocks)
+{
+    this->sampleRate = sampleRate;
+    factor = static_cast<uint64_t>(std::llround(sampleRate / clockRate * std::ldexp(1.0, fractionBits)));
+    const size_t frameSamples = static_cast<size_t>((static_cast<uint64_t>(maxFrameClocks) * factor) >> fractionBits);
+    samples.assign(frameSamples + 2 * kernelWidth, 0);
+    clear();
+}
+
+void NesApu::BlipBuffer::addDelta(uint32_t time, int32_t delta)
+{
+    const uint64_t position = offset + time * factor;
+    const size_t index = static_cast<size_t>(position >> fractionBits);
+    if (index + kernelWidth > samples.size())
+    {
+        // Past the end of the buffer; the frame ran too long
+        return;
+    }
+    const int32_t* taps = getKernel().taps[(position >> (fractionBits - phaseBits)) & (numPhases - 1)];
+    int32_t* out = samples.data() + index;
+    for (uint32_t i = 0; i < kernelWidth; ++i)
+    {
+        out[i] += taps[i] * delta;
+    }
+}
+
+void NesApu::BlipBuffer::endFrame(uint32_t time)
+{
+    offset += time * factor;
+}
+
+uint32_t NesApu::BlipBuffer::readSamples(int16_t* out, uint32_t count)
+{
+    count = std::min(count, samplesAvailable());
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        integrator += samples[i];
+        const int32_t sample = integrator >> kernelBits;
+        out[i] = static_cast<int16_t>(std::max(-32768, std::min(32767, sample)));
+        integrator -= sample * (1 << (kernelBits - bassShift));
+    }
+
+    // Impulses of steps near the end of the frame reach into samples that
+    // aren't available yet
+    std::copy(samples.begin() + count, samples.end(), samples.begin());
+    std::fill(samples.end() - count, samples.end(), 0);
+    offset -= static_cast<uint64_t>(count) << fractionBits;
+    return count;
+}
+
+void NesApu::BlipBuffer::clear()
+{
+    offset = 0;
+    integrator = 0;
+    std::fill(samples.begin(), samples.end(), 0);
+}
@@ -0,0 +1,78 @@
+#ifndef BLIPBUFFER_HXX
+#define BLIPBUFFER_HXX
+
+#include <stdint.h>
+#include <vector>
+
+namespace NesApu
+{
+
+// Turns a signal given as steps at clock times into samples at the output
+// rate without aliasing. Each step is added as a band-limited impulse (a
+// windowed sinc, picked from a table by the step's position between two
+// samples), and reading integrates the impulses back into steps. The work
+// is per step rather than per clock, so a square wave that changes a few
+// thousand times a frame costs a few thousand kernel adds however fast the
+// clock is.
+class BlipBuffer {
+
+public:
+    BlipBuffer();
+
+    // Clock ticks and output samples per second. Holds up to maxFrameClocks
+    // of clock time between endFrame() and reading. Clears the buffer.
+    void setRates(double clockRate, uint32_t sampleRate, uint32_t maxFrameClocks);
+
+    uint32_t getSampleRate() const { return sampleRate; }
+
+    // Add a step of delta at time clocks since the start of the frame.
+    // Steps after the frame's end are fine as long as they're within
+    // maxFrameClocks of its start.
+    void addDelta(uint32_t time, int32_t delta);
+
+    // End the frame time clocks after its start, making the samples before
+    // that point available. Steps still to come must be timed from there.
+    void endFrame(uint32_t time);
+
+    uint32_t samplesAvailable() const { return static_cast<uint32_t>(offset >> fractionBits); }
+
+    // Take up to count samples, with the DC level filtered out. Returns how
+    // many were written.
+    uint32_t readSamples(int16_t* out, uint32_t count);
+
+    // Drop everything in the buffer and go back to silence
+    void clear();
+
+    // The kernel spans this many samples, starting at the step. The output
+    // lags the input by half of it.
+    static const uint32_t kernelWidth = 16;
+
+    // Positions between two samples the kernel is tabulated for
+    static const uint32_t phaseBits = 6;
+    static const uint32_t numPhases = 1u << phaseBits;
+
+    // Kernel taps are fixed point with this many fraction bits, and each
+    // phase sums to exactly one so a step integrates to its full height
+    static const uint32_t kernelBits = 14;
+
+private:
+    // Sample positions are 32.32 fixed point
+    static const uint32_t fractionBits = 32;
+
+    // The DC filter takes away 1/2^bassShift of the level each sample
+    static const uint32_t bassShift = 9;
+
+    // clock ticks to sample positions
+    uint64_t factor;
+    // Position of the frame start, in samples from the first unread one
+    uint64_t offset;
+    // Running sum of the impulses read so far
+    int32_t integrator;
+    uint32_t sampleRate;
+
+    std::vector<int32_t> samples;
+};
+
+}
+
+#endif
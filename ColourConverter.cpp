@@ -0,0 +1,238 @@
+#include <cstring>
+#include "ColourConverter.h"
+#include "Simd.h"
+
+namespace {
+
+// The 2C02's 64 colours as 0xRRGGBB
+const uint32_t nesColours[64] = {
+    0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00,
+    0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+    0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00,
+    0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+    0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22,
+    0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+    0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5,
+    0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000
+};
+
+// Each emphasis bit dims the two channels it doesn't name by about this much
+const double emphasisAttenuation = 0.816;
+
+// Emphasis bits of $2001, shifted down to 0-7: red, green, blue
+const uint32_t emphasisShift = 5;
+
+const uint32_t numColours = 64;
+const uint8_t opaque = 0xFF;
+
+#if NES_HAVE_SSSE3
+// Indices of 16 colours (0-63) for each quarter of a 64-byte plane.
+// pshufb only indexes 16 bytes, so each quarter is looked up in turn with
+// the index biased so anything outside that quarter has its top bit set
+// and reads 0. The biased indices are the same for every plane.
+struct QuarterIndices {
+    __m128i quarter[4];
+};
+
+NES_TARGET("ssse3") inline QuarterIndices quarterIndices(__m128i index)
+{
+    const __m128i bias = _mm_set1_epi8(0x70);
+    QuarterIndices indices;
+    for (uint32_t quarter = 0; quarter < 4; ++quarter)
+    {
+        indices.quarter[quarter] = _mm_adds_epu8(_mm_sub_epi8(index, _mm_set1_epi8(static_cast<char>(quarter * 16))), bias);
+    }
+    return indices;
+}
+
+NES_TARGET("ssse3") inline __m128i lookupPlane(const uint8_t* plane, const QuarterIndices& indices)
+{
+    __m128i result = _mm_setzero_si128();
+    for (uint32_t quarter = 0; quarter < 4; ++quarter)
+    {
+        const __m128i table = _mm_load_si128(reinterpret_cast<const __m128i*>(plane + quarter * 16));
+        result = _mm_or_si128(result, _mm_shuffle_epi8(table, indices.quarter[quarter]));
+    }
+    return result;
+}
+
+// Sixteen pixels a step: look up the three colour bytes as planes and
+// interleave them with alpha
+NES_TARGET("ssse3") void convertLine32Ssse3(const uint8_t (*planes)[64], const uint8_t* pixels, uint8_t* out)
+{
+    const __m128i alpha = _mm_set1_epi8(static_cast<char>(opaque));
+    for (uint32_t x = 0; x < NesPpu::screenWidth; x += 16)
+    {
+        const QuarterIndices indices = quarterIndices(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x)));
+        const __m128i byte0 = lookupPlane(planes[0], indices);
+        const __m128i byte1 = lookupPlane(planes[1], indices);
+        const __m128i byte2 = lookupPlane(planes[2], indices);
+        const __m128i low01 = _mm_unpacklo_epi8(byte0, byte1);
+        const __m128i high01 = _mm_unpackhi_epi8(byte0, byte1);
+        const __m128i low23 = _mm_unpacklo_epi8(byte2, alpha);
+        const __m128i high23 = _mm_unpackhi_epi8(byte2, alpha);
+        __m128i* row = reinterpret_cast<__m128i*>(out + x * 4);
+        _mm_store_si128(row, _mm_unpacklo_epi16(low01, low23));
+        _mm_store_si128(row + 1, _mm_unpackhi_epi16(low01, low23));
+        _mm_store_si128(row + 2, _mm_unpacklo_epi16(high01, high23));
+        _mm_store_si128(row + 3, _mm_unpackhi_epi16(high01, high23));
+    }
+}
+
+// Sixteen pixels a step, looking up the low and high bytes as planes
+NES_TARGET("ssse3") void convertLine16Ssse3(const uint8_t (*planes)[64], const uint8_t* pixels, uint8_t* out)
+{
+    for (uint32_t x = 0; x < NesPpu::screenWidth; x += 16)
+    {
+        const QuarterIndices indices = quarterIndices(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x)));
+        const __m128i low = lookupPlane(planes[0], indices);
+        const __m128i high = lookupPlane(planes[1], indices);
+        __m128i* row = reinterpret_cast<__m128i*>(out + x * 2);
+        _mm_store_si128(row, _mm_unpacklo_epi8(low, high));
+        _mm_store_si128(row + 1, _mm_unpackhi_epi8(low, high));
+    }
+}
+#endif
+
+#if NES_HAVE_AVX2
+// Eight pixels a step, gathering whole colours
+NES_TARGET("avx2") void convertLine32Avx2(const uint32_t* colours, const uint8_t* pixels, uint8_t* out)
+{
+    const int* table = reinterpret_cast<const int*>(colours);
+    for (uint32_t x = 0; x < NesPpu::screenWidth; x += 8)
+    {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixels + x)));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(out + x * 4), _mm256_i32gather_epi32(table, index, 4));
+    }
+}
+#endif
+}
+
+uint32_t NesPpu::bytesPerPixel(PixelFormat format)
+{
+    return format == rgb565 ? 2 : 4;
+}
+
+NesPpu::ColourConverter::ColourConverter(PixelFormat format) : format{format}
+    , useSsse3{Simd::cpuHasSsse3()}
+    , useAvx2{Simd::cpuHasAvx2()}
+    , colours{}
+    , planes{}
+{
+    for (uint32_t emphasis = 0; emphasis < 8; ++emphasis)
+    {
+        for (uint32_t colour = 0; colour < numColours; ++colour)
+        {
+            uint8_t rgb[3] = {
+                static_cast<uint8_t>(nesColours[colour] >> 16),
+                static_cast<uint8_t>(nesColours[colour] >> 8),
+                static_cast<uint8_t>(nesColours[colour])
+            };
+            for (uint32_t channel = 0; channel < 3; ++channel)
+            {
+                double level = rgb[channel];
+                for (uint32_t bit = 0; bit < 3; ++bit)
+                {
+                    if (bit != channel && (emphasis & (1u << bit)))
+                    {
+                        level *= emphasisAttenuation;
+                    }
+                }
+                rgb[channel] = static_cast<uint8_t>(level + 0.5);
+            }
+
+            uint8_t bytes[4] = {};
+            if (format == rgba8888)
+            {
+                bytes[0] = rgb[0];
+                bytes[1] = rgb[1];
+                bytes[2] = rgb[2];
+                bytes[3] = opaque;
+            }
+            else if (format == bgra8888)
+            {
+                bytes[0] = rgb[2];
+                bytes[1] = rgb[1];
+                bytes[2] = rgb[0];
+                bytes[3] = opaque;
+            }
+            else
+            {
+                const uint16_t word = static_cast<uint16_t>((rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3);
+                bytes[0] = static_cast<uint8_t>(word);
+                bytes[1] = static_cast<uint8_t>(word >> 8);
+            }
+
+            std::memcpy(&colours[emphasis][colour], bytes, sizeof(bytes));
+            for (uint32_t plane = 0; plane < 4; ++plane)
+            {
+                planes[emphasis][plane][colour] = bytes[plane];
+            }
+        }
+    }
+}
+
+bool NesPpu::ColourConverter::convert(const Frame& frame, uint8_t* out, size_t pitch) const
+{
+    if (reinterpret_cast<uintptr_t>(out) % imageAlignment != 0 || pitch % imageAlignment != 0
+        || pitch < screenWidth * bytesPerPixel(format))
+    {
+        return false;
+    }
+
+    for (uint32_t line = 0; line < screenHeight; ++line)
+    {
+        convertLine(frame.pixels + line * screenWidth, frame.emphasis[line], out + line * pitch);
+    }
+    return true;
+}
+
+void NesPpu::ColourConverter::convertLine(const uint8_t* pixels, uint8_t emphasis, uint8_t* out) const
+{
+    const uint32_t setting = (emphasis & maskEmphasis) >> emphasisShift;
+    if (format == rgb565)
+    {
+        convertLine16(pixels, setting, out);
+    }
+    else
+    {
+        convertLine32(pixels, setting, out);
+    }
+}
+
+void NesPpu::ColourConverter::convertLine32(const uint8_t* pixels, uint32_t emphasis, uint8_t* out) const
+{
+#if NES_HAVE_AVX2
+    if (useAvx2)
+    {
+        convertLine32Avx2(colours[emphasis], pixels, out);
+        return;
+    }
+#endif
+#if NES_HAVE_SSSE3
+    if (useSsse3)
+    {
+        convertLine32Ssse3(planes[emphasis], pixels, out);
+        return;
+    }
+#endif
+    for (uint32_t x = 0; x < screenWidth; ++x)
+    {
+        std::memcpy(out + x * 4, &colours[emphasis][pixels[x]], 4);
+    }
+}
+
+void NesPpu::ColourConverter::convertLine16(const uint8_t* pixels, uint32_t emphasis, uint8_t* out) const
+{
+#if NES_HAVE_SSSE3
+    if (useSsse3)
+    {
+        convertLine16Ssse3(planes[emphasis], pixels, out);
+        return;
+    }
+#endif
+    for (uint32_t x = 0; x < screenWidth; ++x)
+    {
+        std::memcpy(out + x * 2, &colours[emphasis][pixels[x]], 2);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef COLOURCONVERTER_HXX
+#define COLOURCONVERTER_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include "Ppu.h"
+
+namespace NesPpu
+{
+
+// Layouts of converted pixels, named by byte order in memory. RGB565 is one
+// little-endian 16-bit word per pixel.
+enum PixelFormat : uint8_t
+{
+    rgba8888,
+    bgra8888,
+    rgb565
+};
+
+uint32_t bytesPerPixel(PixelFormat format);
+
+// Output buffers and rows must start on 64-byte boundaries
+static const size_t imageAlignment = 64;
+
+// A converted frame in any of the formats, for callers without a buffer
+// of their own
+struct Image {
+    alignas(imageAlignment) uint8_t bytes[screenHeight * screenWidth * 4];
+};
+
+// Turns finished frames of NES colours into RGB, applying each line's
+// emphasis bits. The colours of all eight emphasis settings are worked out
+// up front in the target format. Lines go through the widest lookup the
+// CPU has, chosen at run time, so plain builds get the vector paths too.
+class ColourConverter {
+
+public:
+    explicit ColourConverter(PixelFormat format);
+
+    PixelFormat getFormat() const { return format; }
+
+    // Convert a whole frame into out, pitch bytes from one row to the next.
+    // Returns false without writing if out or pitch isn't 64-byte aligned
+    // or pitch is shorter than a row.
+    bool convert(const Frame& frame, uint8_t* out, size_t pitch) const;
+
+    // Convert one line of 256 pixels drawn with the given emphasis bits
+    // into a 64-byte aligned row
+    void convertLine(const uint8_t* pixels, uint8_t emphasis, uint8_t* out) const;
+
+private:
+    void convertLine32(const uint8_t* pixels, uint32_t emphasis, uint8_t* out) const;
+    void convertLine16(const uint8_t* pixels, uint32_t emphasis, uint8_t* out) const;
+
+    PixelFormat format;
+
+    // Vector paths the CPU can take, whatever the build targets
+    bool useSsse3;
+    bool useAvx2;
+
+    // Each colour as one output pixel, in the low 16 bits for RGB565
+    alignas(64) uint32_t colours[8][64];
+
+    // The same colours split into byte planes for shuffle lookups: plane n
+    // holds byte n of every colour
+    alignas(64) uint8_t planes[8][4][64];
+};
+
+}
+
+#endif
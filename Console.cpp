@@ -1,18 +1,359 @@
 #include <iostream>
+#include <algorithm>
+#include <sstream>
 #include "Console.h"
+#include "SaveState.h"
+#include "FramePipeline.h"
 
-void Console::initialize()
+void Console::initialize(const std::string& romPath)
+{
+    nesReader.setFilename(romPath);
+    start();
+}
+
+void Console::initialize(std::shared_ptr<const RomImage> romImage)
+{
+    nesReader.setRomImage(std::move(romImage));
+    start();
+}
+
+void Console::start()
 {
-    nesReader.setFilename("Contra (USA).nes");
     nesReader.initialize(mapper);
-    NesMapper::MapperInfo mapperInfo = mapper.getMapperInfo();
-    NesReader::uint8Vec* cartridgeData = nesReader.getCartridgeData();
-    mapper.initialize(*cartridgeData, memory);
+    mapper.initialize(nesReader.getCartridgeData(), memory, ppu);
     cpu.reset(memory);
+    apu.reset();
+    targetCycle = cpu.cycles;
+    frameStartCycle = cpu.cycles;
+    nextFrameEvent = vblankStart;
+}
+
+bool Console::setTracer(Tracer* tracer)
+{
+    if (tracer)
+    {
+        tracer->setClock(&cpu.cycles, &cpu.PC);
+    }
+    return memory.setTracer(tracer);
+}
+
+void Console::setDebugger(Debugger* debugger)
+{
+    if (debugger)
+    {
+        debugger->setClock(&cpu.cycles);
+        debugger->takeWatchChanges();
+    }
+    cpu.setDebugger(debugger);
+    memory.setDebugger(debugger);
+}
+
+void Console::setFrame(NesPpu::Frame* frame)
+{
+    outputFrame = frame;
+    selectFrame();
+}
+
+void Console::setFramePipeline(FramePipeline* pipeline)
+{
+    framePipeline = pipeline;
+    setFrame(pipeline ? pipeline->getBackFrame() : nullptr);
+}
+
+void Console::setFrameSkip(uint32_t skip)
+{
+    frameSkip = skip;
+    selectFrame();
+}
+
+void Console::selectFrame()
+{
+    const bool drawn = (frameCount + 1) % (static_cast<uint64_t>(frameSkip) + 1) == 0;
+    ppu.setFrame(drawn ? outputFrame : nullptr);
+}
+
+void Console::mapIo()
+{
+    IoHandler ppuHandler{};
+    ppuHandler.read = [](void* context, uint16_t address)
+    {
+        return static_cast<Console*>(context)->ppu.readRegister(address);
+    };
+    ppuHandler.write = [](void* context, uint16_t address, uint8_t value)
+    {
+        Console& console = *static_cast<Console*>(context);
+        console.ppu.writeRegister(address, value);
+        // Control, mask and OAM writes can bring the next $2002 change
+        // forward, so the CPU stops to pick it up
+        const uint16_t reg = address & 7;
+        if (reg <= (NesPpu::oamDataRegister & 7) && reg != (NesPpu::ppuStatusRegister & 7))
+        {
+            console.cpu.requestStop();
+        }
+    };
+    ppuHandler.context = this;
+    memory.mapIo(NesPpu::ppuControlRegister1, NesPpu::ppuRegisterEnd, ppuHandler);
+
+    memory.mapIo(apuIoStart, apuIoEnd, IoHandler{&Console::readIo, &Console::writeIo, this});
+}
+
+uint8_t Console::readIo(void* context, uint16_t address)
+{
+    Console& console = *static_cast<Console*>(context);
+    switch (address)
+    {
+    case NesApu::statusRegister:
+    {
+        console.syncApu();
+        const uint8_t value = console.apu.readStatus();
+        console.cpu.setIRQ(console.apu.irqAsserted());
+        return value;
+    }
+    case controller1Register:
+    case controller2Register:
+    {
+        // Buttons shift out A first. After eight reads the port returns 1s.
+        const uint32_t port = address - controller1Register;
+        if (console.controllerStrobe)
+        {
+            console.controllerShift[port] = console.controllerState[port];
+        }
+        const uint8_t bit = console.controllerShift[port] & 1;
+        console.controllerShift[port] = (console.controllerShift[port] >> 1) | 0x80;
+        // The upper bits are open bus
+        return 0x40 | bit;
+    }
+    default:
+        // The other APU registers are write-only
+        return static_cast<uint8_t>(address >> 8);
+    }
+}
+
+void Console::writeIo(void* context, uint16_t address, uint8_t value)
+{
+    Console& console = *static_cast<Console*>(context);
+    switch (address)
+    {
+    case oamDmaRegister:
+    {
+        // Copy a CPU page into sprite memory while the CPU is halted
+        const uint16_t source = value << 8;
+        console.ppu.catchUp();
+        for (uint32_t i = 0; i < NesPpu::oamSize; ++i)
+        {
+            console.ppu.writeOam(console.memory.read(source + i));
+        }
+        console.cpu.cycles += oamDmaCycles + (console.cpu.cycles & 1);
+        console.cpu.requestStop();
+        break;
+    }
+    case controller1Register:
+        // While the strobe is high the shift registers keep reloading
+        console.controllerStrobe = (value & 1) != 0;
+        if (console.controllerStrobe)
+        {
+            console.controllerShift[0] = console.controllerState[0];
+            console.controllerShift[1] = console.controllerState[1];
+        }
+        break;
+    default:
+        if (address <= NesApu::registerEnd || address == NesApu::statusRegister
+            || address == NesApu::frameCounterRegister)
+        {
+            console.syncApu();
+            console.apu.writeRegister(address, value);
+            console.syncApu();
+            // The DMC rate, enable and frame counter move the next IRQ or
+            // fetch, so the CPU stops to pick it up
+            if (address == NesApu::dmcControlRegister || address == NesApu::statusRegister
+                || address == NesApu::frameCounterRegister)
+            {
+                console.cpu.requestStop();
+            }
+        }
+        break;
+    }
+}
 
+void Console::run(int64_t cycleBudget)
+{
+    targetCycle += cycleBudget;
+    while (static_cast<int64_t>(targetCycle - cpu.cycles) > 0)
+    {
+        // Idle loops are fast-forwarded no further than the end of each run,
+        // so stopping at the next event is what bounds the skip
+        const uint64_t nextEvent = std::min({eventCycle(nextFrameEvent), ppuSyncCycle(), apu.nextSyncCycle()});
+        const uint64_t stopCycle = std::min(targetCycle, nextEvent);
+        if (stopCycle > cpu.cycles)
+        {
+            cpu.run(memory, static_cast<int64_t>(stopCycle - cpu.cycles));
+        }
+        if (cpu.debugger && cpu.debugger->isStopped())
+        {
+            return;
+        }
+
+        ppu.catchUp();
+        syncApu();
+        while (cpu.cycles >= eventCycle(nextFrameEvent))
+        {
+            handleFrameEvent(nextFrameEvent);
+        }
+    }
+}
+
+uint64_t Console::eventCycle(FrameEvent event) const
+{
+    switch (event)
+    {
+    case vblankStart:
+        return frameStartCycle + vblankStartCycle;
+    case vblankEnd:
+        return frameStartCycle + vblankEndCycle;
+    default:
+        return frameStartCycle + cpuCyclesPerFrame;
+    }
+}
+
+uint64_t Console::ppuSyncCycle()
+{
+    const uint32_t dot = ppu.nextSyncDot();
+    if (dot == NesPpu::Ppu::noSync)
+    {
+        return UINT64_MAX;
+    }
+    // The first CPU cycle whose dots reach it
+    return frameStartCycle + (dot + 2) / 3;
+}
 
-    cpu.setupOpcodes();
-    cpu.opcodeInfoArray[0].operation(cpu,memory,0);
+void Console::syncApu()
+{
+    apu.catchUp();
+    cpu.cycles += apu.takeStallCycles();
+    cpu.setIRQ(apu.irqAsserted());
+}
+
+void Console::handleFrameEvent(FrameEvent event)
+{
+    switch (event)
+    {
+    case vblankStart:
+        ppu.beginVblank();
+        if (ppu.nmiEnabled())
+        {
+            cpu.triggerNMI();
+        }
+        nextFrameEvent = vblankEnd;
+        break;
+    case vblankEnd:
+        ppu.endVblank();
+        nextFrameEvent = frameEnd;
+        break;
+    default:
+        ppu.endFrame();
+        apu.endFrame();
+        if (ppu.getFrame())
+        {
+            if (framePipeline)
+            {
+                outputFrame = framePipeline->publish();
+            }
+            ++renderedFrameCount;
+        }
+        ++frameCount;
+        selectFrame();
+        frameStartCycle += cpuCyclesPerFrame;
+        nextFrameEvent = vblankStart;
+        break;
+    }
+}
 
-    std::cout << "end\n";
-}
\ No newline at end of file
+void Console::saveState(std::ostream& out)
+{
+    SaveState::write(out, SaveState::magic);
+    SaveState::write(out, SaveState::version);
+    cpu.saveState(out);
+    memory.saveState(out);
+    ppu.saveState(out);
+    apu.saveState(out);
+    mapper.saveState(out);
+    saveFields(out);
+}
+
+bool Console::loadState(std::istream& in)
+{
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    if (!SaveState::read(in, magic) || !SaveState::read(in, version)
+        || magic != SaveState::magic || version != SaveState::version)
+    {
+        std::cout << "Invalid save state\n";
+        return false;
+    }
+
+    if (!cpu.loadState(in) || !memory.loadState(in) || !ppu.loadState(in) || !apu.loadState(in)
+        || !mapper.loadState(in) || !loadFields(in))
+    {
+        std::cout << "Truncated save state\n";
+        return false;
+    }
+    return true;
+}
+
+void Console::snapshot(StateSnapshot& snapshot)
+{
+    std::ostringstream registers;
+    cpu.saveState(registers);
+    ppu.saveRegisters(registers);
+    apu.saveState(registers);
+    mapper.saveState(registers);
+    saveFields(registers);
+    snapshot.registers = registers.str();
+    memory.capture(snapshot);
+    ppu.capture(snapshot);
+}
+
+bool Console::restore(const StateSnapshot& snapshot)
+{
+    std::istringstream registers(snapshot.registers);
+    if (!cpu.loadState(registers) || !ppu.loadRegisters(registers) || !apu.loadState(registers)
+        || !mapper.loadState(registers) || !loadFields(registers) || !memory.restore(snapshot)
+        || !ppu.restore(snapshot))
+    {
+        std::cout << "Invalid snapshot\n";
+        return false;
+    }
+    return true;
+}
+
+void Console::saveFields(std::ostream& out) const
+{
+    SaveState::write(out, targetCycle);
+    SaveState::write(out, frameStartCycle);
+    SaveState::write(out, static_cast<uint8_t>(nextFrameEvent));
+    SaveState::write(out, frameCount);
+    SaveState::write(out, controllerState);
+    SaveState::write(out, controllerShift);
+    SaveState::write(out, controllerStrobe);
+}
+
+bool Console::loadFields(std::istream& in)
+{
+    uint8_t event = 0;
+    if (!SaveState::read(in, targetCycle) || !SaveState::read(in, frameStartCycle)
+        || !SaveState::read(in, event) || !SaveState::read(in, frameCount)
+        || !SaveState::read(in, controllerState) || !SaveState::read(in, controllerShift)
+        || !SaveState::read(in, controllerStrobe))
+    {
+        return false;
+    }
+    nextFrameEvent = static_cast<FrameEvent>(event);
+    selectFrame();
+    return true;
+}
+
+uint64_t Console::hashRam()
+{
+    // $0000-$07FF, mirrored up to $1FFF
+    return SaveState::hash(memory.getAddress(0), 0x800);
+}
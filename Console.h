@@ -4,8 +4,43 @@
 #include "Cpu.h"
 #include "Memory.h"
 #include "Ppu.h"
+#include "Apu.h"
 #include "NesReader.h"
 #include "Mapper.h"
+#include "Snapshot.h"
+#include <string>
+#include <memory>
+#include <istream>
+#include <ostream>
+
+// NTSC CPU cycles per frame (341 PPU dots * 262 scanlines / 3)
+static const int64_t cpuCyclesPerFrame = 29781;
+
+// CPU cycles from the start of a frame to the start of VBlank (scanline
+// 241) and to its end on the pre-render scanline (261)
+static const int64_t vblankStartCycle = (241 * 341 + 1) / 3;
+static const int64_t vblankEndCycle = (261 * 341 + 1) / 3;
+
+// APU and I/O registers
+static const uint16_t apuIoStart = 0x4000;
+static const uint16_t apuIoEnd = 0x40FF;
+static const uint16_t oamDmaRegister = 0x4014;
+static const uint16_t controller1Register = 0x4016;
+static const uint16_t controller2Register = 0x4017;
+
+// OAM DMA halts the CPU for 513 cycles, plus one when it starts on an odd cycle
+static const uint64_t oamDmaCycles = 513;
+
+class FramePipeline;
+class AudioSink;
+
+// Events the console schedules within each frame, in order
+enum FrameEvent
+{
+    vblankStart,
+    vblankEnd,
+    frameEnd
+};
 
 class Console {
 
@@ -13,19 +48,162 @@ public:
     Console() : cpu{}
         , memory{}
         , ppu{}
+        , apu{}
         , nesReader{}
         , mapper{}
-    {}
+        , targetCycle{}
+        , frameStartCycle{}
+        , nextFrameEvent{vblankStart}
+        , frameCount{}
+        , framePipeline{}
+        , outputFrame{}
+        , frameSkip{}
+        , renderedFrameCount{}
+        , controllerState{}
+        , controllerShift{}
+        , controllerStrobe{}
+    {
+        mapIo();
+        ppu.setClock(&cpu.cycles, &frameStartCycle);
+        apu.setClock(&cpu.cycles);
+        apu.setMemory(&memory);
+    }
+
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    // Load a ROM and reset the CPU
+    void initialize(const std::string& romPath);
+
+    // Run a ROM that is already loaded. Consoles can share one image.
+    void initialize(std::shared_ptr<const RomImage> romImage);
+
+    // Run the CPU for the given number of cycles. Cycles that a previous
+    // call ran past its budget are deducted so the long-run rate is exact.
+    // The CPU stops at each frame event so it sees VBlank and NMI on time,
+    // where $2002 can change by itself, and where an APU IRQ or DMC fetch
+    // is due. Scanline and APU work is otherwise caught up lazily when the
+    // CPU touches the PPU or APU, the mapper switches CHR, at those stops
+    // and at the end of the run.
+    void run(int64_t cycleBudget);
+
+    const NesCpu::Cpu& getCpu() const { return cpu; }
+
+    void setJitEnabled(bool enabled) { cpu.setJitEnabled(enabled); }
+
+    void setIdleSkipEnabled(bool enabled) { cpu.setIdleSkipEnabled(enabled); }
+
+    // Trace bus accesses, stamped with the CPU's cycle count and PC, or stop
+    // with null. Returns false in builds without NES_TRACE.
+    bool setTracer(Tracer* tracer);
+
+    // Attach a debugger to the CPU and bus, or detach with null. run()
+    // returns early when it stops; the rest of the budget carries over to
+    // the next run() after Debugger::resume().
+    void setDebugger(Debugger* debugger);
+
+    // Draw frames into frame, or run headless with null (the default).
+    // A frame is complete when getFrameCount() goes up.
+    void setFrame(NesPpu::Frame* frame);
+
+    // Draw into the pipeline's back frame and publish each one as it's
+    // completed, or go back to headless with null
+    void setFramePipeline(FramePipeline* pipeline);
+
+    // Draw only the last frame of every skip + 1 and run the others
+    // headless. Skipped frames still time VBlank, NMI, sprite 0 hit and
+    // sprite overflow exactly; they leave out background and sprite pixels.
+    void setFrameSkip(uint32_t skip);
+
+    // Whether the frame in progress is being drawn
+    bool isDrawingFrame() const { return ppu.getFrame() != nullptr; }
 
-    void initialize();
+    // Frames completed with pixels since initialize()
+    uint64_t getRenderedFrameCount() const { return renderedFrameCount; }
+
+    // Send each frame's audio to sink, or run silent with null (the
+    // default). The sink's sample rate is used from here on.
+    void setAudioSink(AudioSink* sink) { apu.setSink(sink); }
+
+    // Draw from a cache of decoded CHR tiles (the default) or straight from
+    // the bitplanes
+    void setTileCacheEnabled(bool enabled) { ppu.setTileCacheEnabled(enabled); }
+
+    // Frames completed since initialize()
+    uint64_t getFrameCount() const { return frameCount; }
+
+    // Buttons held on a controller port, bit 0 to 7: A, B, Select, Start,
+    // Up, Down, Left, Right (the order $4016/$4017 shift them out)
+    void setController(uint32_t port, uint8_t buttons) { controllerState[port & 1] = buttons; }
+
+    // Save or restore the whole machine. Returns false on a malformed state.
+    void saveState(std::ostream& out);
+    bool loadState(std::istream& in);
+
+    // Capture the machine in memory. Only pages written since the last
+    // snapshot or restore are copied; the rest are shared with earlier
+    // snapshots, so taking one every frame is cheap.
+    void snapshot(StateSnapshot& snapshot);
+
+    // Return to a snapshot taken from a console running the same ROM.
+    // Copies back only the pages that differ.
+    bool restore(const StateSnapshot& snapshot);
+
+    // Hash of the 2 KB of internal RAM
+    uint64_t hashRam();
 
 
 private:
     NesCpu::Cpu cpu;
     Memory memory;
     NesPpu::Ppu ppu;
+    NesApu::Apu apu;
     NesReader nesReader;
     NesMapper::Mapper mapper;
+    uint64_t targetCycle;
+
+    // CPU cycle the current frame started on and the next event in it
+    uint64_t frameStartCycle;
+    FrameEvent nextFrameEvent;
+    uint64_t frameCount;
+    FramePipeline* framePipeline;
+
+    // Where drawn frames go, and how many frames are skipped between them
+    NesPpu::Frame* outputFrame;
+    uint32_t frameSkip;
+    uint64_t renderedFrameCount;
+
+    // Buttons held, and the shift registers $4016/$4017 read them out of
+    uint8_t controllerState[2];
+    uint8_t controllerShift[2];
+    bool controllerStrobe;
+
+    // Map the cartridge and reset the CPU once the ROM is loaded
+    void start();
+
+    // Install the PPU register and APU/IO handlers on the bus
+    void mapIo();
+
+    static uint8_t readIo(void* context, uint16_t address);
+    static void writeIo(void* context, uint16_t address, uint8_t value);
+
+    // Scheduler and controller fields, after the components in a state
+    void saveFields(std::ostream& out) const;
+    bool loadFields(std::istream& in);
+
+    uint64_t eventCycle(FrameEvent event) const;
+
+    // CPU cycle of the PPU's next change to $2002
+    uint64_t ppuSyncCycle();
+
+    // Catch the APU up, charge the CPU for DMC fetches and set the IRQ line
+    void syncApu();
+
+    void handleFrameEvent(FrameEvent event);
+
+    // Give the PPU the output frame if the frame in progress is drawn, or
+    // null if it's skipped
+    void selectFrame();
 
 };
 
@@ -1,71 +1,483 @@
 #include "Cpu.h"
+#include "SaveState.h"
 #include <iostream>
 
-#define MAKE_OPINFO(idx) opinfo.bytes = opcodeByteArray[idx]; \
-opinfo.operation = NesCpu::Cpu::opcodeArray[idx]
+namespace {
+
+// Everything an idle loop iteration could change
+struct IdleState {
+    uint8_t A, X, Y, SP;
+    uint16_t nzResult, carryResult;
+    uint8_t overflowLhs, overflowRhs, overflowResult;
+};
+
+IdleState captureIdleState(const NesCpu::Cpu& cpu)
+{
+    return IdleState{cpu.A, cpu.X, cpu.Y, cpu.SP, cpu.nzResult, cpu.carryResult,
+        cpu.overflowLhs, cpu.overflowRhs, cpu.overflowResult};
+}
+
+bool sameIdleState(const IdleState& a, const IdleState& b)
+{
+    return a.A == b.A && a.X == b.X && a.Y == b.Y && a.SP == b.SP
+        && a.nzResult == b.nzResult && a.carryResult == b.carryResult
+        && a.overflowLhs == b.overflowLhs && a.overflowRhs == b.overflowRhs && a.overflowResult == b.overflowResult;
+}
+
+typedef void (NesCpu::Cpu::*Handler)(Memory&, uint16_t);
+
+using NesCpu::Cpu;
+
+// Handler of an instruction with a memory operand, instantiated for the
+// addressing mode of opcode op
+#define MODE_HANDLER(name, op) &Cpu::name<NesCpu::opcodeInfoArray[op].addressMode>
+
+// Instruction handler for every opcode. Combined with opcodeInfoArray this
+// lets each Cpu::execute<Op> instantiation inline its handler directly.
+constexpr Handler opcodeHandlerArray[NesCpu::numOpcodes] = {
+    &Cpu::BRK, MODE_HANDLER(ORA, 0x01), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ORA, 0x05), MODE_HANDLER(ASL, 0x06), &Cpu::UNK, &Cpu::PHP, MODE_HANDLER(ORA, 0x09), MODE_HANDLER(ASL, 0x0A), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ORA, 0x0D), MODE_HANDLER(ASL, 0x0E), &Cpu::UNK,
+    &Cpu::BPL, MODE_HANDLER(ORA, 0x11), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ORA, 0x15), MODE_HANDLER(ASL, 0x16), &Cpu::UNK, &Cpu::CLC, MODE_HANDLER(ORA, 0x19), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ORA, 0x1D), MODE_HANDLER(ASL, 0x1E), &Cpu::UNK,
+    &Cpu::JSR, MODE_HANDLER(AND, 0x21), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(BIT, 0x24), MODE_HANDLER(AND, 0x25), MODE_HANDLER(ROL, 0x26), &Cpu::UNK, &Cpu::PLP, MODE_HANDLER(AND, 0x29), MODE_HANDLER(ROL, 0x2A), &Cpu::UNK, MODE_HANDLER(BIT, 0x2C), MODE_HANDLER(AND, 0x2D), MODE_HANDLER(ROL, 0x2E), &Cpu::UNK,
+    &Cpu::BMI, MODE_HANDLER(AND, 0x31), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(AND, 0x35), MODE_HANDLER(ROL, 0x36), &Cpu::UNK, &Cpu::SEC, MODE_HANDLER(AND, 0x39), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(AND, 0x3D), MODE_HANDLER(ROL, 0x3E), &Cpu::UNK,
+    &Cpu::RTI, MODE_HANDLER(EOR, 0x41), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(EOR, 0x45), MODE_HANDLER(LSR, 0x46), &Cpu::UNK, &Cpu::PHA, MODE_HANDLER(EOR, 0x49), MODE_HANDLER(LSR, 0x4A), &Cpu::UNK, &Cpu::JMP, MODE_HANDLER(EOR, 0x4D), MODE_HANDLER(LSR, 0x4E), &Cpu::UNK,
+    &Cpu::BVC, MODE_HANDLER(EOR, 0x51), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(EOR, 0x55), MODE_HANDLER(LSR, 0x56), &Cpu::UNK, &Cpu::CLI, MODE_HANDLER(EOR, 0x59), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(EOR, 0x5D), MODE_HANDLER(LSR, 0x5E), &Cpu::UNK,
+    &Cpu::RTS, MODE_HANDLER(ADC, 0x61), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ADC, 0x65), MODE_HANDLER(ROR, 0x66), &Cpu::UNK, &Cpu::PLA, MODE_HANDLER(ADC, 0x69), MODE_HANDLER(ROR, 0x6A), &Cpu::UNK, &Cpu::JMP, MODE_HANDLER(ADC, 0x6D), MODE_HANDLER(ROR, 0x6E), &Cpu::UNK,
+    &Cpu::BVS, MODE_HANDLER(ADC, 0x71), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ADC, 0x75), MODE_HANDLER(ROR, 0x76), &Cpu::UNK, &Cpu::SEI, MODE_HANDLER(ADC, 0x79), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(ADC, 0x7D), MODE_HANDLER(ROR, 0x7E), &Cpu::UNK,
+    &Cpu::UNK, MODE_HANDLER(STA, 0x81), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(STY, 0x84), MODE_HANDLER(STA, 0x85), MODE_HANDLER(STX, 0x86), &Cpu::UNK, &Cpu::DEY, &Cpu::UNK, &Cpu::TXA, &Cpu::UNK, MODE_HANDLER(STY, 0x8C), MODE_HANDLER(STA, 0x8D), MODE_HANDLER(STX, 0x8E), &Cpu::UNK,
+    &Cpu::BCC, MODE_HANDLER(STA, 0x91), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(STY, 0x94), MODE_HANDLER(STA, 0x95), MODE_HANDLER(STX, 0x96), &Cpu::UNK, &Cpu::TYA, MODE_HANDLER(STA, 0x99), &Cpu::TXS, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(STA, 0x9D), &Cpu::UNK, &Cpu::UNK,
+    MODE_HANDLER(LDY, 0xA0), MODE_HANDLER(LDA, 0xA1), MODE_HANDLER(LDX, 0xA2), &Cpu::UNK, MODE_HANDLER(LDY, 0xA4), MODE_HANDLER(LDA, 0xA5), MODE_HANDLER(LDX, 0xA6), &Cpu::UNK, &Cpu::TAY, MODE_HANDLER(LDA, 0xA9), &Cpu::TAX, &Cpu::UNK, MODE_HANDLER(LDY, 0xAC), MODE_HANDLER(LDA, 0xAD), MODE_HANDLER(LDX, 0xAE), &Cpu::UNK,
+    &Cpu::BCS, MODE_HANDLER(LDA, 0xB1), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(LDY, 0xB4), MODE_HANDLER(LDA, 0xB5), MODE_HANDLER(LDX, 0xB6), &Cpu::UNK, &Cpu::CLV, MODE_HANDLER(LDA, 0xB9), &Cpu::TSX, &Cpu::UNK, MODE_HANDLER(LDY, 0xBC), MODE_HANDLER(LDA, 0xBD), MODE_HANDLER(LDX, 0xBE), &Cpu::UNK,
+    MODE_HANDLER(CPY, 0xC0), MODE_HANDLER(CMP, 0xC1), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(CPY, 0xC4), MODE_HANDLER(CMP, 0xC5), MODE_HANDLER(DEC, 0xC6), &Cpu::UNK, &Cpu::INY, MODE_HANDLER(CMP, 0xC9), &Cpu::DEX, &Cpu::UNK, MODE_HANDLER(CPY, 0xCC), MODE_HANDLER(CMP, 0xCD), MODE_HANDLER(DEC, 0xCE), &Cpu::UNK,
+    &Cpu::BNE, MODE_HANDLER(CMP, 0xD1), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(CMP, 0xD5), MODE_HANDLER(DEC, 0xD6), &Cpu::UNK, &Cpu::CLD, MODE_HANDLER(CMP, 0xD9), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(CMP, 0xDD), MODE_HANDLER(DEC, 0xDE), &Cpu::UNK,
+    MODE_HANDLER(CPX, 0xE0), MODE_HANDLER(SBC, 0xE1), &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(CPX, 0xE4), MODE_HANDLER(SBC, 0xE5), MODE_HANDLER(INC, 0xE6), &Cpu::UNK, &Cpu::INX, MODE_HANDLER(SBC, 0xE9), &Cpu::NOP, &Cpu::UNK, MODE_HANDLER(CPX, 0xEC), MODE_HANDLER(SBC, 0xED), MODE_HANDLER(INC, 0xEE), &Cpu::UNK,
+    &Cpu::BEQ, MODE_HANDLER(SBC, 0xF1), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(SBC, 0xF5), MODE_HANDLER(INC, 0xF6), &Cpu::UNK, &Cpu::SED, MODE_HANDLER(SBC, 0xF9), &Cpu::UNK, &Cpu::UNK, &Cpu::UNK, MODE_HANDLER(SBC, 0xFD), MODE_HANDLER(INC, 0xFE), &Cpu::UNK
+};
+
+#undef MODE_HANDLER
+
+// Runs an instruction from the decode cache, whose cycles are already counted
+template<uint8_t Op>
+void decodedOperation(Cpu& cpu, Memory& mem, uint16_t operand)
+{
+    cpu.executeOperand<Op>(mem, operand);
+}
+
+}
+
+// Expands to one switch case per opcode in a row of 16
+#define OPCODE_CASE(op) case op: execute<op>(mem); break;
+#define OPCODE_ROW(row) \
+    OPCODE_CASE(row + 0x0) OPCODE_CASE(row + 0x1) OPCODE_CASE(row + 0x2) OPCODE_CASE(row + 0x3) \
+    OPCODE_CASE(row + 0x4) OPCODE_CASE(row + 0x5) OPCODE_CASE(row + 0x6) OPCODE_CASE(row + 0x7) \
+    OPCODE_CASE(row + 0x8) OPCODE_CASE(row + 0x9) OPCODE_CASE(row + 0xA) OPCODE_CASE(row + 0xB) \
+    OPCODE_CASE(row + 0xC) OPCODE_CASE(row + 0xD) OPCODE_CASE(row + 0xE) OPCODE_CASE(row + 0xF)
+
+// Expands to the decoded operation of each opcode in a row of 16
+#define OPCODE_FUNCTION(op) &decodedOperation<op>,
+#define OPCODE_FUNCTION_ROW(row) \
+    OPCODE_FUNCTION(row + 0x0) OPCODE_FUNCTION(row + 0x1) OPCODE_FUNCTION(row + 0x2) OPCODE_FUNCTION(row + 0x3) \
+    OPCODE_FUNCTION(row + 0x4) OPCODE_FUNCTION(row + 0x5) OPCODE_FUNCTION(row + 0x6) OPCODE_FUNCTION(row + 0x7) \
+    OPCODE_FUNCTION(row + 0x8) OPCODE_FUNCTION(row + 0x9) OPCODE_FUNCTION(row + 0xA) OPCODE_FUNCTION(row + 0xB) \
+    OPCODE_FUNCTION(row + 0xC) OPCODE_FUNCTION(row + 0xD) OPCODE_FUNCTION(row + 0xE) OPCODE_FUNCTION(row + 0xF)
+
+const NesCpu::OpFunction NesCpu::Cpu::opcodeFunctionArray[NesCpu::numOpcodes] = {
+    OPCODE_FUNCTION_ROW(0x00) OPCODE_FUNCTION_ROW(0x10) OPCODE_FUNCTION_ROW(0x20) OPCODE_FUNCTION_ROW(0x30)
+    OPCODE_FUNCTION_ROW(0x40) OPCODE_FUNCTION_ROW(0x50) OPCODE_FUNCTION_ROW(0x60) OPCODE_FUNCTION_ROW(0x70)
+    OPCODE_FUNCTION_ROW(0x80) OPCODE_FUNCTION_ROW(0x90) OPCODE_FUNCTION_ROW(0xA0) OPCODE_FUNCTION_ROW(0xB0)
+    OPCODE_FUNCTION_ROW(0xC0) OPCODE_FUNCTION_ROW(0xD0) OPCODE_FUNCTION_ROW(0xE0) OPCODE_FUNCTION_ROW(0xF0)
+};
 
 
 std::string NesCpu::Cpu::flagString()
 {
-    std::string flagString = "C: " + std::to_string(C)
-        + " Z: " + std::to_string(Z)
+    std::string flagString = "C: " + std::to_string(carryFlag())
+        + " Z: " + std::to_string(zeroFlag())
         + " I: " + std::to_string(I)
         + " D: " + std::to_string(D)
         + " B: " + std::to_string(B)
-        + " V: " + std::to_string(V)
-        + " N: " + std::to_string(N);
+        + " V: " + std::to_string(overflowFlag())
+        + " N: " + std::to_string(negativeFlag());
 
     return flagString;
 }
 
 void NesCpu::Cpu::reset(Memory& mem)
 {
-    PC = (mem.read(0xFFFD) << 8) + mem.read(0xFFFC);
-    std::cout << (int)PC << std::endl;
+    PC = read16(mem, resetVector);
+    SP = 0xFD;
+    I = 1;
+    nmiPending = false;
+    irqPending = false;
+
+    // The reset sequence takes as long as an interrupt
+    cycles += maxInstructionCycles;
+}
 
-    for (int i = 0; i < 15; ++i)
+void NesCpu::Cpu::step(Memory& mem)
+{
+    const uint8_t op = mem.read(PC);
+    switch (op)
     {
-        std::cout << (int)mem.read(PC+i) << '\n';
+        OPCODE_ROW(0x00) OPCODE_ROW(0x10) OPCODE_ROW(0x20) OPCODE_ROW(0x30)
+        OPCODE_ROW(0x40) OPCODE_ROW(0x50) OPCODE_ROW(0x60) OPCODE_ROW(0x70)
+        OPCODE_ROW(0x80) OPCODE_ROW(0x90) OPCODE_ROW(0xA0) OPCODE_ROW(0xB0)
+        OPCODE_ROW(0xC0) OPCODE_ROW(0xD0) OPCODE_ROW(0xE0) OPCODE_ROW(0xF0)
     }
+}
 
-
-    // TODO 
-
+int64_t NesCpu::Cpu::run(Memory& mem, int64_t cycleBudget)
+{
+    return debugger ? runLoop<true>(mem, cycleBudget) : runLoop<false>(mem, cycleBudget);
 }
 
-void NesCpu::Cpu::setupOpcodes()
+template<bool Debug>
+int64_t NesCpu::Cpu::runLoop(Memory& mem, int64_t cycleBudget)
 {
-    for (uint32_t i = 0; i < numOpcodes; ++i)
+    if (Debug && debugger->takeWatchChanges())
+    {
+        mem.setDebugger(debugger);
+    }
+
+    const uint64_t targetCycle = cycles + cycleBudget;
+
+    int64_t remaining = cycleBudget;
+    while (remaining > 0)
     {
-        OpInfo opinfo;
-        // TODO: Finish macro to update remaining info
-        MAKE_OPINFO(i);
-        opcodeInfoArray[i] = opinfo;
+        // A watchpoint hit stops after the instruction that made the access
+        if (Debug && debugger->isStopped())
+        {
+            break;
+        }
+        if (stopRequested)
+        {
+            stopRequested = false;
+            break;
+        }
+
+        if (nmiPending)
+        {
+            nmiPending = false;
+            interrupt(mem, nmiVector);
+        }
+        else if (irqPending && !I)
+        {
+            interrupt(mem, irqVector);
+        }
+
+        if (mem.hasDirtyCode())
+        {
+            decodeCache.flushDirty(mem);
+        }
+
+        if (Debug)
+        {
+            // Blocks, native code and idle skipping would step over
+            // breakpoints, so every instruction is stepped and checked
+            if (debugger->checkBreakpoint(PC))
+            {
+                break;
+            }
+            step(mem);
+            debugger->stepped();
+            remaining = static_cast<int64_t>(targetCycle - cycles);
+            continue;
+        }
+
+        // Whole blocks run while they are guaranteed to fit in the budget.
+        // Near the end single instructions are stepped so the overshoot is
+        // never more than one instruction.
+        DecodedBlock& block = decodeCache.getBlock(mem, PC);
+        if (block.maxCycles <= remaining)
+        {
+            const bool checkIdle = idleSkipEnabled && block.idleCandidate;
+            const IdleState before = checkIdle ? captureIdleState(*this) : IdleState{};
+            const uint64_t blockStartCycle = cycles;
+
+            const bool interpreted = !block.native;
+            bool codeChanged = false;
+            if (!interpreted)
+            {
+                // Native code hands back to the interpreter for I/O and
+                // instructions it doesn't translate
+                if (block.native(this, &mem.getPageTable(), mem.getCodePages()) == jitInterpret)
+                {
+                    step(mem);
+                }
+            }
+            else
+            {
+                for (const DecodedOp& op : block.ops)
+                {
+                    cycles += op.cycles;
+                    op.operation(*this, mem, op.operand);
+                    // A store over decoded code or a bank switch may have
+                    // changed the rest of the block, so it is left here and
+                    // decoded again from PC once the cache is flushed
+                    if (mem.hasDirtyCode())
+                    {
+                        codeChanged = true;
+                        break;
+                    }
+                }
+            }
+
+            // Back at the start with nothing changed, the loop will repeat
+            // identically until the budget ends, so skip the iterations
+            // that would have run as whole blocks
+            remaining = static_cast<int64_t>(targetCycle - cycles);
+            if (checkIdle && !stopRequested && PC == block.start && remaining >= static_cast<int64_t>(block.maxCycles)
+                && sameIdleState(before, captureIdleState(*this)))
+            {
+                const uint64_t iterationCycles = cycles - blockStartCycle;
+                const uint64_t iterations = (remaining - block.maxCycles) / iterationCycles + 1;
+                cycles += iterations * iterationCycles;
+                skippedCycles += iterations * iterationCycles;
+                ++idleLoopSkips;
+            }
+
+            // A block cut short is about to be flushed, so it isn't worth
+            // counting towards compilation. Native code leaves a polling
+            // loop at its I/O read, part-way through an iteration, so the
+            // loop would never look idle; those stay interpreted while idle
+            // skipping is on.
+            if (interpreted && !codeChanged && !(idleSkipEnabled && block.pollsIo))
+            {
+                if (jitEnabled && !block.jitFailed && ++block.executionCount >= jitThreshold)
+                {
+                    if (jit.isFull())
+                    {
+                        // Blocks are dropped before the code they point to
+                        decodeCache.clear();
+                        jit.reset();
+                    }
+                    else
+                    {
+                        jit.compile(*this, block);
+                    }
+                }
+            }
+        }
+        else
+        {
+            step(mem);
+        }
+
+        remaining = static_cast<int64_t>(targetCycle - cycles);
     }
 
+    return -remaining;
+}
 
+void NesCpu::Cpu::saveState(std::ostream& out)
+{
+    SaveState::write(out, PC);
+    SaveState::write(out, A);
+    SaveState::write(out, X);
+    SaveState::write(out, Y);
+    SaveState::write(out, SP);
+    SaveState::write(out, B);
+    // I and D are part of the status byte
+    SaveState::write(out, getStatus(false));
+    SaveState::write(out, cycles);
+    SaveState::write(out, nmiPending);
+    SaveState::write(out, irqPending);
+}
+
+bool NesCpu::Cpu::loadState(std::istream& in)
+{
+    uint8_t status = 0;
+    const bool ok = SaveState::read(in, PC) && SaveState::read(in, A) && SaveState::read(in, X)
+        && SaveState::read(in, Y) && SaveState::read(in, SP) && SaveState::read(in, B)
+        && SaveState::read(in, status) && SaveState::read(in, cycles)
+        && SaveState::read(in, nmiPending) && SaveState::read(in, irqPending);
+    setStatus(status);
+    return ok;
 }
 
 /////////////////////////////////////
-// PPU control operations
+// Interrupts
 /////////////////////////////////////
 
-// Enable 8x8 or 8x16 sprites
-void NesCpu::Cpu::enableSpriteMode(Memory& mem, NesPpu::SpriteType spriteType)
+// Signal a non-maskable interrupt
+void NesCpu::Cpu::triggerNMI()
 {
-    // Setting bit 5 of $2000 enables 8x16 sprites
-    const uint8_t bitNum = 5;
-    // 8x8 == 0, 8x16 == 1
-    mem.setBit(NesPpu::ppuControlRegister1, bitNum, spriteType);
+    nmiPending = true;
 }
 
-// Disable non-maskable interrupt (NMI) on V-Blank
-void NesCpu::Cpu::disableNMI(Memory& mem)
+// Assert or release the IRQ line
+void NesCpu::Cpu::setIRQ(bool asserted)
 {
-    // Setting bit 7 of $2000 disables NMI
-    const uint8_t bitNum = 7;
-    mem.setBit(NesPpu::ppuControlRegister1, bitNum, 0);
+    irqPending = asserted;
+}
 
+// Push PC and status and jump through an interrupt vector
+void NesCpu::Cpu::interrupt(Memory& mem, uint16_t vector)
+{
+    push16(mem, PC);
+    push(mem, getStatus(false));
+    I = 1;
+    PC = read16(mem, vector);
+    cycles += maxInstructionCycles;
+}
+
+/////////////////////////////////////
+// Instruction dispatch
+/////////////////////////////////////
+
+template<uint8_t Op>
+void NesCpu::Cpu::execute(Memory& mem)
+{
+    constexpr OpInfo info = opcodeInfoArray[Op];
+
+    uint16_t operand = 0;
+    if (info.bytes == 2)
+    {
+        operand = mem.read(PC + 1);
+    }
+    else if (info.bytes == 3)
+    {
+        operand = read16(mem, PC + 1);
+    }
+
+    cycles += info.cycles;
+    executeOperand<Op>(mem, operand);
+}
+
+template<uint8_t Op>
+void NesCpu::Cpu::executeOperand(Memory& mem, uint16_t operand)
+{
+    constexpr OpInfo info = opcodeInfoArray[Op];
+
+    // Operands are resolved after PC moves past the instruction so that
+    // branches, JSR and BRK see the address of the next instruction
+    PC += info.bytes;
+    const uint16_t address = resolveAddress<info.addressMode, info.pageCrossCycle>(mem, operand);
+
+    (this->*opcodeHandlerArray[Op])(mem, address);
+}
+
+template<NesCpu::AddressMode Mode, bool PageCrossCycle>
+uint16_t NesCpu::Cpu::resolveAddress(Memory& mem, uint16_t operand)
+{
+    uint16_t base = 0;
+    uint16_t address = 0;
+
+    switch (Mode)
+    {
+    case absolute:
+        return operand;
+    case immediate:
+        // The value is the byte just before the next instruction
+        return PC - 1;
+    case absoluteXidx:
+        base = operand;
+        address = base + X;
+        break;
+    case absoluteYidx:
+        base = operand;
+        address = base + Y;
+        break;
+    case indirect:
+    {
+        // The high byte is fetched without carrying into the page, so an
+        // indirect vector at $xxFF wraps around to $xx00
+        const uint16_t highAddress = (operand & 0xFF00) | ((operand + 1) & 0x00FF);
+        return mem.read(operand) | (mem.read(highAddress) << 8);
+    }
+    case indirectXidx:
+    {
+        const uint8_t pointer = static_cast<uint8_t>(operand + X);
+        return mem.read(pointer) | (mem.read(static_cast<uint8_t>(pointer + 1)) << 8);
+    }
+    case indirectYidx:
+    {
+        const uint8_t pointer = static_cast<uint8_t>(operand);
+        base = mem.read(pointer) | (mem.read(static_cast<uint8_t>(pointer + 1)) << 8);
+        address = base + Y;
+        break;
+    }
+    case relative:
+        return PC + static_cast<int8_t>(operand);
+    case zeropage:
+        return operand;
+    case zeropageXidx:
+        return static_cast<uint8_t>(operand + X);
+    case zeropageYidx:
+        return static_cast<uint8_t>(operand + Y);
+    default:
+        // accumulator and implied have no memory operand to resolve
+        return 0;
+    }
+
+    if (PageCrossCycle && ((base ^ address) & 0xFF00) != 0)
+    {
+        ++cycles;
+    }
+    return address;
+}
+
+template<NesCpu::AddressMode Mode>
+uint8_t NesCpu::Cpu::fetch(Memory& mem, uint16_t address)
+{
+    if (Mode == accumulator)
+    {
+        return A;
+    }
+    return mem.read(address);
+}
+
+template<NesCpu::AddressMode Mode>
+void NesCpu::Cpu::store(Memory& mem, uint16_t address, uint8_t value)
+{
+    if (Mode == accumulator)
+    {
+        A = value;
+    }
+    else
+    {
+        mem.write(address, value);
+    }
+}
+
+uint16_t NesCpu::Cpu::read16(Memory& mem, uint16_t address)
+{
+    return mem.read(address) | (mem.read(address + 1) << 8);
+}
+
+// Take a relative branch, adding the taken and page-cross cycles
+void NesCpu::Cpu::branch(uint16_t address)
+{
+    cycles += ((PC ^ address) & 0xFF00) != 0 ? 2 : 1;
+    PC = address;
+}
+
+// Processor status byte as pushed by PHP, BRK and interrupts
+uint8_t NesCpu::Cpu::getStatus(bool breakFlag) const
+{
+    // Reformat status flags into a single byte arranged as follows:
+    // Bits:  | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // Flags: | N | V |   | B | D | I | Z | C |
+    // Bit 5 always reads back as set
+    uint8_t byteFlag = 0x20;
+    if (carryFlag()) {byteFlag += 1;}
+    if (zeroFlag()) {byteFlag += 2;}
+    if (I) {byteFlag += 4;}
+    if (D) {byteFlag += 8;}
+    if (breakFlag) {byteFlag += 16;}
+    if (overflowFlag()) {byteFlag += 64;}
+    if (negativeFlag()) {byteFlag += 128;}
+    return byteFlag;
+}
+
+// Restore flags from a status byte pulled by PLP and RTI
+void NesCpu::Cpu::setStatus(uint8_t status)
+{
+    // Bits 4 and 5 don't exist in the status register and are ignored
+    setNegativeZero((status >> 7) & 1, (status >> 1) & 1);
+    setOverflow((status >> 6) & 1);
+    D = (status >> 3) & 1;
+    I = (status >> 2) & 1;
+    setCarry(status & 1);
 }
 
 /////////////////////////////////////
@@ -73,62 +485,43 @@ void NesCpu::Cpu::disableNMI(Memory& mem)
 /////////////////////////////////////
 
 // Push 8-bit value to stack
-void NesCpu::Cpu::push(Memory& mem, int8_t value)
+void NesCpu::Cpu::push(Memory& mem, uint8_t value)
 {
     // Stack is located in memory locations $0100-$01FF and works top-down
-    uint16_t address = 0x1FF - SP;
-    mem.write(address, value);
+    mem.write(0x100 + SP, value);
     --SP; // Intentionally not preventing overflow
 }
 
 // Push 16-bit value to stack
-void NesCpu::Cpu::push16(Memory& mem, int16_t value)
+void NesCpu::Cpu::push16(Memory& mem, uint16_t value)
 {
-    // Stack is located in memory locations $0100-$01FF and works top-down
-    uint16_t address = 0x1FF - SP;
-    uint8_t* bytes = reinterpret_cast<uint8_t*>(mem.getAddress(address));
-    // TODO -- verify order
-    // Push each byte of the uint16_t value
-    mem.write(address, bytes[0]);
-    --SP; // Intentionally not preventing overflow
-    mem.write(address, bytes[1]);
-    --SP; // Intentionally not preventing overflow
+    // High byte first so the value reads back little-endian
+    push(mem, static_cast<uint8_t>(value >> 8));
+    push(mem, static_cast<uint8_t>(value));
 }
 
 // Pop value from stack 
-int8_t NesCpu::Cpu::pop(Memory& mem)
+uint8_t NesCpu::Cpu::pop(Memory& mem)
 {
     // Stack is located in memory locations $0100-$01FF and works top-down
-    uint16_t address = 0x1FF - SP;
-    int8_t val = mem.read(address);
     ++SP; // Intentionally not preventing overflow
-    return val;
+    return mem.read(0x100 + SP);
 }
 
 // Pop 16-bit value from stack
-int16_t NesCpu::Cpu::pop16(Memory& mem)
+uint16_t NesCpu::Cpu::pop16(Memory& mem)
 {
-    // Stack is located in memory locations $0100-$01FF and works top-down
-    uint16_t address = 0x1FF - SP;
-    int8_t bytes[2];
-    // TODO -- verify order
-    // Pop each byte of the uint16_t value
-    bytes[0] = mem.read(address);
-    ++SP; // Intentionally not preventing overflow
-    bytes[1] = mem.read(address);
-    ++SP; // Intentionally not preventing overflow
-    uint16_t* value_p = reinterpret_cast<uint16_t*>(bytes);
-    return *value_p;
+    const uint8_t low = pop(mem);
+    const uint8_t high = pop(mem);
+    return low | (high << 8);
 }
 
 // Peek at value on stack
-int8_t NesCpu::Cpu::peek(Memory& mem)
+uint8_t NesCpu::Cpu::peek(Memory& mem)
 {
     // Stack is located in memory locations $0100-$01FF and works top-down
-    uint16_t address = 0x1FF - SP;
-    int8_t val = mem.read(address);
     // Don't increment SP
-    return val;
+    return mem.read(0x100 + static_cast<uint8_t>(SP + 1));
 }
 
 /////////////////////////////////////
@@ -136,138 +529,137 @@ int8_t NesCpu::Cpu::peek(Memory& mem)
 /////////////////////////////////////
 
 // Add with carry
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::ADC(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    const uint8_t prevA = A;
-    A = A + val + C;
-    Z = (A == 0) ? 1 : 0;
-    C = (static_cast<int>(prevA) + val + C > 0xFF) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
-    // Overflow occurred if accumulator flipped signs after addition && 
-    // accumulator and memory value are same sign
-    V = ((prevA^A) & 0x80 != 0 && (A^val) & 0x80 == 0) ? 1 : 0;
+    // The 2A03 has no decimal mode, so D is ignored
+    const uint8_t val = fetch<Mode>(mem, address);
+    const uint16_t sum = A + val + carryFlag();
+    // Overflow is worked out from the operands only when V is read
+    overflowLhs = A;
+    overflowRhs = val;
+    carryResult = sum;
+    A = static_cast<uint8_t>(sum);
+    overflowResult = A;
+    nzResult = A;
 }
 
 // Logical and
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::AND(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
+    const uint8_t val = fetch<Mode>(mem, address);
     A = A & val;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // Arithmetic shift left
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::ASL(Memory& mem, uint16_t address)
 {
-    // TODO: Check for accumulator address mode
-    int8_t val = mem.read(address);
-    C = (val & 0x80 != 0) ? 1 : 0;
-    val <<= 2;
-    Z = (A == 0) ? 1 : 0;
-    N = (val & 0x80 != 0) ? 1 : 0;
-    mem.write(address, val);
+    const uint16_t shifted = fetch<Mode>(mem, address) << 1;
+    const uint8_t val = static_cast<uint8_t>(shifted);
+    carryResult = shifted;
+    nzResult = val;
+    store<Mode>(mem, address, val);
 }
 
 // Branch on carry clear
 void NesCpu::Cpu::BCC(Memory& mem, uint16_t address)
 {
-    if(C == 0)
+    if (!carryFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Branch on carry set
 void NesCpu::Cpu::BCS(Memory& mem, uint16_t address)
 {
-    if(C == 1)
+    if (carryFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Branch on equal
 void NesCpu::Cpu::BEQ(Memory& mem, uint16_t address)
 {
-    if(Z == 1)
+    if (zeroFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Bit test
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::BIT(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    Z = (A & val) == 0 ? 1 : 0;
-    N = val & 0x80;
-    V = val & 0x40;
+    const uint8_t val = fetch<Mode>(mem, address);
+    // Z comes from A & M while N and V are copied from bits 7 and 6 of M
+    nzResult = (A & val) | ((val & 0x80) << 1);
+    setOverflow((val >> 6) & 1);
 }
 
 // Branch if minus
 void NesCpu::Cpu::BMI(Memory& mem, uint16_t address)
 {
-    if (N == 1)
+    if (negativeFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Branch if not equal
 void NesCpu::Cpu::BNE(Memory& mem, uint16_t address)
 {
-    if (Z == 0)
+    if (!zeroFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Branch if plus
 void NesCpu::Cpu::BPL(Memory& mem, uint16_t address)
 {
-    if (N == 0)
+    if (!negativeFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Break
 void NesCpu::Cpu::BRK(Memory& mem, uint16_t address)
 {
-    push16(mem, PC);
-    PHP(mem,0);
-    uint16_t* irqVec_p = reinterpret_cast<uint16_t*>(mem.getAddress(0xFFFE));
-    PC = *irqVec_p;
-    B = 1;
-
-    std::cout << "BRK\n";
-
+    // BRK skips a padding byte, so the return address is PC + 1
+    push16(mem, PC + 1);
+    push(mem, getStatus(true));
+    I = 1;
+    PC = read16(mem, irqVector);
 }
 
 // Branch if overflow clear
 void NesCpu::Cpu::BVC(Memory& mem, uint16_t address)
 {
-    if (V == 0)
+    if (!overflowFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Branch if overflow set
 void NesCpu::Cpu::BVS(Memory& mem, uint16_t address)
 {
-    if (V == 1)
+    if (overflowFlag())
     {
-        PC = address;
+        branch(address);
     }
 }
 
 // Clear carry flag
 void NesCpu::Cpu::CLC(Memory& mem, uint16_t address)
 {
-    C = 0;
+    setCarry(0);
 }
 
 // Clear decimal mode
@@ -285,113 +677,101 @@ void NesCpu::Cpu::CLI(Memory& mem, uint16_t address)
 // Clear overflow flag
 void NesCpu::Cpu::CLV(Memory& mem, uint16_t address)
 {
-    V = 0;
+    setOverflow(0);
 }
 
 // Compare accumulator
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::CMP(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    N = (A - val) & 0x80 != 0 ? 1 : 0;
-    C = (A >= val) ? 1 : 0;
-    Z = (A == val) ? 1 : 0;
+    const uint8_t val = fetch<Mode>(mem, address);
+    // Bit 8 of reg + ~M + 1 is set when reg >= M
+    carryResult = A + (val ^ 0xFF) + 1;
+    nzResult = static_cast<uint8_t>(A - val);
 }
 
 // Compare X register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::CPX(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    N = (X - val) & 0x80 != 0 ? 1 : 0;
-    C = (X >= val) ? 1 : 0;
-    Z = (X == val) ? 1 : 0;
+    const uint8_t val = fetch<Mode>(mem, address);
+    // Bit 8 of reg + ~M + 1 is set when reg >= M
+    carryResult = X + (val ^ 0xFF) + 1;
+    nzResult = static_cast<uint8_t>(X - val);
 }
 
 // Compare Y register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::CPY(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    N = (Y - val) & 0x80 != 0 ? 1 : 0;
-    C = (Y >= val) ? 1 : 0;
-    Z = (Y == val) ? 1 : 0;
+    const uint8_t val = fetch<Mode>(mem, address);
+    // Bit 8 of reg + ~M + 1 is set when reg >= M
+    carryResult = Y + (val ^ 0xFF) + 1;
+    nzResult = static_cast<uint8_t>(Y - val);
 }
 
 // Decrement memory
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::DEC(Memory& mem, uint16_t address)
 {
-    int8_t val = mem.read(address);
+    uint8_t val = fetch<Mode>(mem, address);
     --val;
-    mem.write(address, val);
-    Z = (val == 0) ? 1 : 0;
-    N = (val & 0x80) != 0 ? 1 : 0;
+    store<Mode>(mem, address, val);
+    nzResult = val;
 }
 
 // Decrement X register
 void NesCpu::Cpu::DEX(Memory& mem, uint16_t address)
 {
     --X;
-    Z = (X == 0) ? 1 : 0;
-    N = (X & 0x80) != 0 ? 1 : 0;
+    nzResult = X;
 }
 
 // Decrement Y register
 void NesCpu::Cpu::DEY(Memory& mem, uint16_t address)
 {
     --Y;
-    Z = (Y == 0) ? 1 : 0;
-    N = (Y & 0x80) != 0 ? 1 : 0;
+    nzResult = Y;
 }
 
 // Logical exclusive or
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::EOR(Memory& mem, uint16_t address)
 {
-    int8_t val = mem.read(address);
+    const uint8_t val = fetch<Mode>(mem, address);
     A = A^val;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // Increment memory
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::INC(Memory& mem, uint16_t address)
 {
-    int8_t val = mem.read(address);
+    uint8_t val = fetch<Mode>(mem, address);
     ++val;
-    mem.write(address, val);
-    Z = (val == 0) ? 1 : 0;
-    N = (val & 0x80) != 0 ? 1 : 0;
+    store<Mode>(mem, address, val);
+    nzResult = val;
 }
 
 // Increment X register
 void NesCpu::Cpu::INX(Memory& mem, uint16_t address)
 {
     ++X;
-    Z = (X == 0) ? 1 : 0;
-    N = (X & 0x80) != 0 ? 1 : 0;
+    nzResult = X;
 }
 
 // Increment Y register
 void NesCpu::Cpu::INY(Memory& mem, uint16_t address)
 {
     ++Y;
-    Z = (Y == 0) ? 1 : 0;
-    N = (Y & 0x80) != 0 ? 1 : 0;
+    nzResult = Y;
 }
 
 // Jump
 void NesCpu::Cpu::JMP(Memory& mem, uint16_t address)
 {
-    // TODO
-
-    // if addressing mode is absolute
-    // PC = address;
-
-    // if addressing mode is indirect
-    // uint16_t* irqVec_p = reinterpret_cast<uint16_t*>(mem.getAddress(0xFFFE));
-        // If addressing mode is indirect, don't allow locations 
-        // beginning on the last byte of a page (0xXXFF)
-        //PC = *irqVec_p;
-
-    // Should probably disallow address == 0xFFFF, otherwise it'll read a byte from outside of memory
-
+    // Absolute and indirect targets are both resolved by the addressing mode
+    PC = address;
 }
 
 // Jump to subroutine
@@ -402,43 +782,38 @@ void NesCpu::Cpu::JSR(Memory& mem, uint16_t address)
 }
 
 // Load accumulator
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::LDA(Memory& mem, uint16_t address)
 {
-    A = mem.read(address);
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    A = fetch<Mode>(mem, address);
+    nzResult = A;
 }
 
 // Load X register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::LDX(Memory& mem, uint16_t address)
 {
-    X = mem.read(address);
-    Z = (X == 0) ? 1 : 0;
-    N = (X & 0x80 != 0) ? 1 : 0;
+    X = fetch<Mode>(mem, address);
+    nzResult = X;
 }
 
 // Load Y register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::LDY(Memory& mem, uint16_t address)
 {
-    Y = mem.read(address);
-    Z = (Y == 0) ? 1 : 0;
-    N = (Y & 0x80 != 0) ? 1 : 0;
+    Y = fetch<Mode>(mem, address);
+    nzResult = Y;
 }
 
 // Logical shift right
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::LSR(Memory& mem, uint16_t address)
 {
-    // TODO
-    // If in accumulator mode, perform on A instead
-
-    // Cast as uint8_t so when the bits are shifted, the top bit becomes 0
-    // For int8_t, the top bit will stay the same
-    uint8_t val = static_cast<uint8_t>(mem.read(address));
-    C = val & 0x01;
+    uint8_t val = fetch<Mode>(mem, address);
+    carryResult = val << 8;
     val >>= 1;
-    mem.write(address, static_cast<int8_t>(val));
-    Z = (val == 0) ? 1 : 0;
-    N = (val & 0x80 != 0) ? 1 : 0;
+    store<Mode>(mem, address, val);
+    nzResult = val;
 }
 
 // No operation
@@ -448,12 +823,12 @@ void NesCpu::Cpu::NOP(Memory& mem, uint16_t address)
 }
 
 // Logical inclusive or
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::ORA(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
+    const uint8_t val = fetch<Mode>(mem, address);
     A = A|val;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // Push accumulator
@@ -465,115 +840,80 @@ void NesCpu::Cpu::PHA(Memory& mem, uint16_t address)
 // Push processor status
 void NesCpu::Cpu::PHP(Memory& mem, uint16_t address)
 {
-    // Reformat status flags into a single byte arranged as follows:
-    // Bits:  | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // Flags: | N | V |   | B | D | I | Z | C |
-    uint8_t byteFlag = 0;
-    if (C) {byteFlag += 1;}
-    if (Z) {byteFlag += 2;}
-    if (I) {byteFlag += 4;}
-    if (D) {byteFlag += 8;}
-    if (B) {byteFlag += 16;}
-    if (V) {byteFlag += 64;}
-    if (N) {byteFlag += 128;}
-
-    int8_t* byteFlag_p = reinterpret_cast<int8_t*>(&byteFlag);
-    push(mem, *byteFlag_p);
+    // PHP always pushes with the break bit set
+    push(mem, getStatus(true));
 }
 
 // Pull accumulator
 void NesCpu::Cpu::PLA(Memory& mem, uint16_t address)
 {
     A = pop(mem);
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // Pull processor status
 void NesCpu::Cpu::PLP(Memory& mem, uint16_t address)
 {
-    // Reformat status flags from a single byte arranged as follows:
-    // Bits:  | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // Flags: | N | V |   | B | D | I | Z | C |
-    int8_t byteFlags = pop(mem);
-
-    // Set status flags to values pulled
-    N = byteFlags & 0x80;
-    V = byteFlags & 0x40;
-    B = byteFlags & 0x10;
-    D = byteFlags & 0x08;
-    I = byteFlags & 0x04;
-    Z = byteFlags & 0x02;
-    C = byteFlags & 0x01;
+    setStatus(pop(mem));
 }
 
 // Rotate left
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::ROL(Memory& mem, uint16_t address)
 {
-    // TODO
-    // If in accumulator mode, perform on A instead
-
-    int8_t val = mem.read(address);
-    const int8_t signBit = val & 0x80;
-    val <<= 1;
-    if (C == 1)
-    {
-        val |= 0x01;
-    }
-    C = signBit;
-    Z = (val == 0) ? 1 : 0;
-    N = (val & 0x80 != 0) ? 1 : 0;
+    const uint16_t rotated = (fetch<Mode>(mem, address) << 1) | carryFlag();
+    const uint8_t val = static_cast<uint8_t>(rotated);
+    carryResult = rotated;
+    store<Mode>(mem, address, val);
+    nzResult = val;
 }
 
 // Rotate right
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::ROR(Memory& mem, uint16_t address)
 {
-    // TODO
-    // If in accumulator mode, perform on A instead
-
-    int8_t val = mem.read(address);
-    const int8_t zeroBit = val & 0x01;
-    val >>= 1;
-    if (C == 1)
-    {
-        val |= 0x80;
-    }
-    C = zeroBit;
-    Z = (val == 0) ? 1 : 0;
-    N = (val & 0x80 != 0) ? 1 : 0;
+    uint8_t val = fetch<Mode>(mem, address);
+    const uint16_t zeroBit = val << 8;
+    val = (val >> 1) | (carryFlag() << 7);
+    carryResult = zeroBit;
+    store<Mode>(mem, address, val);
+    nzResult = val;
 }
 
 // Return from interrupt
 void NesCpu::Cpu::RTI(Memory& mem, uint16_t address)
 {
-    PLP(mem,0);
+    setStatus(pop(mem));
     PC = pop16(mem);
 }
 
 // Return from subroutine
 void NesCpu::Cpu::RTS(Memory& mem, uint16_t address)
 {
-    PC = pop(mem); 
+    // JSR pushed the address of its last byte
+    PC = pop16(mem) + 1;
 }
 
 // Subtract with carry
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::SBC(Memory& mem, uint16_t address)
 {
-    const int8_t val = mem.read(address);
-    const int8_t prevA = A;
-    A = A - val - (!C);
-    C = (static_cast<int>(prevA) - val - (!C) < -128) ? 1 : 0;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
-    // Overflow occurred if accumulator flipped signs after subtraction && 
-    // accumulator and memory value are same sign
-    V = ((prevA^A) & 0x80 != 0 && (A^val) & 0x80 == 0) ? 1 : 0;
+    // A - M - (1 - C) is the same as A + ~M + C
+    const uint8_t val = fetch<Mode>(mem, address) ^ 0xFF;
+    const uint16_t sum = A + val + carryFlag();
+    // Overflow is worked out from the operands only when V is read
+    overflowLhs = A;
+    overflowRhs = val;
+    carryResult = sum;
+    A = static_cast<uint8_t>(sum);
+    overflowResult = A;
+    nzResult = A;
 }
 
 // Set carry flag
 void NesCpu::Cpu::SEC(Memory& mem, uint16_t address)
 {
-    C = 1;
+    setCarry(1);
 }
 
 // Set decimal flag
@@ -589,67 +929,65 @@ void NesCpu::Cpu::SEI(Memory& mem, uint16_t address)
 }
 
 // Store accumulator
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::STA(Memory& mem, uint16_t address)
 {
-    mem.write(address, A);
+    store<Mode>(mem, address, A);
 }
 
 // Store X register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::STX(Memory& mem, uint16_t address)
 {
-    mem.write(address, X);
+    store<Mode>(mem, address, X);
 }
 
 // Store Y register
+template<NesCpu::AddressMode Mode>
 void NesCpu::Cpu::STY(Memory& mem, uint16_t address)
 {
-    mem.write(address, Y);
+    store<Mode>(mem, address, Y);
 }
 
 // Transfer accumulator to X
 void NesCpu::Cpu::TAX(Memory& mem, uint16_t address)
 {
     X = A;
-    Z = (X == 0) ? 1 : 0;
-    N = (X & 0x80 != 0) ? 1 : 0;
+    nzResult = X;
 }
 
 // Transfer accumulator to Y
 void NesCpu::Cpu::TAY(Memory& mem, uint16_t address)
 {
     Y = A;
-    Z = (Y == 0) ? 1 : 0;
-    N = (Y & 0x80 != 0) ? 1 : 0;
+    nzResult = Y;
 }
 
 // Transfer stack pointer to X
 void NesCpu::Cpu::TSX(Memory& mem, uint16_t address)
 {
-    X = peek(mem);
-    Z = (X == 0) ? 1 : 0;
-    N = (X & 0x80 != 0) ? 1 : 0;
+    X = SP;
+    nzResult = X;
 }
 
 // Transfer X to accumulator
 void NesCpu::Cpu::TXA(Memory& mem, uint16_t address)
 {
     A = X;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // Transfer X to stack pointer
 void NesCpu::Cpu::TXS(Memory& mem, uint16_t address)
 {
-    push(mem, X);
+    SP = X;
 }
 
 // Transfer Y to accumulator
 void NesCpu::Cpu::TYA(Memory& mem, uint16_t address)
 {
     A = Y;
-    Z = (A == 0) ? 1 : 0;
-    N = (A & 0x80 != 0) ? 1 : 0;
+    nzResult = A;
 }
 
 // For unused opcodes
@@ -657,60 +995,3 @@ void NesCpu::Cpu::UNK(Memory& mem, uint16_t address)
 {
     std::cout << "Error: Unused opcode used\n";
 }
-
-/*
-const std::string NesCpu::Cpu::opcodeNameArray[] = {
-    "BRK","ORA","---","---","---","ORA","ASL","---","PHP","ORA","ASL","---","---","ORA","ASL","---",
-    "BPL","ORA","---","---","---","ORA","ASL","---","CLC","ORA","---","---","---","ORA","ASL","---",
-    "JSR","AND","---","---","BIT","AND","ROL","---","PLP","AND","ROL","---","BIT","AND","ROL","---",
-    "BMI","AND","---","---","---","AND","ROL","---","SEC","AND","---","---","---","AND","ROL","---",
-    "RTI","EOR","---","---","---","EOR","LSR","---","PHA","EOR","LSR","---","JMP","EOR","LSR","---",
-    "BVC","EOR","---","---","---","EOR","LSR","---","CLI","EOR","---","---","---","EOR","LSR","---",
-    "RTS","ADC","---","---","---","ADC","ROR","---","PLA","ADC","ROR","---","JMP","ADC","ROR","---",
-    "BVS","ADC","---","---","---","ADC","ROR","---","SEI","ADC","---","---","---","ADC","ROR","---",
-    "---","STA","---","---","STY","STA","STX","---","DEY","---","TXA","---","STY","STA","STX","---",
-    "BCC","STA","---","---","STY","STA","STX","---","TYA","STA","TXS","---","---","STA","---","---",
-    "LDY","LDA","LDX","---","LDY","LDA","LDX","---","TAY","LDA","TAX","---","LDY","LDA","LDX","---",
-    "BCS","LDA","---","---","LDY","LDA","LDX","---","CLV","LDA","TSX","---","LDY","LDA","LDX","---",
-    "CPY","CMP","---","---","CPY","CMP","DEC","---","INY","CMP","DEX","---","CPY","CMP","DEC","---",
-    "BNE","CMP","---","---","---","CMP","DEC","---","CLD","CMP","---","---","---","CMP","DEC","---",
-    "CPX","SBC","---","---","CPX","SBC","INC","---","INX","SBC","NOP","---","CPX","SBC","INC","---",
-    "BEQ","SBC","---","---","---","SBC","INC","---","SED","SBC","---","---","---","SBC","INC","---"};
-*/
-
-const uint8_t NesCpu::Cpu::opcodeByteArray[] = {
-    1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 0, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
-    3, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
-    1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
-    1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
-    0, 2, 0, 0, 2, 2, 2, 0, 1, 0, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 0, 3, 0, 0,
-    2, 2, 2, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
-    2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
-    2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0};
-
-const std::function<void(NesCpu::Cpu&, Memory&, uint16_t)> NesCpu::Cpu::opcodeArray[] = {
-    NesCpu::Cpu::BRK, NesCpu::Cpu::ORA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ORA, NesCpu::Cpu::ASL, NesCpu::Cpu::UNK, NesCpu::Cpu::PHP, NesCpu::Cpu::ORA, NesCpu::Cpu::ASL, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ORA, NesCpu::Cpu::ASL, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BPL, NesCpu::Cpu::ORA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ORA, NesCpu::Cpu::ASL, NesCpu::Cpu::UNK, NesCpu::Cpu::CLC, NesCpu::Cpu::ORA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ORA, NesCpu::Cpu::ASL, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    JSR, NesCpu::Cpu::AND, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::BIT, NesCpu::Cpu::AND, NesCpu::Cpu::ROL, NesCpu::Cpu::UNK, NesCpu::Cpu::PLP, NesCpu::Cpu::AND, NesCpu::Cpu::ROL, NesCpu::Cpu::UNK, NesCpu::Cpu::BIT, NesCpu::Cpu::AND, NesCpu::Cpu::ROL, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BMI, NesCpu::Cpu::AND, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::AND, NesCpu::Cpu::ROL, NesCpu::Cpu::UNK, NesCpu::Cpu::SEC, NesCpu::Cpu::AND, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::AND, NesCpu::Cpu::ROL, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    RTI, NesCpu::Cpu::EOR, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::EOR, NesCpu::Cpu::LSR, NesCpu::Cpu::UNK, NesCpu::Cpu::PHA, NesCpu::Cpu::EOR, NesCpu::Cpu::LSR, NesCpu::Cpu::UNK, NesCpu::Cpu::JMP, NesCpu::Cpu::EOR, NesCpu::Cpu::LSR, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BVC, NesCpu::Cpu::EOR, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::EOR, NesCpu::Cpu::LSR, NesCpu::Cpu::UNK, NesCpu::Cpu::CLI, NesCpu::Cpu::EOR, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::EOR, NesCpu::Cpu::LSR, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    RTS, NesCpu::Cpu::ADC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ADC, NesCpu::Cpu::ROR, NesCpu::Cpu::UNK, NesCpu::Cpu::PLA, NesCpu::Cpu::ADC, NesCpu::Cpu::ROR, NesCpu::Cpu::UNK, NesCpu::Cpu::JMP, NesCpu::Cpu::ADC, NesCpu::Cpu::ROR, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BVS, NesCpu::Cpu::ADC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ADC, NesCpu::Cpu::ROR, NesCpu::Cpu::UNK, NesCpu::Cpu::SEI, NesCpu::Cpu::ADC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::ADC, NesCpu::Cpu::ROR, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    UNK, NesCpu::Cpu::STA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::STY, NesCpu::Cpu::STA, NesCpu::Cpu::STX, NesCpu::Cpu::UNK, NesCpu::Cpu::DEY, NesCpu::Cpu::UNK, NesCpu::Cpu::TXA, NesCpu::Cpu::UNK, NesCpu::Cpu::STY, NesCpu::Cpu::STA, NesCpu::Cpu::STX, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BCC, NesCpu::Cpu::STA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::STY, NesCpu::Cpu::STA, NesCpu::Cpu::STX, NesCpu::Cpu::UNK, NesCpu::Cpu::TYA, NesCpu::Cpu::STA, NesCpu::Cpu::TXS, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::STA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    LDY, NesCpu::Cpu::LDA, NesCpu::Cpu::LDX, NesCpu::Cpu::UNK, NesCpu::Cpu::LDY, NesCpu::Cpu::LDA, NesCpu::Cpu::LDX, NesCpu::Cpu::UNK, NesCpu::Cpu::TAY, NesCpu::Cpu::LDA, NesCpu::Cpu::TAX, NesCpu::Cpu::UNK, NesCpu::Cpu::LDY, NesCpu::Cpu::LDA, NesCpu::Cpu::LDX, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BCS, NesCpu::Cpu::LDA, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::LDY, NesCpu::Cpu::LDA, NesCpu::Cpu::LDX, NesCpu::Cpu::UNK, NesCpu::Cpu::CLV, NesCpu::Cpu::LDA, NesCpu::Cpu::TSX, NesCpu::Cpu::UNK, NesCpu::Cpu::LDY, NesCpu::Cpu::LDA, NesCpu::Cpu::LDX, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    CPY, NesCpu::Cpu::CMP, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::CPY, NesCpu::Cpu::CMP, NesCpu::Cpu::DEC, NesCpu::Cpu::UNK, NesCpu::Cpu::INY, NesCpu::Cpu::CMP, NesCpu::Cpu::DEX, NesCpu::Cpu::UNK, NesCpu::Cpu::CPY, NesCpu::Cpu::CMP, NesCpu::Cpu::DEC, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BNE, NesCpu::Cpu::CMP, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::CMP, NesCpu::Cpu::DEC, NesCpu::Cpu::UNK, NesCpu::Cpu::CLD, NesCpu::Cpu::CMP, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::CMP, NesCpu::Cpu::DEC, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    CPX, NesCpu::Cpu::SBC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::CPX, NesCpu::Cpu::SBC, NesCpu::Cpu::INC, NesCpu::Cpu::UNK, NesCpu::Cpu::INX, NesCpu::Cpu::SBC, NesCpu::Cpu::NOP, NesCpu::Cpu::UNK, NesCpu::Cpu::CPX, NesCpu::Cpu::SBC, NesCpu::Cpu::INC, NesCpu::Cpu::UNK, NesCpu::Cpu::
-    BEQ, NesCpu::Cpu::SBC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::SBC, NesCpu::Cpu::INC, NesCpu::Cpu::UNK, NesCpu::Cpu::SED, NesCpu::Cpu::SBC, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::UNK, NesCpu::Cpu::SBC, NesCpu::Cpu::INC, NesCpu::Cpu::UNK};
-
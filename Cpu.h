@@ -3,9 +3,11 @@
 
 #include <stdint.h>
 #include <string>
-#include <functional>
+#include <istream>
+#include <ostream>
 #include "Memory.h"
-#include "Ppu.h"
+#include "DecodeCache.h"
+#include "Jit.h"
 
 
 
@@ -186,15 +188,109 @@ class Cpu;
     };
 
     struct OpInfo {
-        std::string opcode;
+        const char* opcode;
         uint8_t bytes;
         uint8_t cycles;
         AddressMode addressMode;
-        std::function<void(Cpu&, Memory&, uint16_t)> operation;
+        bool pageCrossCycle; // Takes an extra cycle when indexing crosses a page
     };
 
     static constexpr uint32_t numOpcodes = 256;
 
+    // Longest instruction (read-modify-write absolute,X) and interrupt entry
+    static constexpr int64_t maxInstructionCycles = 7;
+
+    // Interrupt vectors
+    static const uint16_t nmiVector = 0xFFFA;
+    static const uint16_t resetVector = 0xFFFC;
+    static const uint16_t irqVector = 0xFFFE;
+
+    // Mnemonic, instruction length, base cycle count, addressing mode and
+    // page-cross penalty for every opcode. Unused opcodes are treated as
+    // 1-byte instructions.
+    static constexpr OpInfo opcodeInfoArray[numOpcodes] = {
+        // 0x00
+        {"BRK", 1, 7, implied, false}, {"ORA", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ORA", 2, 3, zeropage, false}, {"ASL", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"PHP", 1, 3, implied, false}, {"ORA", 2, 2, immediate, false}, {"ASL", 1, 2, accumulator, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ORA", 3, 4, absolute, false}, {"ASL", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0x10
+        {"BPL", 2, 2, relative, false}, {"ORA", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ORA", 2, 4, zeropageXidx, false}, {"ASL", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"CLC", 1, 2, implied, false}, {"ORA", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ORA", 3, 4, absoluteXidx, true}, {"ASL", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false},
+        // 0x20
+        {"JSR", 3, 6, absolute, false}, {"AND", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"BIT", 2, 3, zeropage, false}, {"AND", 2, 3, zeropage, false}, {"ROL", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"PLP", 1, 4, implied, false}, {"AND", 2, 2, immediate, false}, {"ROL", 1, 2, accumulator, false}, {"---", 1, 2, implied, false},
+        {"BIT", 3, 4, absolute, false}, {"AND", 3, 4, absolute, false}, {"ROL", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0x30
+        {"BMI", 2, 2, relative, false}, {"AND", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"AND", 2, 4, zeropageXidx, false}, {"ROL", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"SEC", 1, 2, implied, false}, {"AND", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"AND", 3, 4, absoluteXidx, true}, {"ROL", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false},
+        // 0x40
+        {"RTI", 1, 6, implied, false}, {"EOR", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"EOR", 2, 3, zeropage, false}, {"LSR", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"PHA", 1, 3, implied, false}, {"EOR", 2, 2, immediate, false}, {"LSR", 1, 2, accumulator, false}, {"---", 1, 2, implied, false},
+        {"JMP", 3, 3, absolute, false}, {"EOR", 3, 4, absolute, false}, {"LSR", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0x50
+        {"BVC", 2, 2, relative, false}, {"EOR", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"EOR", 2, 4, zeropageXidx, false}, {"LSR", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"CLI", 1, 2, implied, false}, {"EOR", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"EOR", 3, 4, absoluteXidx, true}, {"LSR", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false},
+        // 0x60
+        {"RTS", 1, 6, implied, false}, {"ADC", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ADC", 2, 3, zeropage, false}, {"ROR", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"PLA", 1, 4, implied, false}, {"ADC", 2, 2, immediate, false}, {"ROR", 1, 2, accumulator, false}, {"---", 1, 2, implied, false},
+        {"JMP", 3, 5, indirect, false}, {"ADC", 3, 4, absolute, false}, {"ROR", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0x70
+        {"BVS", 2, 2, relative, false}, {"ADC", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ADC", 2, 4, zeropageXidx, false}, {"ROR", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"SEI", 1, 2, implied, false}, {"ADC", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"ADC", 3, 4, absoluteXidx, true}, {"ROR", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false},
+        // 0x80
+        {"---", 1, 2, implied, false}, {"STA", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"STY", 2, 3, zeropage, false}, {"STA", 2, 3, zeropage, false}, {"STX", 2, 3, zeropage, false}, {"---", 1, 2, implied, false},
+        {"DEY", 1, 2, implied, false}, {"---", 1, 2, implied, false}, {"TXA", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"STY", 3, 4, absolute, false}, {"STA", 3, 4, absolute, false}, {"STX", 3, 4, absolute, false}, {"---", 1, 2, implied, false},
+        // 0x90
+        {"BCC", 2, 2, relative, false}, {"STA", 2, 6, indirectYidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"STY", 2, 4, zeropageXidx, false}, {"STA", 2, 4, zeropageXidx, false}, {"STX", 2, 4, zeropageYidx, false}, {"---", 1, 2, implied, false},
+        {"TYA", 1, 2, implied, false}, {"STA", 3, 5, absoluteYidx, false}, {"TXS", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"STA", 3, 5, absoluteXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        // 0xA0
+        {"LDY", 2, 2, immediate, false}, {"LDA", 2, 6, indirectXidx, false}, {"LDX", 2, 2, immediate, false}, {"---", 1, 2, implied, false},
+        {"LDY", 2, 3, zeropage, false}, {"LDA", 2, 3, zeropage, false}, {"LDX", 2, 3, zeropage, false}, {"---", 1, 2, implied, false},
+        {"TAY", 1, 2, implied, false}, {"LDA", 2, 2, immediate, false}, {"TAX", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"LDY", 3, 4, absolute, false}, {"LDA", 3, 4, absolute, false}, {"LDX", 3, 4, absolute, false}, {"---", 1, 2, implied, false},
+        // 0xB0
+        {"BCS", 2, 2, relative, false}, {"LDA", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"LDY", 2, 4, zeropageXidx, false}, {"LDA", 2, 4, zeropageXidx, false}, {"LDX", 2, 4, zeropageYidx, false}, {"---", 1, 2, implied, false},
+        {"CLV", 1, 2, implied, false}, {"LDA", 3, 4, absoluteYidx, true}, {"TSX", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"LDY", 3, 4, absoluteXidx, true}, {"LDA", 3, 4, absoluteXidx, true}, {"LDX", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false},
+        // 0xC0
+        {"CPY", 2, 2, immediate, false}, {"CMP", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"CPY", 2, 3, zeropage, false}, {"CMP", 2, 3, zeropage, false}, {"DEC", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"INY", 1, 2, implied, false}, {"CMP", 2, 2, immediate, false}, {"DEX", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"CPY", 3, 4, absolute, false}, {"CMP", 3, 4, absolute, false}, {"DEC", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0xD0
+        {"BNE", 2, 2, relative, false}, {"CMP", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"CMP", 2, 4, zeropageXidx, false}, {"DEC", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"CLD", 1, 2, implied, false}, {"CMP", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"CMP", 3, 4, absoluteXidx, true}, {"DEC", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false},
+        // 0xE0
+        {"CPX", 2, 2, immediate, false}, {"SBC", 2, 6, indirectXidx, false}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"CPX", 2, 3, zeropage, false}, {"SBC", 2, 3, zeropage, false}, {"INC", 2, 5, zeropage, false}, {"---", 1, 2, implied, false},
+        {"INX", 1, 2, implied, false}, {"SBC", 2, 2, immediate, false}, {"NOP", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"CPX", 3, 4, absolute, false}, {"SBC", 3, 4, absolute, false}, {"INC", 3, 6, absolute, false}, {"---", 1, 2, implied, false},
+        // 0xF0
+        {"BEQ", 2, 2, relative, false}, {"SBC", 2, 5, indirectYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"SBC", 2, 4, zeropageXidx, false}, {"INC", 2, 6, zeropageXidx, false}, {"---", 1, 2, implied, false},
+        {"SED", 1, 2, implied, false}, {"SBC", 3, 4, absoluteYidx, true}, {"---", 1, 2, implied, false}, {"---", 1, 2, implied, false},
+        {"---", 1, 2, implied, false}, {"SBC", 3, 4, absoluteXidx, true}, {"INC", 3, 7, absoluteXidx, false}, {"---", 1, 2, implied, false}
+    };
+
 class Cpu {
     
     
@@ -204,62 +300,195 @@ public:
         , Y{}    // Y register
         , A{}    // Accumulator
         , SP{}   // Stack pointer
-        , C{}    // Carry flag
-        , Z{}    // Zero flag
         , I{}    // Interrupt disable
         , D{}    // Decimal mode flag
         , B{}    // Break command
-        , V{}    // Overflow flag
-        , N{}    // Negative flag
-        , opcodeInfoArray{}
+        , nzResult{1}      // Negative and zero flags
+        , carryResult{}    // Carry flag
+        , overflowLhs{}    // Overflow flag
+        , overflowRhs{}
+        , overflowResult{}
+        , cycles{}
+        , nmiPending{}
+        , irqPending{}
+        , decodeCache{}
+        , jit{}
+        , jitEnabled{}
+        , jitThreshold{defaultJitThreshold}
+        , idleSkipEnabled{true}
+        , skippedCycles{}
+        , idleLoopSkips{}
+        , debugger{}
+        , stopRequested{}
     {}
 
     uint16_t PC;
-    int8_t X, Y, A;
-    uint8_t SP, C, Z, I, D, B, V, N;
-    OpInfo opcodeInfoArray[numOpcodes];
-
-    //static const std::string opcodeNameArray[];
-
-    static const uint8_t opcodeByteArray[];
-    
-    static const std::function<void(Cpu&, Memory&, uint16_t)> opcodeArray[];
+    uint8_t X, Y, A;
+    uint8_t SP, I, D, B;
+
+    // N, Z, C and V are evaluated lazily. Instructions only record the
+    // value the flags derive from and each flag is worked out when a
+    // branch, PHP, BRK or getStatus() reads it.
+    // Z is set when the low byte of nzResult is zero and N when bit 7 or
+    // bit 8 is set. Bit 8 lets BIT report N independently of Z.
+    uint16_t nzResult;
+    // C is bit 8 of the last 9-bit add, compare or shift result
+    uint16_t carryResult;
+    // V is recomputed from the operands and result of the last ADC/SBC
+    uint8_t overflowLhs, overflowRhs, overflowResult;
+
+    // Total CPU cycles elapsed since power on
+    uint64_t cycles;
+
+    // Interrupt lines, sampled between instruction batches
+    bool nmiPending;
+    bool irqPending;
+
+    // Decoded basic blocks keyed by their starting PC
+    DecodeCache decodeCache;
+
+    // Native translations of hot blocks. Off by default so the interpreter
+    // can serve as the reference when comparing the two.
+    Jit jit;
+    bool jitEnabled;
+    // Interpreted runs of a block before it is translated
+    uint32_t jitThreshold;
+    static const uint32_t defaultJitThreshold = 64;
+
+    // Polling loops that can't change anything until an external event
+    // (VBlank, IRQ, end of the budget) are fast-forwarded by whole
+    // iterations. The cycle count is the same as running them.
+    bool idleSkipEnabled;
+    // Cycles fast-forwarded and how many times a loop was skipped
+    uint64_t skippedCycles;
+    uint64_t idleLoopSkips;
+
+    // Breakpoints and watchpoints. While attached, run() uses its debug
+    // instantiation, which steps one instruction at a time.
+    Debugger* debugger;
+
+    // Set by I/O handlers to end run() after the current batch, when the
+    // access moves an event the budget was cut short for
+    bool stopRequested;
+
+    // Decoded-instruction entry point for every opcode
+    static const OpFunction opcodeFunctionArray[numOpcodes];
 
     std::string flagString();
 
-    void setupOpcodes();
+    uint8_t carryFlag() const { return (carryResult >> 8) & 1; }
+    uint8_t zeroFlag() const { return (nzResult & 0xFF) == 0 ? 1 : 0; }
+    uint8_t negativeFlag() const { return (nzResult & 0x180) != 0 ? 1 : 0; }
+    uint8_t overflowFlag() const { return ((overflowLhs ^ overflowResult) & (overflowRhs ^ overflowResult)) >> 7; }
+
+    void setCarry(uint8_t set) { carryResult = set ? 0x100 : 0; }
+    void setNegativeZero(uint8_t negative, uint8_t zero) { nzResult = (zero ? 0 : 1) | (negative ? 0x100 : 0); }
+    void setOverflow(uint8_t set) { overflowLhs = 0; overflowRhs = 0; overflowResult = set ? 0x80 : 0; }
 
     void reset(Memory& mem);
-    
+
+    // Fetch, decode and execute the instruction at PC
+    void step(Memory& mem);
+
+    // Execute instructions until cycleBudget cycles have elapsed. The budget
+    // and pending interrupts are only checked between batches of
+    // instructions. Returns how many cycles ran past the budget.
+    int64_t run(Memory& mem, int64_t cycleBudget);
+
+    // run() with or without debugging. The plain instantiation has no
+    // debugger checks; the debug one checks the breakpoint bitmap before
+    // every instruction and stops when the debugger does.
+    template<bool Debug>
+    int64_t runLoop(Memory& mem, int64_t cycleBudget);
+
+    // Save or restore registers, flags, cycle count and pending interrupts
+    void saveState(std::ostream& out);
+    bool loadState(std::istream& in);
+
+    // Translate hot blocks to native code, or run purely interpreted
+    void setJitEnabled(bool enabled) { jitEnabled = enabled; }
+
+    // Fast-forward idle loops, or run every iteration
+    void setIdleSkipEnabled(bool enabled) { idleSkipEnabled = enabled; }
+
+    // Attach a debugger, or detach with null. The bus must be given the same
+    // debugger so watchpoints are trapped.
+    void setDebugger(Debugger* debugger) { this->debugger = debugger; }
+
+    // Return from run() after the current batch of instructions, without
+    // fast-forwarding an idle loop
+    void requestStop() { stopRequested = true; }
+
     /////////////////////////////////////
-    // PPU control operations
+    // Interrupts
     /////////////////////////////////////
 
-    // Enable 8x8 or 8x16 sprites
-    void enableSpriteMode(Memory& mem, NesPpu::SpriteType);
-    
-    // Disable non-maskable interrupt on V-Blank
-    void disableNMI(Memory& mem);
+    // Signal a non-maskable interrupt
+    void triggerNMI();
+
+    // Assert or release the IRQ line
+    void setIRQ(bool asserted);
+
+    // Push PC and status and jump through an interrupt vector
+    void interrupt(Memory& mem, uint16_t vector);
+
+    /////////////////////////////////////
+    // Instruction dispatch
+    /////////////////////////////////////
+
+    // Execute opcode Op with its addressing mode resolved at compile time
+    template<uint8_t Op>
+    void execute(Memory& mem);
 
+    // Execute opcode Op given its already fetched operand
+    template<uint8_t Op>
+    void executeOperand(Memory& mem, uint16_t operand);
 
+    // Resolve the effective address of an operand for the given addressing
+    // mode, charging a cycle for page crossings when PageCrossCycle is set
+    template<AddressMode Mode, bool PageCrossCycle>
+    uint16_t resolveAddress(Memory& mem, uint16_t operand);
+
+    // Operand of an instruction at a resolved address. Accumulator mode
+    // reads A, so each instruction/mode pair compiles without a mode check.
+    template<AddressMode Mode>
+    uint8_t fetch(Memory& mem, uint16_t address);
+
+    // Write an instruction's result back to its operand, or to A in
+    // accumulator mode
+    template<AddressMode Mode>
+    void store(Memory& mem, uint16_t address, uint8_t value);
+
+    // Read a little-endian 16-bit value
+    uint16_t read16(Memory& mem, uint16_t address);
+
+    // Take a relative branch, adding the taken and page-cross cycles
+    void branch(uint16_t address);
+
+    // Processor status byte as pushed by PHP, BRK and interrupts
+    uint8_t getStatus(bool breakFlag) const;
+
+    // Restore flags from a status byte pulled by PLP and RTI
+    void setStatus(uint8_t status);
+    
     /////////////////////////////////////
     // Stack operations
     /////////////////////////////////////
 
     // Push 8-bit value to stack
-    void push(Memory& mem, int8_t value);
+    void push(Memory& mem, uint8_t value);
 
     // Push 16-bit value to stack
-    void push16(Memory& mem, int16_t value);
+    void push16(Memory& mem, uint16_t value);
 
     // Pop value from stack   
-    int8_t pop(Memory& mem);
+    uint8_t pop(Memory& mem);
 
     // Pop 16-bit value from stack
-    int16_t pop16(Memory& mem);
+    uint16_t pop16(Memory& mem);
 
     // Peek at value on stack
-    int8_t peek(Memory& mem);
+    uint8_t peek(Memory& mem);
 
 
 
@@ -268,12 +497,15 @@ public:
     /////////////////////////////////////
 
     // Add with carry
+    template<AddressMode Mode>
     void ADC(Memory& mem, uint16_t address);
 
     // Logical and
+    template<AddressMode Mode>
     void AND(Memory& mem, uint16_t address);
 
     // Arithmetic shift left
+    template<AddressMode Mode>
     void ASL(Memory& mem, uint16_t address);
 
     // Branch if carry clear
@@ -286,6 +518,7 @@ public:
     void BEQ(Memory& mem, uint16_t address);
 
     // Bit test
+    template<AddressMode Mode>
     void BIT(Memory& mem, uint16_t address);
 
     // Branch if minus
@@ -319,15 +552,19 @@ public:
     void CLV(Memory& mem, uint16_t address);
 
     // Compare accumulator
+    template<AddressMode Mode>
     void CMP(Memory& mem, uint16_t address);
 
     // Compare X register
+    template<AddressMode Mode>
     void CPX(Memory& mem, uint16_t address);
 
     // Compare Y register
+    template<AddressMode Mode>
     void CPY(Memory& mem, uint16_t address);
 
     // Decrement memory
+    template<AddressMode Mode>
     void DEC(Memory& mem, uint16_t address);
 
     // Decrement X register
@@ -337,9 +574,11 @@ public:
     void DEY(Memory& mem, uint16_t address);
     
     // Exclusive or
+    template<AddressMode Mode>
     void EOR(Memory& mem, uint16_t address);
 
     // Increment memory
+    template<AddressMode Mode>
     void INC(Memory& mem, uint16_t address);
 
     // Increment X register
@@ -355,21 +594,26 @@ public:
     void JSR(Memory& mem, uint16_t address);
 
     // Load accumulator
+    template<AddressMode Mode>
     void LDA(Memory& mem, uint16_t address);
     
     // Load X register
+    template<AddressMode Mode>
     void LDX(Memory& mem, uint16_t address);
 
     // Load Y register
+    template<AddressMode Mode>
     void LDY(Memory& mem, uint16_t address);
 
     // Logical shift right
+    template<AddressMode Mode>
     void LSR(Memory& mem, uint16_t address);
 
     // No operation
     void NOP(Memory& mem, uint16_t address);
 
     // Logical inclusive or
+    template<AddressMode Mode>
     void ORA(Memory& mem, uint16_t address);
 
     // Push accumulator
@@ -385,9 +629,11 @@ public:
     void PLP(Memory& mem, uint16_t address);
 
     // Rotate left
+    template<AddressMode Mode>
     void ROL(Memory& mem, uint16_t address);
 
     // Rotate right
+    template<AddressMode Mode>
     void ROR(Memory& mem, uint16_t address);
 
     // Return from interrupt
@@ -397,6 +643,7 @@ public:
     void RTS(Memory& mem, uint16_t address);
 
     // Subtract with carry
+    template<AddressMode Mode>
     void SBC(Memory& mem, uint16_t address);
 
     // Set carry flag
@@ -409,12 +656,15 @@ public:
     void SEI(Memory& mem, uint16_t address);
 
     // Store accumulator
+    template<AddressMode Mode>
     void STA(Memory& mem, uint16_t address);
 
     // Store X register
+    template<AddressMode Mode>
     void STX(Memory& mem, uint16_t address);
 
     // Store Y register
+    template<AddressMode Mode>
     void STY(Memory& mem, uint16_t address);
 
     // Transfer accumulator to X
@@ -0,0 +1,75 @@
+#include "Debugger.h"
+
+void Debugger::setWatchpoint(uint16_t start, uint16_t end, uint8_t types, bool set)
+{
+    for (uint32_t address = start; address <= end; ++address)
+    {
+        if (types & watchRead)
+        {
+            setBit(readWatches, static_cast<uint16_t>(address), set);
+        }
+        if (types & watchWrite)
+        {
+            setBit(writeWatches, static_cast<uint16_t>(address), set);
+        }
+    }
+    watchesChanged = true;
+}
+
+bool Debugger::isPageWatched(uint8_t page) const
+{
+    // A page is four words of each bitmap
+    const uint32_t first = page * 4;
+    for (uint32_t word = first; word < first + 4; ++word)
+    {
+        if (readWatches[word] | writeWatches[word])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Debugger::checkBreakpoint(uint16_t address)
+{
+    instructionPc = address;
+    if (!isBreakpoint(address))
+    {
+        return false;
+    }
+    if (resuming && resumePc == address)
+    {
+        return false;
+    }
+    stop(debugBreakpoint, address, 0);
+    resumePc = address;
+    resuming = true;
+    return true;
+}
+
+bool Debugger::takeWatchChanges()
+{
+    const bool changed = watchesChanged;
+    watchesChanged = false;
+    return changed;
+}
+
+void Debugger::setBit(uint64_t* bits, uint16_t address, bool set)
+{
+    const uint64_t mask = 1ull << (address & 63);
+    bits[address >> 6] = set ? (bits[address >> 6] | mask) : (bits[address >> 6] & ~mask);
+}
+
+void Debugger::stop(DebugEventType type, uint16_t address, uint8_t value)
+{
+    if (stopped)
+    {
+        return;
+    }
+    stopped = true;
+    event.type = type;
+    event.pc = instructionPc;
+    event.address = address;
+    event.value = value;
+    event.cycle = cycles ? *cycles : 0;
+}
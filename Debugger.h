@@ -0,0 +1,135 @@
+#ifndef DEBUGGER_HXX
+#define DEBUGGER_HXX
+
+#include <stdint.h>
+
+// Kinds of watchpoint, also used as a mask
+enum WatchType : uint8_t
+{
+    watchRead = 1,
+    watchWrite = 2
+};
+
+// What stopped the CPU
+enum DebugEventType : uint8_t
+{
+    debugBreakpoint,
+    debugReadWatch,
+    debugWriteWatch
+};
+
+struct DebugEvent {
+    DebugEventType type;
+    uint16_t pc;        // Instruction that hit
+    uint16_t address;   // PC for breakpoints
+    uint8_t value;      // Value read or written
+    uint64_t cycle;
+};
+
+// Breakpoints on PC and watchpoints on bus addresses, each a 64K-bit
+// bitmap. Attaching a debugger switches the CPU to its debug run loop,
+// which checks the PC bitmap before every instruction, and traps the bus
+// pages holding watched addresses. With no debugger attached the normal
+// loop and accessors run with no checks.
+//
+// The first hit stops the CPU after the instruction that caused it.
+// Running again resumes, stepping over a breakpoint it stopped on.
+class Debugger {
+
+public:
+    Debugger() : breakpoints{}
+        , readWatches{}
+        , writeWatches{}
+        , watchesChanged{}
+        , stopped{}
+        , event{}
+        , resumePc{}
+        , resuming{}
+        , instructionPc{}
+        , cycles{}
+    {}
+
+    void setBreakpoint(uint16_t address, bool set = true) { setBit(breakpoints, address, set); }
+
+    // Watch reads, writes or both (a WatchType mask) of [start, end]
+    void setWatchpoint(uint16_t start, uint16_t end, uint8_t types, bool set = true);
+
+    bool isBreakpoint(uint16_t address) const { return getBit(breakpoints, address); }
+
+    bool isReadWatched(uint16_t address) const { return getBit(readWatches, address); }
+
+    bool isWriteWatched(uint16_t address) const { return getBit(writeWatches, address); }
+
+    // True if any address in a 256-byte bus page is watched
+    bool isPageWatched(uint8_t page) const;
+
+    // Where the cycle count of events comes from
+    void setClock(const uint64_t* cycles) { this->cycles = cycles; }
+
+    /////////////////////////////////////
+    // Called by the CPU and bus
+    /////////////////////////////////////
+
+    // Called with the PC of each instruction before it runs. Stop if it has
+    // a breakpoint, unless execution is resuming from it.
+    bool checkBreakpoint(uint16_t address);
+
+    // An instruction ran, so a breakpoint it resumed from counts again
+    void stepped() { resuming = false; }
+
+    void checkRead(uint16_t address, uint8_t value)
+    {
+        if (isReadWatched(address))
+        {
+            stop(debugReadWatch, address, value);
+        }
+    }
+
+    void checkWrite(uint16_t address, uint8_t value)
+    {
+        if (isWriteWatched(address))
+        {
+            stop(debugWriteWatch, address, value);
+        }
+    }
+
+    // True once, after watchpoints change, so the bus re-traps its pages
+    bool takeWatchChanges();
+
+    /////////////////////////////////////
+    // Stop state
+    /////////////////////////////////////
+
+    bool isStopped() const { return stopped; }
+
+    const DebugEvent& getEvent() const { return event; }
+
+    // Clear the stop so the CPU can run again
+    void resume() { stopped = false; }
+
+private:
+    static bool getBit(const uint64_t* bits, uint16_t address) { return (bits[address >> 6] >> (address & 63)) & 1; }
+
+    static void setBit(uint64_t* bits, uint16_t address, bool set);
+
+    // Record the first event and stop
+    void stop(DebugEventType type, uint16_t address, uint8_t value);
+
+    uint64_t breakpoints[0x10000 / 64];
+    uint64_t readWatches[0x10000 / 64];
+    uint64_t writeWatches[0x10000 / 64];
+    bool watchesChanged;
+
+    bool stopped;
+    DebugEvent event;
+
+    // The breakpoint the CPU stopped on, skipped once when it resumes
+    uint16_t resumePc;
+    bool resuming;
+
+    // Address of the instruction being run, for events
+    uint16_t instructionPc;
+    const uint64_t* cycles;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include "DecodeCache.h"
+#include "Cpu.h"
+#include "Ppu.h"
+#include <cstring>
+
+namespace {
+
+// Instructions after which execution doesn't continue at the next byte
+bool endsBlock(uint8_t op)
+{
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[op];
+    if (info.addressMode == NesCpu::relative)
+    {
+        return true;
+    }
+
+    switch (op)
+    {
+    case 0x00: // BRK
+    case 0x20: // JSR
+    case 0x40: // RTI
+    case 0x4C: // JMP absolute
+    case 0x60: // RTS
+    case 0x6C: // JMP indirect
+        return true;
+    default:
+        // Unused opcodes stop decoding so they report their error when reached
+        return info.opcode[0] == '-';
+    }
+}
+
+
+// True for $2000-$5FFF, where reads may have side effects
+bool isIoAddress(uint32_t address)
+{
+    return address >= 0x2000 && address < 0x6000;
+}
+
+// Instructions that can be repeated without changing anything but
+// registers and flags. The only I/O read allowed is PPU status (and its
+// mirrors), which games poll while waiting for VBlank.
+bool isSideEffectFree(const NesCpu::DecodedOp& op)
+{
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[op.opcode];
+    static const char* const pureOps[] = {
+        "LDA", "LDX", "LDY", "AND", "ORA", "EOR", "ADC", "SBC", "CMP", "CPX", "CPY", "BIT",
+        "INX", "INY", "DEX", "DEY", "TAX", "TAY", "TXA", "TYA", "TSX",
+        "CLC", "SEC", "CLV", "CLD", "SED", "NOP"
+    };
+
+    bool pure = info.addressMode == NesCpu::relative || op.opcode == 0x4C; // JMP absolute
+    for (const char* pureOp : pureOps)
+    {
+        pure = pure || std::strcmp(info.opcode, pureOp) == 0;
+    }
+    if (!pure)
+    {
+        return false;
+    }
+
+    switch (info.addressMode)
+    {
+    case NesCpu::zeropage:
+    case NesCpu::absolute:
+        return op.opcode == 0x4C || !isIoAddress(op.operand) || (op.operand & 0xE007) == NesPpu::ppuStatusRegister;
+    case NesCpu::absoluteXidx:
+    case NesCpu::absoluteYidx:
+        // Every address the index can reach has to be outside I/O
+        return op.operand + 0xFFu < 0x2000 || op.operand >= 0x6000;
+    case NesCpu::indirectXidx:
+    case NesCpu::indirectYidx:
+        // The target depends on RAM contents
+        return false;
+    default:
+        return true;
+    }
+}
+
+// A candidate idle loop branches or jumps back to its own start and only
+// touches registers, flags and side-effect-free reads
+bool isIdleCandidate(const NesCpu::DecodedBlock& block)
+{
+    const NesCpu::DecodedOp& last = block.ops.back();
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[last.opcode];
+    uint16_t target = 0;
+    if (info.addressMode == NesCpu::relative)
+    {
+        target = block.end + 1 + static_cast<int8_t>(last.operand);
+    }
+    else if (last.opcode == 0x4C)
+    {
+        target = last.operand;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (target != block.start)
+    {
+        return false;
+    }
+    for (const NesCpu::DecodedOp& op : block.ops)
+    {
+        if (!isSideEffectFree(op))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// True if any instruction reads an I/O register
+bool readsIo(const NesCpu::DecodedBlock& block)
+{
+    for (const NesCpu::DecodedOp& op : block.ops)
+    {
+        const NesCpu::AddressMode mode = NesCpu::opcodeInfoArray[op.opcode].addressMode;
+        if ((mode == NesCpu::zeropage || mode == NesCpu::absolute) && op.opcode != 0x4C && isIoAddress(op.operand))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+NesCpu::DecodedBlock& NesCpu::DecodeCache::getBlock(Memory& mem, uint16_t pc)
+{
+    std::unique_ptr<CachePage>& page = pages[pc >> 8];
+    if (page)
+    {
+        DecodedBlock* block = page->blocks[pc & 0xFF].get();
+        if (block)
+        {
+            return *block;
+        }
+    }
+    return *decodeBlock(mem, pc);
+}
+
+NesCpu::DecodedBlock* NesCpu::DecodeCache::decodeBlock(Memory& mem, uint16_t pc)
+{
+    std::unique_ptr<DecodedBlock> block(new DecodedBlock{});
+    block->start = pc;
+    block->maxCycles = 0;
+    block->ops.reserve(8);
+
+    uint16_t address = pc;
+    for (uint32_t i = 0; i < maxBlockOps; ++i)
+    {
+        const uint8_t op = mem.peek(address);
+        const OpInfo& info = opcodeInfoArray[op];
+
+        DecodedOp decoded;
+        decoded.operation = Cpu::opcodeFunctionArray[op];
+        decoded.operand = 0;
+        decoded.opcode = op;
+        decoded.cycles = info.cycles;
+        if (info.bytes == 2)
+        {
+            decoded.operand = mem.peek(address + 1);
+        }
+        else if (info.bytes == 3)
+        {
+            decoded.operand = mem.peek(address + 1) | (mem.peek(address + 2) << 8);
+        }
+        block->ops.push_back(decoded);
+
+        // Taken branches to another page cost two extra cycles
+        block->maxCycles += info.cycles + (info.pageCrossCycle ? 1 : 0) + (info.addressMode == relative ? 2 : 0);
+        block->end = address + info.bytes - 1;
+        address += info.bytes;
+
+        if (endsBlock(op) || address < pc)
+        {
+            break;
+        }
+    }
+
+    block->idleCandidate = isIdleCandidate(*block);
+    block->pollsIo = block->idleCandidate && readsIo(*block);
+
+    // ROM stays valid for the whole run; RAM pages holding code are watched
+    // so writes to them invalidate the block
+    for (uint32_t p = block->start >> 8; p <= static_cast<uint32_t>(block->end >> 8); ++p)
+    {
+        if (!mem.isRom(p << 8))
+        {
+            mem.watchCodePage(p);
+        }
+    }
+
+    std::unique_ptr<CachePage>& page = pages[pc >> 8];
+    if (!page)
+    {
+        page.reset(new CachePage{});
+    }
+    page->blocks[pc & 0xFF] = std::move(block);
+    return page->blocks[pc & 0xFF].get();
+}
+
+void NesCpu::DecodeCache::flushDirty(Memory& mem)
+{
+    for (uint32_t word = 0; word < 4; ++word)
+    {
+        uint64_t dirty = mem.takeDirtyCodePages(word);
+        for (uint32_t bit = 0; dirty != 0; ++bit, dirty >>= 1)
+        {
+            if (dirty & 1)
+            {
+                flushPage(static_cast<uint8_t>(word * 64 + bit));
+            }
+        }
+    }
+}
+
+void NesCpu::DecodeCache::flushPage(uint8_t page)
+{
+    if (pages[page])
+    {
+        pages[page].reset();
+    }
+
+    // Blocks are at most two pages long, so only the previous page can
+    // hold blocks running into this one
+    const uint8_t previous = page - 1;
+    if (page != 0 && pages[previous])
+    {
+        for (std::unique_ptr<DecodedBlock>& block : pages[previous]->blocks)
+        {
+            if (block && (block->end >> 8) == page)
+            {
+                block.reset();
+            }
+        }
+    }
+}
+
+void NesCpu::DecodeCache::clear()
+{
+    for (std::unique_ptr<CachePage>& page : pages)
+    {
+        page.reset();
+    }
+}
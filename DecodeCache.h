@@ -0,0 +1,74 @@
+#ifndef DECODECACHE_HXX
+#define DECODECACHE_HXX
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "Memory.h"
+
+namespace NesCpu {
+
+class Cpu;
+
+// Executes one pre-decoded instruction given its raw operand
+typedef void (*OpFunction)(Cpu&, Memory&, uint16_t);
+
+// Native translation of a block. Takes the CPU, the bus page table and the
+// bitmap of pages holding decoded code, and returns a JitExit.
+typedef uint32_t (*NativeBlock)(Cpu*, const PageTable*, const uint64_t*);
+
+struct DecodedOp {
+    OpFunction operation;
+    uint16_t operand;
+    uint8_t opcode;
+    uint8_t cycles;
+};
+
+// A straight run of instructions ending at the first branch, jump,
+// return, BRK or unused opcode
+struct DecodedBlock {
+    uint16_t start;
+    uint16_t end;           // Address of the last byte in the block
+    uint32_t maxCycles;     // Worst case including page-cross and branch cycles
+    std::vector<DecodedOp> ops;
+    uint32_t executionCount;
+    NativeBlock native;     // Set once the JIT has translated the block
+    bool jitFailed;         // The block can't be translated
+    bool idleCandidate;     // Loops back to its own start with no side effects
+    bool pollsIo;           // An idle candidate that reads PPU status
+};
+
+// Longest block, which also keeps a block within two 256-byte pages
+static const uint32_t maxBlockOps = 32;
+
+class DecodeCache {
+
+public:
+    DecodeCache() : pages{}
+    {}
+
+    // Find the block starting at pc, decoding it on first use
+    DecodedBlock& getBlock(Memory& mem, uint16_t pc);
+
+    // Drop every block overlapping a page marked dirty in memory
+    void flushDirty(Memory& mem);
+
+    // Drop every block overlapping the given page
+    void flushPage(uint8_t page);
+
+    // Drop every block
+    void clear();
+
+private:
+    struct CachePage {
+        std::unique_ptr<DecodedBlock> blocks[256];
+    };
+
+    DecodedBlock* decodeBlock(Memory& mem, uint16_t pc);
+
+    std::unique_ptr<CachePage> pages[256];
+};
+
+}
+
+#endif
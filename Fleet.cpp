@@ -0,0 +1,140 @@
+#include "Fleet.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// Frames still to run on one console
+struct FrameTask {
+    size_t console;
+    uint64_t frame;
+    uint64_t lastFrame;
+};
+
+// Each worker owns a deque. The owner works from the back; thieves take
+// from the front so they get the task the owner would reach last.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<FrameTask> tasks;
+
+    bool popBack(FrameTask& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.back();
+        tasks.pop_back();
+        return true;
+    }
+
+    bool popFront(FrameTask& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.front();
+        tasks.pop_front();
+        return true;
+    }
+
+    void pushBack(const FrameTask& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+};
+
+}
+
+FleetStats Fleet::run(uint64_t frames, uint32_t threads, const std::vector<uint8_t>* input)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    FleetStats stats{};
+    stats.framesPerWorker.assign(threads, 0);
+    if (consoles.empty() || frames == 0)
+    {
+        return stats;
+    }
+
+    // Deal the consoles out round robin
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < consoles.size(); ++i)
+    {
+        queues[i % threads].tasks.push_back(FrameTask{i, 0, frames});
+    }
+
+    // Consoles with frames left; workers stop when it reaches zero
+    std::atomic<size_t> unfinished(consoles.size());
+    std::atomic<uint64_t> steals(0);
+
+    auto worker = [&](uint32_t self)
+    {
+        uint64_t framesRun = 0;
+        FrameTask task;
+        while (unfinished.load(std::memory_order_acquire) != 0)
+        {
+            bool found = queues[self].popBack(task);
+            for (uint32_t i = 1; !found && i < threads; ++i)
+            {
+                found = queues[(self + i) % threads].popFront(task);
+                if (found)
+                {
+                    steals.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            if (!found)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            Console& console = *consoles[task.console];
+            if (input)
+            {
+                console.setController(0, task.frame < input->size() ? (*input)[task.frame] : 0);
+            }
+            console.run(cpuCyclesPerFrame);
+            ++framesRun;
+
+            if (++task.frame < task.lastFrame)
+            {
+                queues[self].pushBack(task);
+            }
+            else
+            {
+                unfinished.fetch_sub(1, std::memory_order_release);
+            }
+        }
+        stats.framesPerWorker[self] = framesRun;
+    };
+
+    const auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (uint32_t i = 1; i < threads; ++i)
+    {
+        pool.emplace_back(worker, i);
+    }
+    // The calling thread is worker 0
+    worker(0);
+    for (std::thread& thread : pool)
+    {
+        thread.join();
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    stats.frames = frames * consoles.size();
+    stats.steals = steals.load();
+    return stats;
+}
@@ -0,0 +1,42 @@
+#ifndef FLEET_HXX
+#define FLEET_HXX
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "Console.h"
+
+// Totals from one Fleet::run()
+struct FleetStats {
+    uint64_t frames;                        // Frames run across all consoles
+    double seconds;                         // Wall-clock time
+    uint64_t steals;                        // Tasks taken from another worker
+    std::vector<uint64_t> framesPerWorker;
+};
+
+// Runs many independent Consoles on a pool of worker threads. A task runs
+// one frame of one console; workers take their own tasks newest first and
+// steal the oldest task of another worker when they run out. Consoles share
+// no mutable state, so tasks never wait on each other.
+class Fleet {
+
+public:
+    Fleet() : consoles{}
+    {}
+
+    void add(std::unique_ptr<Console> console) { consoles.push_back(std::move(console)); }
+
+    size_t size() const { return consoles.size(); }
+
+    Console& getConsole(size_t index) { return *consoles[index]; }
+
+    // Run every console for the given number of frames using threads workers
+    // (0 for one per hardware thread). Controller 1 is fed input[frame] on
+    // each console when input is given.
+    FleetStats run(uint64_t frames, uint32_t threads, const std::vector<uint8_t>* input = nullptr);
+
+private:
+    std::vector<std::unique_ptr<Console>> consoles;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <chrono>
+#include "FramePipeline.h"
+
+FramePipeline::FramePipeline(NesPpu::PixelFormat format) : converter{format}
+    , frames{new NesPpu::Frame[3]()}
+    , sequence{}
+    , image{new NesPpu::Image()}
+    , pitch{NesPpu::screenWidth * NesPpu::bytesPerPixel(format)}
+    , back{0}
+    , published{}
+    , front{1}
+    , converted{}
+    , dropped{}
+    , middle{2}
+    , stopping{false}
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+}
+
+bool FramePipeline::start(const std::string& videoPath)
+{
+    stop();
+    if (!videoPath.empty())
+    {
+        video.open(videoPath, std::ios::binary | std::ios::trunc);
+        if (!video.is_open())
+        {
+            std::cout << "Error opening video file " << videoPath << '\n';
+            return false;
+        }
+    }
+
+    stopping.store(false);
+    renderThread = std::thread(&FramePipeline::render, this);
+    return true;
+}
+
+void FramePipeline::stop()
+{
+    if (renderThread.joinable())
+    {
+        stopping.store(true, std::memory_order_release);
+        renderThread.join();
+    }
+    if (video.is_open())
+    {
+        video.close();
+    }
+}
+
+NesPpu::Frame* FramePipeline::publish()
+{
+    sequence[back] = ++published;
+    back = middle.exchange(back | fresh, std::memory_order_acq_rel) & slotMask;
+    return &frames[back];
+}
+
+void FramePipeline::render()
+{
+    // Yield a while before sleeping so a frame published just after the
+    // last one was converted isn't held up for a whole sleep
+    const uint32_t spinPolls = 256;
+    uint32_t idlePolls = 0;
+    uint64_t lastSequence = 0;
+    for (;;)
+    {
+        // Read the flag before the middle slot so a final pass sees the
+        // last frame published
+        const bool finished = stopping.load(std::memory_order_acquire);
+        if (middle.load(std::memory_order_relaxed) & fresh)
+        {
+            front = middle.exchange(front, std::memory_order_acq_rel) & slotMask;
+            dropped += sequence[front] - lastSequence - 1;
+            lastSequence = sequence[front];
+
+            converter.convert(frames[front], image->bytes, pitch);
+            if (video.is_open())
+            {
+                video.write(reinterpret_cast<const char*>(image->bytes), NesPpu::screenHeight * pitch);
+            }
+            ++converted;
+            idlePolls = 0;
+        }
+        else if (finished)
+        {
+            break;
+        }
+        else if (++idlePolls < spinPolls)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    video.flush();
+}
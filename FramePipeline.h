@@ -0,0 +1,81 @@
+#ifndef FRAMEPIPELINE_HXX
+#define FRAMEPIPELINE_HXX
+
+#include <stdint.h>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include "Ppu.h"
+#include "ColourConverter.h"
+
+// Converts and outputs finished frames on a render thread while the
+// emulator thread draws the next one. Frames are handed over through a
+// lock-free triple buffer: the emulator draws into the back frame, the
+// render thread reads the front frame, and publishing swaps the back frame
+// with the middle one. Neither side ever waits for the other; if the
+// render thread falls behind, frames it didn't get to are replaced by
+// newer ones and counted as dropped.
+class FramePipeline {
+
+public:
+    explicit FramePipeline(NesPpu::PixelFormat format);
+    ~FramePipeline();
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // Start the render thread, writing every converted frame to videoPath
+    // as raw rows of pixels if it isn't empty. Returns false if the file
+    // can't be opened.
+    bool start(const std::string& videoPath);
+
+    // Convert the last published frame and stop the render thread
+    void stop();
+
+    // Emulator thread: the frame to draw into
+    NesPpu::Frame* getBackFrame() { return &frames[back]; }
+
+    // Emulator thread: hand over the finished back frame and get the next
+    // one to draw into
+    NesPpu::Frame* publish();
+
+    // The most recently converted frame. Only stable once stopped.
+    const NesPpu::Image& getImage() const { return *image; }
+    size_t getPitch() const { return pitch; }
+
+    uint64_t getFramesPublished() const { return published; }
+    uint64_t getFramesConverted() const { return converted; }
+    uint64_t getFramesDropped() const { return dropped; }
+
+private:
+    // Render thread: convert and write each frame as it's published
+    void render();
+
+    // The middle slot's index, with fresh set when it holds a frame the
+    // render thread hasn't taken yet
+    static const uint32_t slotMask = 3;
+    static const uint32_t fresh = 4;
+
+    NesPpu::ColourConverter converter;
+    std::unique_ptr<NesPpu::Frame[]> frames;
+    uint64_t sequence[3];       // Publish count of the frame in each slot
+    std::unique_ptr<NesPpu::Image> image;
+    size_t pitch;
+
+    // Emulator thread's slot and count; render thread's slot and counts
+    uint32_t back;
+    uint64_t published;
+    alignas(64) uint32_t front;
+    uint64_t converted;
+    uint64_t dropped;
+
+    alignas(64) std::atomic<uint32_t> middle;
+
+    std::ofstream video;
+    std::thread renderThread;
+    std::atomic<bool> stopping;
+};
+
+#endif
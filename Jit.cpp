@@ -0,0 +1,1039 @@
+#include "Jit.h"
+#include "Cpu.h"
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#if NES_JIT_SUPPORTED
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace {
+
+#if NES_JIT_SUPPORTED
+
+// Size of the executable buffer shared by all translations of one Cpu
+const size_t jitBufferSize = 512 * 1024;
+
+// Room needed to be sure the next block fits
+const size_t maxBlockCodeSize = 8 * 1024;
+
+enum Reg
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Condition : uint8_t
+{
+    condBelow = 0x2,
+    condAboveEqual = 0x3,
+    condEqual = 0x4,
+    condNotEqual = 0x5
+};
+
+// Byte offset of the write pointers in Memory's PageTable
+const int32_t writePagesOffset = static_cast<int32_t>(offsetof(PageTable, write));
+
+// Host register assignment inside a block
+const int regA = R12;
+const int regX = R13;
+const int regY = R14;
+const int regPages = R15;
+// Internal RAM pages 0 and 1 never move, so their pointers are loaded once
+const int regZeroPage = R10;
+const int regStackPage = R11;
+const int regCpu = RBX;
+const int regCodePages = RBP;
+
+#ifdef _WIN32
+const int regArg0 = RCX;
+const int regArg1 = RDX;
+const int regArg2 = R8;
+#else
+const int regArg0 = RDI;
+const int regArg1 = RSI;
+const int regArg2 = RDX;
+#endif
+
+// [base + index * scale + disp], index < 0 when unused
+struct MemOperand {
+    int base;
+    int index;
+    uint8_t scale;
+    int32_t disp;
+};
+
+MemOperand at(int base, int32_t disp)
+{
+    return MemOperand{base, -1, 1, disp};
+}
+
+MemOperand at(int base, int index, int32_t disp)
+{
+    return MemOperand{base, index, 1, disp};
+}
+
+MemOperand atScaled(int base, int index, uint8_t scale, int32_t disp)
+{
+    return MemOperand{base, index, scale, disp};
+}
+
+// Minimal x86-64 encoder covering the forms the block compiler uses
+class Emitter {
+
+public:
+    std::vector<uint8_t> code;
+
+    size_t size() const { return code.size(); }
+
+    void byte(uint8_t b) { code.push_back(b); }
+
+    void word(uint16_t w)
+    {
+        byte(static_cast<uint8_t>(w));
+        byte(static_cast<uint8_t>(w >> 8));
+    }
+
+    void dword(uint32_t d)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            byte(static_cast<uint8_t>(d >> (8 * i)));
+        }
+    }
+
+    void rex(bool w, int reg, int index, int base)
+    {
+        const uint8_t value = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+        if (value != 0x40)
+        {
+            byte(value);
+        }
+    }
+
+    // Opcode with a memory operand; always uses a 32-bit displacement
+    void memOp(bool operand16, bool w, std::initializer_list<uint8_t> opcode, int reg, const MemOperand& m)
+    {
+        if (operand16)
+        {
+            byte(0x66);
+        }
+        rex(w, reg, m.index < 0 ? 0 : m.index, m.base);
+        for (uint8_t b : opcode)
+        {
+            byte(b);
+        }
+        if (m.index < 0 && (m.base & 7) != RSP)
+        {
+            byte(0x80 | ((reg & 7) << 3) | (m.base & 7));
+        }
+        else
+        {
+            const int index = m.index < 0 ? RSP : m.index;
+            const uint8_t scaleBits = m.scale == 8 ? 3 : (m.scale == 4 ? 2 : (m.scale == 2 ? 1 : 0));
+            byte(0x80 | ((reg & 7) << 3) | RSP);
+            byte((scaleBits << 6) | ((index & 7) << 3) | (m.base & 7));
+        }
+        dword(static_cast<uint32_t>(m.disp));
+    }
+
+    // Opcode with a register operand in r/m
+    void regOp(bool w, std::initializer_list<uint8_t> opcode, int reg, int rm)
+    {
+        rex(w, reg, 0, rm);
+        for (uint8_t b : opcode)
+        {
+            byte(b);
+        }
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void loadByte(int dst, const MemOperand& m) { memOp(false, false, {0x0F, 0xB6}, dst, m); }
+    void loadWord(int dst, const MemOperand& m) { memOp(false, false, {0x0F, 0xB7}, dst, m); }
+    void loadQword(int dst, const MemOperand& m) { memOp(false, true, {0x8B}, dst, m); }
+    void storeByte(const MemOperand& m, int src) { memOp(false, false, {0x88}, src, m); }
+    void storeWord(const MemOperand& m, int src) { memOp(true, false, {0x89}, src, m); }
+    void storeByteImm(const MemOperand& m, uint8_t imm) { memOp(false, false, {0xC6}, 0, m); byte(imm); }
+    void storeWordImm(const MemOperand& m, uint16_t imm) { memOp(true, false, {0xC7}, 0, m); word(imm); }
+    void addQwordImm(const MemOperand& m, int32_t imm) { memOp(false, true, {0x81}, 0, m); dword(imm); }
+    void addQwordReg(const MemOperand& m, int src) { memOp(false, true, {0x01}, src, m); }
+    void testByteImm(const MemOperand& m, uint8_t imm) { memOp(false, false, {0xF6}, 0, m); byte(imm); }
+    void testWordImm(const MemOperand& m, uint16_t imm) { memOp(true, false, {0xF7}, 0, m); word(imm); }
+    void cmpByteImm(const MemOperand& m, uint8_t imm) { memOp(false, false, {0x80}, 7, m); byte(imm); }
+    void lea(int dst, const MemOperand& m) { memOp(false, false, {0x8D}, dst, m); }
+
+    // bt qword [m], bit
+    void btImm(const MemOperand& m, uint8_t bit) { memOp(false, true, {0x0F, 0xBA}, 4, m); byte(bit); }
+    void btReg(const MemOperand& m, int bit) { memOp(false, true, {0x0F, 0xA3}, bit, m); }
+
+    void mov(int dst, int src) { regOp(false, {0x89}, src, dst); }
+    void mov64(int dst, int src) { regOp(true, {0x89}, src, dst); }
+    void movImm(int dst, uint32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        byte(0xB8 + (dst & 7));
+        dword(imm);
+    }
+    void movzxByte(int dst, int src) { regOp(false, {0x0F, 0xB6}, dst, src); }
+
+    void add(int dst, int src) { regOp(false, {0x01}, src, dst); }
+    void sub(int dst, int src) { regOp(false, {0x29}, src, dst); }
+    void andReg(int dst, int src) { regOp(false, {0x21}, src, dst); }
+    void orReg(int dst, int src) { regOp(false, {0x09}, src, dst); }
+    void xorReg(int dst, int src) { regOp(false, {0x31}, src, dst); }
+
+    void aluImm(uint8_t digit, int dst, uint32_t imm) { regOp(false, {0x81}, digit, dst); dword(imm); }
+    void addImm(int dst, uint32_t imm) { aluImm(0, dst, imm); }
+    void orImm(int dst, uint32_t imm) { aluImm(1, dst, imm); }
+    void andImm(int dst, uint32_t imm) { aluImm(4, dst, imm); }
+    void subImm(int dst, uint32_t imm) { aluImm(5, dst, imm); }
+    void xorImm(int dst, uint32_t imm) { aluImm(6, dst, imm); }
+    void cmpImm(int dst, uint32_t imm) { aluImm(7, dst, imm); }
+    void testImm(int dst, uint32_t imm) { regOp(false, {0xF7}, 0, dst); dword(imm); }
+    void test64(int a, int b) { regOp(true, {0x85}, b, a); }
+
+    void shlImm(int dst, uint8_t count) { regOp(false, {0xC1}, 4, dst); byte(count); }
+    void shrImm(int dst, uint8_t count) { regOp(false, {0xC1}, 5, dst); byte(count); }
+
+    void setcc(uint8_t cond, int dst) { regOp(false, {0x0F, static_cast<uint8_t>(0x90 + cond)}, 0, dst); }
+
+    void push(int r) { rex(false, 0, 0, r); byte(0x50 + (r & 7)); }
+    void pop(int r) { rex(false, 0, 0, r); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xC3); }
+
+    // Jumps return the offset of their rel32 field for patching
+    size_t jcc(uint8_t cond)
+    {
+        byte(0x0F);
+        byte(0x80 + cond);
+        dword(0);
+        return size() - 4;
+    }
+
+    size_t jmp()
+    {
+        byte(0xE9);
+        dword(0);
+        return size() - 4;
+    }
+
+    void patch(size_t field, size_t target)
+    {
+        const int32_t rel = static_cast<int32_t>(target) - static_cast<int32_t>(field + 4);
+        std::memcpy(&code[field], &rel, sizeof(rel));
+    }
+};
+
+// Offsets of CPU state from the Cpu object
+struct CpuOffsets {
+    int32_t A, X, Y, SP, D, PC, cycles;
+    int32_t nzResult, carryResult, overflowLhs, overflowRhs, overflowResult;
+};
+
+int32_t offsetIn(const NesCpu::Cpu& cpu, const void* member)
+{
+    return static_cast<int32_t>(static_cast<const char*>(member) - reinterpret_cast<const char*>(&cpu));
+}
+
+// Where native code leaves the block
+struct Exit {
+    std::vector<size_t> jumps;
+    int32_t pc;             // < 0 when the block already stored PC
+    uint32_t cycles;        // Base cycles of the instructions completed so far
+    uint32_t code;
+};
+
+// Translates one DecodedBlock
+class BlockCompiler {
+
+public:
+    BlockCompiler(const NesCpu::Cpu& cpu) : e{}
+        , exits{}
+        , cyclesSoFar{}
+        , pc{}
+    {
+        o.A = offsetIn(cpu, &cpu.A);
+        o.X = offsetIn(cpu, &cpu.X);
+        o.Y = offsetIn(cpu, &cpu.Y);
+        o.SP = offsetIn(cpu, &cpu.SP);
+        o.D = offsetIn(cpu, &cpu.D);
+        o.PC = offsetIn(cpu, &cpu.PC);
+        o.cycles = offsetIn(cpu, &cpu.cycles);
+        o.nzResult = offsetIn(cpu, &cpu.nzResult);
+        o.carryResult = offsetIn(cpu, &cpu.carryResult);
+        o.overflowLhs = offsetIn(cpu, &cpu.overflowLhs);
+        o.overflowRhs = offsetIn(cpu, &cpu.overflowRhs);
+        o.overflowResult = offsetIn(cpu, &cpu.overflowResult);
+    }
+
+    // Returns false if not even the first instruction could be translated
+    bool compile(const NesCpu::DecodedBlock& block);
+
+    Emitter e;
+
+private:
+    MemOperand cpuField(int32_t offset) { return at(regCpu, offset); }
+
+    // Exit before the current instruction so the interpreter runs it
+    void sideExitIf(uint8_t cond);
+
+    // Unconditional exit with the given PC and extra cycles
+    void exitTo(int32_t nextPc, uint32_t extraCycles, uint32_t code);
+
+    void storeNZ(int reg) { e.storeWord(cpuField(o.nzResult), reg); }
+
+    // Load the carry flag into dst as 0 or 1
+    void loadCarry(int dst);
+
+    // Add a cycle when the bases in edx and the address in ecx differ in page
+    void pageCrossCycle();
+
+    // Entries of the bus page table
+    MemOperand readPage(uint8_t page) { return at(regPages, page * 8); }
+    MemOperand writePage(uint8_t page) { return at(regPages, writePagesOffset + page * 8); }
+
+    // Load the host pointer for a page into dst, leaving the block if the
+    // page goes through an I/O handler
+    void loadPagePointer(int dst, const MemOperand& entry);
+
+    // Computes the operand address. Returns true with a static address in
+    // address, or false with the address in ecx.
+    bool operandAddress(const NesCpu::DecodedOp& op, NesCpu::AddressMode mode, bool pageCross, uint16_t& address);
+
+    // Leave eax holding the operand value. Leaves the block for I/O pages.
+    bool readOperand(const NesCpu::DecodedOp& op);
+
+    // Prepare a write (or read-modify-write) target, returning the memory
+    // operand to store to. Leaves the block for I/O pages and pages holding
+    // decoded code. Leaves rcx free.
+    bool writeTarget(const NesCpu::DecodedOp& op, MemOperand& target);
+
+    // Translate one instruction. Returns false when it has to be interpreted.
+    bool instruction(const NesCpu::DecodedOp& op, bool& endsBlock);
+
+    bool branch(const NesCpu::DecodedOp& op);
+
+    CpuOffsets o;
+    std::vector<Exit> exits;
+    uint32_t cyclesSoFar;
+    uint16_t pc;
+};
+
+void BlockCompiler::sideExitIf(uint8_t cond)
+{
+    Exit exit{{e.jcc(cond)}, pc, cyclesSoFar, NesCpu::jitInterpret};
+    exits.push_back(exit);
+}
+
+void BlockCompiler::exitTo(int32_t nextPc, uint32_t extraCycles, uint32_t code)
+{
+    Exit exit{{e.jmp()}, nextPc, cyclesSoFar + extraCycles, code};
+    exits.push_back(exit);
+}
+
+void BlockCompiler::loadCarry(int dst)
+{
+    e.loadWord(dst, cpuField(o.carryResult));
+    e.shrImm(dst, 8);
+    e.andImm(dst, 1);
+}
+
+void BlockCompiler::pageCrossCycle()
+{
+    e.xorReg(RDX, RCX);
+    e.testImm(RDX, 0xFF00);
+    e.setcc(condNotEqual, RDX);
+    e.movzxByte(RDX, RDX);
+    e.addQwordReg(cpuField(o.cycles), RDX);
+}
+
+bool BlockCompiler::operandAddress(const NesCpu::DecodedOp& op, NesCpu::AddressMode mode, bool pageCross, uint16_t& address)
+{
+    switch (mode)
+    {
+    case NesCpu::zeropage:
+    case NesCpu::absolute:
+        address = op.operand;
+        return true;
+    case NesCpu::zeropageXidx:
+    case NesCpu::zeropageYidx:
+        e.lea(RCX, at(mode == NesCpu::zeropageXidx ? regX : regY, op.operand));
+        e.movzxByte(RCX, RCX);
+        return false;
+    case NesCpu::absoluteXidx:
+    case NesCpu::absoluteYidx:
+        e.lea(RCX, at(mode == NesCpu::absoluteXidx ? regX : regY, op.operand));
+        e.andImm(RCX, 0xFFFF);
+        if (pageCross)
+        {
+            e.movImm(RDX, op.operand);
+        }
+        return false;
+    case NesCpu::indirectXidx:
+        e.lea(RCX, at(regX, op.operand));
+        e.movzxByte(RCX, RCX);
+        e.loadByte(RAX, at(regZeroPage, RCX, 0));
+        e.addImm(RCX, 1);
+        e.movzxByte(RCX, RCX);
+        e.loadByte(RCX, at(regZeroPage, RCX, 0));
+        e.shlImm(RCX, 8);
+        e.orReg(RCX, RAX);
+        return false;
+    case NesCpu::indirectYidx:
+        e.loadByte(RCX, at(regZeroPage, op.operand & 0xFF));
+        e.loadByte(RAX, at(regZeroPage, (op.operand + 1) & 0xFF));
+        e.shlImm(RAX, 8);
+        e.orReg(RCX, RAX);
+        e.mov(RDX, RCX);
+        e.add(RCX, regY);
+        e.andImm(RCX, 0xFFFF);
+        return false;
+    default:
+        address = 0;
+        return true;
+    }
+}
+
+void BlockCompiler::loadPagePointer(int dst, const MemOperand& entry)
+{
+    e.loadQword(dst, entry);
+    e.test64(dst, dst);
+    sideExitIf(condEqual);
+}
+
+bool BlockCompiler::readOperand(const NesCpu::DecodedOp& op)
+{
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[op.opcode];
+    if (info.addressMode == NesCpu::immediate)
+    {
+        e.movImm(RAX, op.operand);
+        return true;
+    }
+
+    uint16_t address = 0;
+    if (operandAddress(op, info.addressMode, info.pageCrossCycle, address))
+    {
+        const uint8_t page = address >> 8;
+        if (page == 0)
+        {
+            e.loadByte(RAX, at(regZeroPage, address));
+        }
+        else if (page == 1)
+        {
+            e.loadByte(RAX, at(regStackPage, address & 0xFF));
+        }
+        else
+        {
+            loadPagePointer(RAX, readPage(page));
+            e.loadByte(RAX, at(RAX, address & 0xFF));
+        }
+        return true;
+    }
+
+    const bool zeropageIndexed = info.addressMode == NesCpu::zeropageXidx || info.addressMode == NesCpu::zeropageYidx;
+    if (zeropageIndexed)
+    {
+        e.loadByte(RAX, at(regZeroPage, RCX, 0));
+        return true;
+    }
+
+    e.mov(R8, RCX);
+    e.shrImm(R8, 8);
+    e.loadQword(R8, atScaled(regPages, R8, 8, 0));
+    e.test64(R8, R8);
+    sideExitIf(condEqual);
+    if (info.pageCrossCycle)
+    {
+        pageCrossCycle();
+    }
+    e.movzxByte(R9, RCX);
+    e.loadByte(RAX, at(R8, R9, 0));
+    return true;
+}
+
+bool BlockCompiler::writeTarget(const NesCpu::DecodedOp& op, MemOperand& target)
+{
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[op.opcode];
+    uint16_t address = 0;
+    if (operandAddress(op, info.addressMode, false, address))
+    {
+        // Writes over decoded code go through the interpreter so the
+        // decode cache sees them
+        const uint8_t page = address >> 8;
+        e.btImm(at(regCodePages, (page >> 6) * 8), page & 63);
+        sideExitIf(condBelow);
+        if (page == 0)
+        {
+            target = at(regZeroPage, address);
+        }
+        else if (page == 1)
+        {
+            target = at(regStackPage, address & 0xFF);
+        }
+        else
+        {
+            loadPagePointer(R8, writePage(page));
+            target = at(R8, address & 0xFF);
+        }
+        return true;
+    }
+
+    const bool zeropageIndexed = info.addressMode == NesCpu::zeropageXidx || info.addressMode == NesCpu::zeropageYidx;
+    if (zeropageIndexed)
+    {
+        e.btImm(at(regCodePages, 0), 0);
+        sideExitIf(condBelow);
+        e.mov(R9, RCX);
+        target = at(regZeroPage, R9, 0);
+        return true;
+    }
+
+    e.mov(RAX, RCX);
+    e.shrImm(RAX, 8);
+    e.btReg(at(regCodePages, 0), RAX);
+    sideExitIf(condBelow);
+    e.loadQword(R8, atScaled(regPages, RAX, 8, writePagesOffset));
+    e.test64(R8, R8);
+    sideExitIf(condEqual);
+    e.movzxByte(R9, RCX);
+    target = at(R8, R9, 0);
+    return true;
+}
+
+bool BlockCompiler::branch(const NesCpu::DecodedOp& op)
+{
+    const uint16_t nextPc = pc + 2;
+    const uint16_t target = nextPc + static_cast<int8_t>(op.operand);
+    uint8_t takenCondition = condNotEqual;
+
+    switch (op.opcode)
+    {
+    case 0x90: // BCC
+    case 0xB0: // BCS
+        e.testWordImm(cpuField(o.carryResult), 0x100);
+        takenCondition = op.opcode == 0xB0 ? condNotEqual : condEqual;
+        break;
+    case 0xF0: // BEQ
+    case 0xD0: // BNE
+        e.cmpByteImm(cpuField(o.nzResult), 0);
+        takenCondition = op.opcode == 0xF0 ? condEqual : condNotEqual;
+        break;
+    case 0x30: // BMI
+    case 0x10: // BPL
+        e.testWordImm(cpuField(o.nzResult), 0x180);
+        takenCondition = op.opcode == 0x30 ? condNotEqual : condEqual;
+        break;
+    case 0x70: // BVS
+    case 0x50: // BVC
+        e.loadByte(RAX, cpuField(o.overflowLhs));
+        e.loadByte(RCX, cpuField(o.overflowResult));
+        e.xorReg(RAX, RCX);
+        e.loadByte(RDX, cpuField(o.overflowRhs));
+        e.xorReg(RDX, RCX);
+        e.andReg(RAX, RDX);
+        e.testImm(RAX, 0x80);
+        takenCondition = op.opcode == 0x70 ? condNotEqual : condEqual;
+        break;
+    default:
+        return false;
+    }
+
+    const uint32_t takenCycles = op.cycles + (((nextPc ^ target) & 0xFF00) != 0 ? 2 : 1);
+    Exit taken{{e.jcc(takenCondition)}, target, cyclesSoFar + takenCycles, NesCpu::jitBlockDone};
+    exits.push_back(taken);
+    exitTo(nextPc, op.cycles, NesCpu::jitBlockDone);
+    return true;
+}
+
+bool BlockCompiler::instruction(const NesCpu::DecodedOp& op, bool& endsBlock)
+{
+    const NesCpu::OpInfo& info = NesCpu::opcodeInfoArray[op.opcode];
+    const uint16_t nextPc = pc + info.bytes;
+    const char* name = info.opcode;
+    MemOperand target{};
+    endsBlock = false;
+
+    if (info.addressMode == NesCpu::relative)
+    {
+        endsBlock = true;
+        return branch(op);
+    }
+
+    // Opcodes are matched by mnemonic since each has several addressing modes
+    const uint32_t mnemonic = (name[0] << 16) | (name[1] << 8) | name[2];
+    switch (mnemonic)
+    {
+#define MNEMONIC(a, b, c) ((a << 16) | (b << 8) | c)
+    case MNEMONIC('L', 'D', 'A'):
+    case MNEMONIC('L', 'D', 'X'):
+    case MNEMONIC('L', 'D', 'Y'):
+    {
+        const int reg = name[2] == 'A' ? regA : (name[2] == 'X' ? regX : regY);
+        if (!readOperand(op))
+        {
+            return false;
+        }
+        e.mov(reg, RAX);
+        storeNZ(reg);
+        return true;
+    }
+    case MNEMONIC('S', 'T', 'A'):
+    case MNEMONIC('S', 'T', 'X'):
+    case MNEMONIC('S', 'T', 'Y'):
+    {
+        const int reg = name[2] == 'A' ? regA : (name[2] == 'X' ? regX : regY);
+        if (!writeTarget(op, target))
+        {
+            return false;
+        }
+        e.storeByte(target, reg);
+        return true;
+    }
+    case MNEMONIC('A', 'N', 'D'):
+    case MNEMONIC('O', 'R', 'A'):
+    case MNEMONIC('E', 'O', 'R'):
+        if (!readOperand(op))
+        {
+            return false;
+        }
+        if (name[0] == 'A')
+        {
+            e.andReg(regA, RAX);
+        }
+        else if (name[0] == 'O')
+        {
+            e.orReg(regA, RAX);
+        }
+        else
+        {
+            e.xorReg(regA, RAX);
+        }
+        storeNZ(regA);
+        return true;
+    case MNEMONIC('A', 'D', 'C'):
+    case MNEMONIC('S', 'B', 'C'):
+        if (!readOperand(op))
+        {
+            return false;
+        }
+        if (name[0] == 'S')
+        {
+            // A - M - (1 - C) is the same as A + ~M + C
+            e.xorImm(RAX, 0xFF);
+        }
+        loadCarry(RCX);
+        e.storeByte(cpuField(o.overflowLhs), regA);
+        e.storeByte(cpuField(o.overflowRhs), RAX);
+        e.lea(RDX, at(regA, RAX, 0));
+        e.add(RDX, RCX);
+        e.storeWord(cpuField(o.carryResult), RDX);
+        e.movzxByte(regA, RDX);
+        e.storeByte(cpuField(o.overflowResult), regA);
+        storeNZ(regA);
+        return true;
+    case MNEMONIC('C', 'M', 'P'):
+    case MNEMONIC('C', 'P', 'X'):
+    case MNEMONIC('C', 'P', 'Y'):
+    {
+        const int reg = name[2] == 'P' ? regA : (name[2] == 'X' ? regX : regY);
+        if (!readOperand(op))
+        {
+            return false;
+        }
+        e.mov(RDX, reg);
+        e.sub(RDX, RAX);
+        e.movzxByte(RDX, RDX);
+        storeNZ(RDX);
+        e.xorImm(RAX, 0xFF);
+        e.lea(RDX, at(reg, RAX, 1));
+        e.storeWord(cpuField(o.carryResult), RDX);
+        return true;
+    }
+    case MNEMONIC('B', 'I', 'T'):
+        if (!readOperand(op))
+        {
+            return false;
+        }
+        e.mov(RDX, regA);
+        e.andReg(RDX, RAX);
+        e.mov(RCX, RAX);
+        e.andImm(RCX, 0x80);
+        e.shlImm(RCX, 1);
+        e.orReg(RDX, RCX);
+        storeNZ(RDX);
+        e.storeByteImm(cpuField(o.overflowLhs), 0);
+        e.storeByteImm(cpuField(o.overflowRhs), 0);
+        e.shlImm(RAX, 1);
+        e.andImm(RAX, 0x80);
+        e.storeByte(cpuField(o.overflowResult), RAX);
+        return true;
+    case MNEMONIC('I', 'N', 'C'):
+    case MNEMONIC('D', 'E', 'C'):
+    case MNEMONIC('A', 'S', 'L'):
+    case MNEMONIC('L', 'S', 'R'):
+    case MNEMONIC('R', 'O', 'L'):
+    case MNEMONIC('R', 'O', 'R'):
+    {
+        const bool onA = info.addressMode == NesCpu::accumulator;
+        if (onA)
+        {
+            e.mov(RAX, regA);
+        }
+        else if (writeTarget(op, target))
+        {
+            e.loadByte(RAX, target);
+        }
+        else
+        {
+            return false;
+        }
+        if (name[0] == 'I')
+        {
+            e.addImm(RAX, 1);
+        }
+        else if (name[0] == 'D')
+        {
+            e.subImm(RAX, 1);
+        }
+        else if (name[0] == 'A')
+        {
+            e.shlImm(RAX, 1);
+            e.storeWord(cpuField(o.carryResult), RAX);
+        }
+        else if (name[0] == 'L')
+        {
+            e.mov(RDX, RAX);
+            e.shlImm(RDX, 8);
+            e.storeWord(cpuField(o.carryResult), RDX);
+            e.shrImm(RAX, 1);
+        }
+        else if (name[2] == 'L')
+        {
+            loadCarry(RDX);
+            e.shlImm(RAX, 1);
+            e.orReg(RAX, RDX);
+            e.storeWord(cpuField(o.carryResult), RAX);
+        }
+        else
+        {
+            loadCarry(RCX);
+            e.shlImm(RCX, 7);
+            e.mov(RDX, RAX);
+            e.shlImm(RDX, 8);
+            e.storeWord(cpuField(o.carryResult), RDX);
+            e.shrImm(RAX, 1);
+            e.orReg(RAX, RCX);
+        }
+        e.movzxByte(RAX, RAX);
+        if (onA)
+        {
+            e.mov(regA, RAX);
+        }
+        else
+        {
+            e.storeByte(target, RAX);
+        }
+        storeNZ(RAX);
+        return true;
+    }
+    case MNEMONIC('I', 'N', 'X'):
+    case MNEMONIC('I', 'N', 'Y'):
+    case MNEMONIC('D', 'E', 'X'):
+    case MNEMONIC('D', 'E', 'Y'):
+    {
+        const int reg = name[2] == 'X' ? regX : regY;
+        if (name[0] == 'I')
+        {
+            e.addImm(reg, 1);
+        }
+        else
+        {
+            e.subImm(reg, 1);
+        }
+        e.andImm(reg, 0xFF);
+        storeNZ(reg);
+        return true;
+    }
+    case MNEMONIC('T', 'A', 'X'):
+        e.mov(regX, regA);
+        storeNZ(regX);
+        return true;
+    case MNEMONIC('T', 'A', 'Y'):
+        e.mov(regY, regA);
+        storeNZ(regY);
+        return true;
+    case MNEMONIC('T', 'X', 'A'):
+        e.mov(regA, regX);
+        storeNZ(regA);
+        return true;
+    case MNEMONIC('T', 'Y', 'A'):
+        e.mov(regA, regY);
+        storeNZ(regA);
+        return true;
+    case MNEMONIC('T', 'S', 'X'):
+        e.loadByte(regX, cpuField(o.SP));
+        storeNZ(regX);
+        return true;
+    case MNEMONIC('T', 'X', 'S'):
+        e.storeByte(cpuField(o.SP), regX);
+        return true;
+    case MNEMONIC('C', 'L', 'C'):
+        e.storeWordImm(cpuField(o.carryResult), 0);
+        return true;
+    case MNEMONIC('S', 'E', 'C'):
+        e.storeWordImm(cpuField(o.carryResult), 0x100);
+        return true;
+    case MNEMONIC('C', 'L', 'V'):
+        e.storeByteImm(cpuField(o.overflowLhs), 0);
+        e.storeByteImm(cpuField(o.overflowRhs), 0);
+        e.storeByteImm(cpuField(o.overflowResult), 0);
+        return true;
+    case MNEMONIC('C', 'L', 'D'):
+        e.storeByteImm(cpuField(o.D), 0);
+        return true;
+    case MNEMONIC('S', 'E', 'D'):
+        e.storeByteImm(cpuField(o.D), 1);
+        return true;
+    case MNEMONIC('N', 'O', 'P'):
+        return true;
+    case MNEMONIC('P', 'H', 'A'):
+    case MNEMONIC('J', 'S', 'R'):
+        // Stack writes go through the interpreter if page 1 holds code
+        e.btImm(at(regCodePages, 0), 1);
+        sideExitIf(condBelow);
+        e.loadByte(RCX, cpuField(o.SP));
+        if (name[0] == 'P')
+        {
+            e.storeByte(at(regStackPage, RCX, 0), regA);
+        }
+        else
+        {
+            const uint16_t returnAddress = nextPc - 1;
+            e.storeByteImm(at(regStackPage, RCX, 0), returnAddress >> 8);
+            e.subImm(RCX, 1);
+            e.movzxByte(RCX, RCX);
+            e.storeByteImm(at(regStackPage, RCX, 0), returnAddress & 0xFF);
+        }
+        e.subImm(RCX, 1);
+        e.storeByte(cpuField(o.SP), RCX);
+        if (name[0] == 'J')
+        {
+            endsBlock = true;
+            exitTo(op.operand, op.cycles, NesCpu::jitBlockDone);
+        }
+        return true;
+    case MNEMONIC('P', 'L', 'A'):
+        e.loadByte(RCX, cpuField(o.SP));
+        e.addImm(RCX, 1);
+        e.movzxByte(RCX, RCX);
+        e.storeByte(cpuField(o.SP), RCX);
+        e.loadByte(regA, at(regStackPage, RCX, 0));
+        storeNZ(regA);
+        return true;
+    case MNEMONIC('R', 'T', 'S'):
+        e.loadByte(RCX, cpuField(o.SP));
+        e.addImm(RCX, 1);
+        e.movzxByte(RCX, RCX);
+        e.loadByte(RAX, at(regStackPage, RCX, 0));
+        e.addImm(RCX, 1);
+        e.movzxByte(RCX, RCX);
+        e.loadByte(RDX, at(regStackPage, RCX, 0));
+        e.storeByte(cpuField(o.SP), RCX);
+        e.shlImm(RDX, 8);
+        e.orReg(RAX, RDX);
+        e.addImm(RAX, 1);
+        e.storeWord(cpuField(o.PC), RAX);
+        endsBlock = true;
+        exitTo(-1, op.cycles, NesCpu::jitBlockDone);
+        return true;
+    case MNEMONIC('J', 'M', 'P'):
+        if (info.addressMode != NesCpu::absolute)
+        {
+            return false;
+        }
+        endsBlock = true;
+        exitTo(op.operand, op.cycles, NesCpu::jitBlockDone);
+        return true;
+#undef MNEMONIC
+    default:
+        // BRK, RTI, PHP, PLP, CLI, SEI and unused opcodes
+        return false;
+    }
+}
+
+bool BlockCompiler::compile(const NesCpu::DecodedBlock& block)
+{
+    // Prologue: save callee-saved registers and load A, X and Y
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.push(R15);
+    e.mov64(regCpu, regArg0);
+    e.mov64(regPages, regArg1);
+    e.mov64(regCodePages, regArg2);
+    e.loadQword(regZeroPage, readPage(0));
+    e.loadQword(regStackPage, readPage(1));
+    e.loadByte(regA, cpuField(o.A));
+    e.loadByte(regX, cpuField(o.X));
+    e.loadByte(regY, cpuField(o.Y));
+
+    pc = block.start;
+    bool ended = false;
+    size_t translated = 0;
+    for (const NesCpu::DecodedOp& op : block.ops)
+    {
+        const size_t mark = e.size();
+        const size_t exitMark = exits.size();
+        bool endsBlock = false;
+        if (!instruction(op, endsBlock))
+        {
+            // Roll back any partial code and hand over to the interpreter
+            e.code.resize(mark);
+            exits.resize(exitMark);
+            exitTo(pc, 0, NesCpu::jitInterpret);
+            ended = true;
+            break;
+        }
+
+        ++translated;
+        if (endsBlock)
+        {
+            ended = true;
+            break;
+        }
+        cyclesSoFar += op.cycles;
+        pc += NesCpu::opcodeInfoArray[op.opcode].bytes;
+    }
+
+    if (translated == 0)
+    {
+        return false;
+    }
+    if (!ended)
+    {
+        exitTo(pc, 0, NesCpu::jitBlockDone);
+    }
+
+    // Exit stubs write back the registers, PC and cycles
+    std::vector<size_t> epilogueJumps;
+    for (const Exit& exit : exits)
+    {
+        for (size_t jump : exit.jumps)
+        {
+            e.patch(jump, e.size());
+        }
+        e.storeByte(cpuField(o.A), regA);
+        e.storeByte(cpuField(o.X), regX);
+        e.storeByte(cpuField(o.Y), regY);
+        if (exit.pc >= 0)
+        {
+            e.storeWordImm(cpuField(o.PC), static_cast<uint16_t>(exit.pc));
+        }
+        if (exit.cycles != 0)
+        {
+            e.addQwordImm(cpuField(o.cycles), exit.cycles);
+        }
+        e.movImm(RAX, exit.code);
+        epilogueJumps.push_back(e.jmp());
+    }
+
+    for (size_t jump : epilogueJumps)
+    {
+        e.patch(jump, e.size());
+    }
+    e.pop(R15);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.ret();
+    return true;
+}
+
+#endif
+
+}
+
+NesCpu::Jit::~Jit()
+{
+#if NES_JIT_SUPPORTED
+    if (codeBuffer)
+    {
+#ifdef _WIN32
+        VirtualFree(codeBuffer, 0, MEM_RELEASE);
+#else
+        munmap(codeBuffer, codeSize);
+#endif
+    }
+#endif
+}
+
+bool NesCpu::Jit::compile(Cpu& cpu, DecodedBlock& block)
+{
+#if NES_JIT_SUPPORTED
+    if (!codeBuffer)
+    {
+#ifdef _WIN32
+        void* buffer = VirtualAlloc(nullptr, jitBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+        void* buffer = mmap(nullptr, jitBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+        {
+            buffer = nullptr;
+        }
+#endif
+        if (!buffer)
+        {
+            block.jitFailed = true;
+            ++failedBlocks;
+            return false;
+        }
+        codeBuffer = static_cast<uint8_t*>(buffer);
+        codeSize = jitBufferSize;
+        codeUsed = 0;
+    }
+
+    BlockCompiler compiler(cpu);
+    if (!compiler.compile(block) || codeUsed + compiler.e.size() > codeSize)
+    {
+        block.jitFailed = true;
+        ++failedBlocks;
+        return false;
+    }
+
+    uint8_t* code = codeBuffer + codeUsed;
+    std::memcpy(code, compiler.e.code.data(), compiler.e.size());
+    // Keep blocks 16-byte aligned
+    codeUsed = (codeUsed + compiler.e.size() + 15) & ~static_cast<size_t>(15);
+
+    block.native = reinterpret_cast<NativeBlock>(code);
+    ++compiledBlocks;
+    return true;
+#else
+    block.jitFailed = true;
+    ++failedBlocks;
+    return false;
+#endif
+}
+
+bool NesCpu::Jit::isFull() const
+{
+#if NES_JIT_SUPPORTED
+    return codeBuffer && codeUsed + maxBlockCodeSize > codeSize;
+#else
+    return false;
+#endif
+}
+
+void NesCpu::Jit::reset()
+{
+    codeUsed = 0;
+}
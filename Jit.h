@@ -0,0 +1,69 @@
+#ifndef JIT_HXX
+#define JIT_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DecodeCache.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NES_JIT_SUPPORTED 1
+#else
+#define NES_JIT_SUPPORTED 0
+#endif
+
+namespace NesCpu {
+
+// Return values of a native block
+enum JitExit : uint32_t
+{
+    jitBlockDone,       // Ran to the end of the block, PC is the next block
+    jitInterpret        // Stopped before an instruction the interpreter must run
+};
+
+// Translates hot basic blocks into x86-64 code. A, X and Y live in host
+// registers for the length of a block; flags stay in their lazy form in
+// the Cpu. Memory is reached through the bus page table. Native code
+// leaves the block before any access to a page served by an I/O handler,
+// such as PPU/APU/IO registers or mapper writes, and before writing to a
+// page holding decoded code so the interpreter's write path invalidates it.
+class Jit {
+
+public:
+    Jit() : codeBuffer{}
+        , codeSize{}
+        , codeUsed{}
+        , compiledBlocks{}
+        , failedBlocks{}
+    {}
+
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Translate a block, storing the result in block.native. Returns false
+    // if the block starts with an instruction that can't be translated or
+    // the code buffer is full.
+    bool compile(Cpu& cpu, DecodedBlock& block);
+
+    // True once the code buffer can't hold another block
+    bool isFull() const;
+
+    // Discard all translations. Every DecodedBlock::native must be dropped first.
+    void reset();
+
+    uint64_t getCompiledBlocks() const { return compiledBlocks; }
+
+    uint64_t getFailedBlocks() const { return failedBlocks; }
+
+private:
+    uint8_t* codeBuffer;
+    size_t codeSize;
+    size_t codeUsed;
+    uint64_t compiledBlocks;
+    uint64_t failedBlocks;
+};
+
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "Mapper.h"
+#include "SaveState.h"
 #include <iostream>
 
 NesMapper::MapperInfo NesMapper::Mapper::getMapperInfo()
@@ -11,34 +12,131 @@ void NesMapper::Mapper::setMapperInfo(NesMapper::MapperInfo info)
     mapperInfo = info;
 }
 
-void NesMapper::Mapper::initialize(std::vector<uint8_t> &cartridgeData, Memory &memory)
+void NesMapper::Mapper::initialize(ByteSpan cartridgeData, Memory &memory, NesPpu::Ppu &ppu)
 {
 
     std::cout << "Mapper: " << mapperInfo.mapperNum << '\n';
     std::cout << "PRG-ROM bank num: " << mapperInfo.numPrgRomBanks << '\n';
     std::cout << "CHR-ROM bank num: " << mapperInfo.numChrRomBanks << '\n';
     std::cout << "trainerPresent: " << mapperInfo.trainerPresent << '\n';
+    std::cout << "Mirroring: " << static_cast<uint32_t>(mapperInfo.mirroring) << '\n';
 
     const uint32_t headerSize = 16;
     const uint32_t trainerSize = 512;
-    uint32_t prgRomOffset = (mapperInfo.trainerPresent) ? headerSize + trainerSize : headerSize;
+    prgRomOffset = (mapperInfo.trainerPresent) ? headerSize + trainerSize : headerSize;
+    chrRomOffset = prgRomOffset + NesMapper::prgRomSize * mapperInfo.numPrgRomBanks;
+    cartridge = cartridgeData;
+    this->memory = &memory;
+    this->ppu = &ppu;
 
-    if (mapperInfo.mapperNum == 2)
+    if (mapperInfo.mapperNum != NesMapper::nrom && mapperInfo.mapperNum != NesMapper::uxrom
+        && mapperInfo.mapperNum != NesMapper::cnrom)
     {
-        for (uint32_t i = 0; i < NesMapper::prgRomSize; ++i)
+        std::cout << "Invalid mapper number\n";
+    }
+
+    // None of the supported mappers switch mirroring, so the header's
+    // layout holds for good
+    ppu.setMirroring(mapperInfo.mirroring);
+    prgBank = 0;
+    chrBank = 0;
+    mapBanks();
+
+    // Writes to ROM reach the mapper's registers
+    IoHandler handler{};
+    handler.write = [](void* context, uint16_t address, uint8_t value)
+    {
+        static_cast<Mapper*>(context)->write(address, value);
+    };
+    handler.context = this;
+    memory.mapWriteHandler(NesMapper::prgRomStartingAddress, 0xFFFF, handler);
+}
+
+void NesMapper::Mapper::write(uint16_t address, uint8_t value)
+{
+    // Games often rewrite the bank that is already selected. Remapping it
+    // would needlessly throw away decoded code.
+    if (mapperInfo.mapperNum == NesMapper::uxrom && mapperInfo.numPrgRomBanks != 0)
+    {
+        const uint32_t bank = value % mapperInfo.numPrgRomBanks;
+        if (bank != prgBank)
         {
-            memory.write(NesMapper::prgRomStartingAddress + i, cartridgeData[prgRomOffset + i]);
-            uint32_t lastRomBankStart = prgRomOffset + NesMapper::prgRomSize*(mapperInfo.numPrgRomBanks-1);
-            memory.write(NesMapper::prgRomStartingAddress + NesMapper::prgRomUpperBankOffset + i, cartridgeData[lastRomBankStart + i]);
+            prgBank = bank;
+            mapPrgBank(NesMapper::prgRomStartingAddress, prgBank);
         }
     }
-    else if (mapperInfo.mapperNum == 3)
+    else if (mapperInfo.mapperNum == NesMapper::cnrom && mapperInfo.numChrRomBanks != 0)
     {
-       // TODO
+        const uint32_t bank = value % mapperInfo.numChrRomBanks;
+        if (bank != chrBank)
+        {
+            // Lines up to now are drawn from the old bank
+            ppu->catchUp();
+            chrBank = bank;
+            mapChrBank(chrBank);
+        }
+    }
+}
+
+void NesMapper::Mapper::mapBanks()
+{
+    if (mapperInfo.numPrgRomBanks != 0)
+    {
+        // UxROM switches the bank at $8000 and fixes the last bank at $C000.
+        // NROM and CNROM have one or two fixed banks; a single bank appears
+        // at both addresses.
+        mapPrgBank(NesMapper::prgRomStartingAddress, prgBank);
+        mapPrgBank(NesMapper::prgRomStartingAddress + NesMapper::prgRomUpperBankOffset, mapperInfo.numPrgRomBanks - 1);
+    }
+
+    if (mapperInfo.numChrRomBanks != 0)
+    {
+        mapChrBank(chrBank);
     }
     else
     {
-        std::cout << "Invalid mapper number\n";
+        ppu->mapChrRam();
     }
-    
-}
\ No newline at end of file
+}
+
+void NesMapper::Mapper::mapPrgBank(uint16_t address, uint32_t bank)
+{
+    const size_t bankStart = prgRomOffset + static_cast<size_t>(NesMapper::prgRomSize) * bank;
+    if (bankStart + NesMapper::prgRomSize > cartridge.size())
+    {
+        std::cout << "PRG-ROM bank out of range\n";
+        return;
+    }
+    // Decoded code from the previous bank is invalidated by the remap
+    memory->mapRom(address, address + NesMapper::prgRomSize - 1, cartridge.data() + bankStart);
+}
+
+void NesMapper::Mapper::mapChrBank(uint32_t bank)
+{
+    const size_t bankStart = chrRomOffset + static_cast<size_t>(NesMapper::chrRomSize) * bank;
+    if (bankStart + NesMapper::chrRomSize > cartridge.size())
+    {
+        std::cout << "CHR-ROM bank out of range\n";
+        return;
+    }
+    ppu->mapChr(0, cartridge.data() + bankStart, NesMapper::chrRomSize, false);
+}
+
+void NesMapper::Mapper::saveState(std::ostream& out) const
+{
+    SaveState::write(out, prgBank);
+    SaveState::write(out, chrBank);
+}
+
+bool NesMapper::Mapper::loadState(std::istream& in)
+{
+    if (!SaveState::read(in, prgBank) || !SaveState::read(in, chrBank))
+    {
+        return false;
+    }
+    if (!cartridge.empty())
+    {
+        mapBanks();
+    }
+    return true;
+}
@@ -1,10 +1,13 @@
 #ifndef MAPPER_HXX
 #define MAPPER_HXX
 
-#include <vector>
 #include <stdint.h>
 #include <iostream>
+#include <istream>
+#include <ostream>
 #include "Memory.h"
+#include "Ppu.h"
+#include "RomImage.h"
 
 namespace NesMapper {
 
@@ -13,29 +16,73 @@ struct MapperInfo {
     uint32_t numPrgRomBanks;
     uint32_t numChrRomBanks;
     bool trainerPresent;
+    NesPpu::Mirroring mirroring;    // Nametable layout the cart is wired for
 };
 
 static const uint32_t prgRomSize = 0x4000;
 static const uint32_t prgRomStartingAddress = 0x8000;
 static const uint32_t prgRomUpperBankOffset = 0x4000;
+static const uint32_t chrRomSize = 0x2000;
 
+// Supported iNES mapper numbers
+static const uint32_t nrom = 0;
+static const uint32_t uxrom = 2;
+static const uint32_t cnrom = 3;
+
+// Maps cartridge banks by pointing the CPU and PPU page tables straight into
+// the cartridge data, so a bank switch swaps pointers instead of copying.
 class Mapper {
 
 public:
     Mapper() : mapperInfo{}
+        , cartridge{}
+        , memory{}
+        , ppu{}
+        , prgRomOffset{}
+        , chrRomOffset{}
+        , prgBank{}
+        , chrBank{}
     {}
 
     MapperInfo getMapperInfo();
 
     void setMapperInfo(MapperInfo info);
 
-    void initialize(std::vector<uint8_t> &cartridgeData, Memory &memory);
+    // Map the initial banks and install the register write handler. The
+    // cartridge data must outlive the mapper.
+    void initialize(ByteSpan cartridgeData, Memory &memory, NesPpu::Ppu &ppu);
+
+    // CPU write to $8000-$FFFF
+    void write(uint16_t address, uint8_t value);
+
+    // Save or restore the bank registers. Loading remaps the banks.
+    void saveState(std::ostream& out) const;
+    bool loadState(std::istream& in);
 
 private:
+    // Map every bank the current registers select
+    void mapBanks();
+
+    // Point address at 16 KB PRG bank number bank
+    void mapPrgBank(uint16_t address, uint32_t bank);
+
+    // Point the pattern tables at 8 KB CHR bank number bank
+    void mapChrBank(uint32_t bank);
+
     MapperInfo mapperInfo;
+    ByteSpan cartridge;
+    Memory* memory;
+    NesPpu::Ppu* ppu;
+    uint32_t prgRomOffset;
+    uint32_t chrRomOffset;
+
+    // Bank registers: the switchable PRG bank at $8000 (UxROM) and the CHR
+    // bank (CNROM)
+    uint32_t prgBank;
+    uint32_t chrBank;
 
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,20 +1,64 @@
 #include <iostream>
 #include "Memory.h"
+#include "SaveState.h"
 
+namespace {
 
-int8_t Memory::read(uint16_t address)
+// Internal RAM pages repeat every 2 KB up to $1FFF
+const uint32_t ramPages = 0x20;
+const uint32_t ramMirrorPages = internalRamSize / pageSize;
+
+// Reads of unmapped addresses return what was last on the data bus, which
+// is usually the high byte of the address
+uint8_t openBus(uint16_t address)
+{
+    return static_cast<uint8_t>(address >> 8);
+}
+
+}
+
+Memory::Memory() : pageTable{}
+    , handlers{}
+    , ram{}
+    , sram{}
+    , codePages{}
+    , dirtyCodePages{}
+    , codeDirty{}
+    , ramTracker{ram, internalRamSize / pageSize}
+    , sramTracker{sram, sramSize / pageSize}
+    , protectedWrite{}
+    , snapshotsEnabled{}
+#if NES_TRACE
+    , tracer{}
+#endif
+    , debugger{}
+    , debugPages{}
 {
-    return data[address];
+    for (uint32_t mirror = 0; mirror < ramPages * pageSize; mirror += internalRamSize)
+    {
+        mapPages(mirror, mirror + internalRamSize - 1, ram, true);
+    }
+    mapPages(sramStart, sramStart + sramSize - 1, sram, true);
 }
 
-void Memory::write(uint16_t address, int8_t value)
+uint8_t Memory::peek(uint16_t address) const
 {
-    data[address] = value;
+    const uint8_t* page = pageTable.read[address >> 8];
+    if (!page && isTrapped(address >> 8))
+    {
+        page = debugPages[address >> 8].read;
+    }
+    return page ? page[address & 0xFF] : openBus(address);
 }
 
-int8_t* Memory::getAddress(uint16_t address)
+uint8_t* Memory::getAddress(uint16_t address)
 {
-    return &data[address];
+    uint8_t* page = pageTable.read[address >> 8];
+    if (!page && isTrapped(address >> 8))
+    {
+        page = debugPages[address >> 8].read;
+    }
+    return page ? page + (address & 0xFF) : nullptr;
 }
 
 void Memory::setBit(uint16_t address, uint8_t bitNum, bool set)
@@ -22,20 +66,399 @@ void Memory::setBit(uint16_t address, uint8_t bitNum, bool set)
     if (bitNum < 8)
     {
         uint8_t bitMask = 1;
-        bitMask << bitNum;
+        bitMask <<= bitNum;
+        uint8_t value = read(address);
         if (set)
         {
-            data[address] |= bitMask;
+            value |= bitMask;
         }
         else
         {
             bitMask = ~bitMask;
-            data[address] &= bitMask;
+            value &= bitMask;
         }
+        write(address, value);
     }
     else
     {
         std::cout << "Error setting bit in memory. bitNum > 7 \n";
     }
 
-}
\ No newline at end of file
+}
+
+bool Memory::setTracer(Tracer* tracer)
+{
+#if NES_TRACE
+    this->tracer = tracer;
+    return true;
+#else
+    (void)tracer;
+    return false;
+#endif
+}
+
+uint8_t Memory::readIo(uint16_t address)
+{
+    const IoHandler& handler = handlers[address >> 8];
+    return handler.read ? handler.read(handler.context, address) : openBus(address);
+}
+
+void Memory::writeIo(uint16_t address, uint8_t value)
+{
+    if (protectedWrite[address >> 8])
+    {
+        // First write to a page since the last snapshot
+        unprotect(address >> 8);
+        storePage(pageTable.write[address >> 8], address, value);
+        return;
+    }
+
+    const IoHandler& handler = handlers[address >> 8];
+    if (handler.write)
+    {
+        handler.write(handler.context, address, value);
+    }
+}
+
+void Memory::mapPages(uint16_t start, uint16_t end, uint8_t* data, bool writable)
+{
+    for (uint32_t page = start >> 8; page <= static_cast<uint32_t>(end >> 8); ++page)
+    {
+        uint8_t* pageData = data + (page - (start >> 8)) * pageSize;
+        // Code decoded from the old mapping is stale, unless the page is
+        // remapped to the data it already reads, as when a restore maps
+        // the same banks again
+        if (getAddress(static_cast<uint16_t>(page << 8)) != pageData)
+        {
+            invalidateCode(static_cast<uint16_t>(page << 8), static_cast<uint16_t>(page << 8));
+        }
+        setReadPage(page, pageData);
+        setWritePage(page, writable ? pageData : nullptr);
+    }
+}
+
+void Memory::mapIo(uint16_t start, uint16_t end, const IoHandler& handler)
+{
+    for (uint32_t page = start >> 8; page <= static_cast<uint32_t>(end >> 8); ++page)
+    {
+        setReadPage(page, nullptr);
+        setWritePage(page, nullptr);
+        setHandler(page, handler);
+    }
+    invalidateCode(start, end);
+}
+
+void Memory::mapWriteHandler(uint16_t start, uint16_t end, const IoHandler& handler)
+{
+    for (uint32_t page = start >> 8; page <= static_cast<uint32_t>(end >> 8); ++page)
+    {
+        setWritePage(page, nullptr);
+        IoHandler& target = isTrapped(page) ? debugPages[page].handler : handlers[page];
+        target.write = handler.write;
+        target.context = handler.context;
+    }
+}
+
+void Memory::mapRom(uint16_t start, uint16_t end, const uint8_t* data)
+{
+    // Read-only pages never have a write pointer, so the data is never
+    // written through the cast
+    mapPages(start, end, const_cast<uint8_t*>(data), false);
+}
+
+void Memory::saveState(std::ostream& out) const
+{
+    SaveState::write(out, ram);
+    SaveState::write(out, sram);
+}
+
+bool Memory::loadState(std::istream& in)
+{
+    if (!SaveState::read(in, ram) || !SaveState::read(in, sram))
+    {
+        return false;
+    }
+    ramTracker.markAllDirty();
+    sramTracker.markAllDirty();
+    invalidateCode(0, 0xFFFF);
+    return true;
+}
+
+void Memory::capture(StateSnapshot& snapshot)
+{
+    // The JIT's native code stores to zero page and the stack through page
+    // pointers of its own, skipping the write table, so those two pages are
+    // always copied
+    ramTracker.markDirty(0);
+    ramTracker.markDirty(1);
+    ramTracker.capture(snapshot.ram);
+    sramTracker.capture(snapshot.sram);
+    snapshotsEnabled = true;
+    protectWrites();
+}
+
+bool Memory::restore(const StateSnapshot& snapshot)
+{
+    // Native stores may also have changed zero page and the stack since
+    // the last capture without marking them, so they are always restored
+    ramTracker.markDirty(0);
+    ramTracker.markDirty(1);
+
+    std::vector<uint32_t> ramRestored;
+    std::vector<uint32_t> sramRestored;
+    if (!ramTracker.restore(snapshot.ram, ramRestored) || !sramTracker.restore(snapshot.sram, sramRestored))
+    {
+        return false;
+    }
+    for (uint32_t page : ramRestored)
+    {
+        markCodeDirty(static_cast<uint8_t>(page));
+    }
+    for (uint32_t page : sramRestored)
+    {
+        markCodeDirty(static_cast<uint8_t>((sramStart >> 8) + page));
+    }
+    snapshotsEnabled = true;
+    protectWrites();
+    return true;
+}
+
+void Memory::setWritePage(uint32_t page, uint8_t* data)
+{
+    if (isTrapped(page))
+    {
+        debugPages[page].write = data;
+    }
+    else if (data && snapshotsEnabled && isSnapshotClean(data))
+    {
+        pageTable.write[page] = nullptr;
+        protectedWrite[page] = data;
+    }
+    else
+    {
+        pageTable.write[page] = data;
+        protectedWrite[page] = nullptr;
+    }
+}
+
+bool Memory::markSnapshotDirty(const uint8_t* data)
+{
+    if (data >= ram && data < ram + internalRamSize)
+    {
+        ramTracker.markDirty(static_cast<uint32_t>(data - ram) / pageSize);
+        return true;
+    }
+    if (data >= sram && data < sram + sramSize)
+    {
+        sramTracker.markDirty(static_cast<uint32_t>(data - sram) / pageSize);
+        return true;
+    }
+    return false;
+}
+
+bool Memory::isSnapshotClean(const uint8_t* data) const
+{
+    if (data >= ram && data < ram + internalRamSize)
+    {
+        // Zero page and the stack are copied on every capture anyway
+        const uint32_t page = static_cast<uint32_t>(data - ram) / pageSize;
+        return page > 1 && !ramTracker.isDirty(page);
+    }
+    if (data >= sram && data < sram + sramSize)
+    {
+        return !sramTracker.isDirty(static_cast<uint32_t>(data - sram) / pageSize);
+    }
+    return false;
+}
+
+void Memory::protectWrites()
+{
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        uint8_t* data = pageTable.write[page] ? pageTable.write[page] : protectedWrite[page];
+        if (data)
+        {
+            setWritePage(page, data);
+        }
+    }
+}
+
+void Memory::unprotect(uint32_t page)
+{
+    uint8_t* data = protectedWrite[page];
+    markSnapshotDirty(data);
+    // RAM mirrors share the backing page
+    for (uint32_t alias = 0; alias < numPages; ++alias)
+    {
+        if (protectedWrite[alias] == data)
+        {
+            pageTable.write[alias] = data;
+            protectedWrite[alias] = nullptr;
+        }
+    }
+}
+
+void Memory::setReadPage(uint32_t page, uint8_t* data)
+{
+    if (isTrapped(page))
+    {
+        debugPages[page].read = data;
+    }
+    else
+    {
+        pageTable.read[page] = data;
+    }
+}
+
+void Memory::setHandler(uint32_t page, const IoHandler& handler)
+{
+    if (isTrapped(page))
+    {
+        debugPages[page].handler = handler;
+    }
+    else
+    {
+        handlers[page] = handler;
+    }
+}
+
+void Memory::setDebugger(Debugger* debugger)
+{
+    if (debugPages)
+    {
+        for (uint32_t page = 0; page < numPages; ++page)
+        {
+            if (debugPages[page].trapped)
+            {
+                untrapPage(page);
+            }
+        }
+    }
+
+    this->debugger = debugger;
+    if (!debugger)
+    {
+        return;
+    }
+    if (!debugPages)
+    {
+        debugPages.reset(new DebugPage[numPages]());
+    }
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        if (debugger->isPageWatched(static_cast<uint8_t>(page)))
+        {
+            trapPage(page);
+        }
+    }
+}
+
+void Memory::trapPage(uint32_t page)
+{
+    // Mapping changes while trapped land in the DebugPage, which is what
+    // the debug handlers use and what untrapPage() puts back
+    DebugPage& debugPage = debugPages[page];
+    debugPage.memory = this;
+    debugPage.read = pageTable.read[page];
+    debugPage.write = pageTable.write[page] ? pageTable.write[page] : protectedWrite[page];
+    debugPage.handler = handlers[page];
+    debugPage.trapped = true;
+
+    pageTable.read[page] = nullptr;
+    pageTable.write[page] = nullptr;
+    protectedWrite[page] = nullptr;
+    handlers[page] = IoHandler{&Memory::debugRead, &Memory::debugWrite, &debugPage};
+}
+
+void Memory::untrapPage(uint32_t page)
+{
+    DebugPage& debugPage = debugPages[page];
+    debugPage.trapped = false;
+    pageTable.read[page] = debugPage.read;
+    handlers[page] = debugPage.handler;
+    setWritePage(page, debugPage.write);
+}
+
+uint8_t Memory::debugRead(void* context, uint16_t address)
+{
+    const DebugPage& debugPage = *static_cast<const DebugPage*>(context);
+    uint8_t value = openBus(address);
+    if (debugPage.read)
+    {
+        value = debugPage.read[address & 0xFF];
+    }
+    else if (debugPage.handler.read)
+    {
+        value = debugPage.handler.read(debugPage.handler.context, address);
+    }
+    debugPage.memory->debugger->checkRead(address, value);
+    return value;
+}
+
+void Memory::debugWrite(void* context, uint16_t address, uint8_t value)
+{
+    const DebugPage& debugPage = *static_cast<const DebugPage*>(context);
+    Memory& memory = *debugPage.memory;
+    memory.debugger->checkWrite(address, value);
+    if (debugPage.write)
+    {
+        // Trapped pages skip the snapshot write trap, so mark them here
+        memory.markSnapshotDirty(debugPage.write);
+        memory.storePage(debugPage.write, address, value);
+    }
+    else if (debugPage.handler.write)
+    {
+        debugPage.handler.write(debugPage.handler.context, address, value);
+    }
+}
+
+void Memory::watchCodePage(uint8_t page)
+{
+    if (page < ramPages)
+    {
+        // Code in internal RAM can be overwritten through any mirror
+        for (uint32_t mirror = page % ramMirrorPages; mirror < ramPages; mirror += ramMirrorPages)
+        {
+            codePages[0] |= 1ull << mirror;
+        }
+        return;
+    }
+    codePages[page >> 6] |= 1ull << (page & 63);
+}
+
+void Memory::markCodeDirty(uint8_t page)
+{
+    if (page < ramPages)
+    {
+        for (uint32_t mirror = page % ramMirrorPages; mirror < ramPages; mirror += ramMirrorPages)
+        {
+            dirtyCodePages[0] |= 1ull << mirror;
+        }
+    }
+    else
+    {
+        dirtyCodePages[page >> 6] |= 1ull << (page & 63);
+    }
+    codeDirty = true;
+}
+
+void Memory::invalidateCode(uint16_t start, uint16_t end)
+{
+    for (uint32_t page = start >> 8; page <= static_cast<uint32_t>(end >> 8); ++page)
+    {
+        dirtyCodePages[page >> 6] |= 1ull << (page & 63);
+    }
+    codeDirty = true;
+}
+
+uint64_t Memory::takeDirtyCodePages(uint32_t word)
+{
+    const uint64_t dirty = dirtyCodePages[word];
+    dirtyCodePages[word] = 0;
+    codePages[word] &= ~dirty;
+    if ((dirtyCodePages[0] | dirtyCodePages[1] | dirtyCodePages[2] | dirtyCodePages[3]) == 0)
+    {
+        codeDirty = false;
+    }
+    return dirty;
+}
@@ -2,24 +2,262 @@
 #define MEMORY_HXX
 
 #include <stdint.h>
+#include <stddef.h>
+#include <istream>
+#include <ostream>
+#include <vector>
+#include "Snapshot.h"
+#include "Tracer.h"
+#include "Debugger.h"
+#include <memory>
 
+// Cartridge PRG-ROM is mapped from here to the top of the address space
+static const uint16_t prgRomStart = 0x8000;
+
+// The bus is split into 256-byte pages
+static const uint32_t pageSize = 0x100;
+static const uint32_t numPages = 0x100;
+
+// Sizes of the memories the bus owns
+static const uint32_t internalRamSize = 0x800;
+static const uint16_t sramStart = 0x6000;
+static const uint32_t sramSize = 0x2000;
+
+// Memory-mapped I/O. Handlers receive the full CPU address.
+typedef uint8_t (*ReadHandler)(void* context, uint16_t address);
+typedef void (*WriteHandler)(void* context, uint16_t address, uint8_t value);
+
+struct IoHandler {
+    ReadHandler read;       // Null reads open bus
+    WriteHandler write;     // Null ignores writes
+    void* context;
+};
+
+// Per-page host pointers. A null entry sends the access to the page's
+// IoHandler instead.
+struct PageTable {
+    uint8_t* read[numPages];
+    uint8_t* write[numPages];
+};
+
+// The CPU address space as a table of 256-byte pages. Each page points
+// straight at host memory (RAM, SRAM, ROM) or goes through an I/O handler
+// (PPU, APU and controller registers, mapper writes), so plain memory
+// costs one table lookup and a load.
+//
+// Default layout:
+// $0000-$1FFF  2 KB internal RAM, mirrored four times
+// $2000-$5FFF  unmapped until handlers are installed
+// $6000-$7FFF  8 KB SRAM
+// $8000-$FFFF  unmapped until the mapper points it at PRG-ROM banks
 class Memory {
 
 public:
-    Memory() : data{}
-    {}
-       
-    int8_t read(uint16_t address);
+    Memory();
+
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    uint8_t read(uint16_t address)
+    {
+        const uint8_t* page = pageTable.read[address >> 8];
+        const uint8_t value = page ? page[address & 0xFF] : readIo(address);
+#if NES_TRACE
+        if (tracer)
+        {
+            tracer->record(address, value, traceRead);
+        }
+#endif
+        return value;
+    }
+
+    void write(uint16_t address, uint8_t value)
+    {
+#if NES_TRACE
+        if (tracer)
+        {
+            tracer->record(address, value, traceWrite);
+        }
+#endif
+        uint8_t* page = pageTable.write[address >> 8];
+        if (!page)
+        {
+            writeIo(address, value);
+            return;
+        }
+        storePage(page, address, value);
+    }
 
-    void write(uint16_t address, int8_t value);
+    // Read without side effects, for decoding and debugging. I/O pages read
+    // as open bus.
+    uint8_t peek(uint16_t address) const;
 
-    int8_t* getAddress(uint16_t address);
+    // Host pointer to a byte on a directly mapped page, null on I/O pages
+    uint8_t* getAddress(uint16_t address);
 
     void setBit(uint16_t address, uint8_t bitNum, bool set);
 
+    const PageTable& getPageTable() const { return pageTable; }
+
+    // Route pages holding watched addresses through a checking handler, or
+    // restore every page with null. The rest of the bus is untouched.
+    // Called again whenever the debugger's watchpoints change.
+    void setDebugger(Debugger* debugger);
+
+    // Send every read and write to a tracer, or stop with null. Returns
+    // false, and does nothing, in builds without NES_TRACE. Native code
+    // doesn't go through read() and write(), so trace with the JIT off.
+    bool setTracer(Tracer* tracer);
+
+    /////////////////////////////////////
+    // Mapping
+    /////////////////////////////////////
+
+    // Point pages [start, end] at consecutive 256-byte blocks of data.
+    // Read-only pages send writes to the page's I/O handler.
+    void mapPages(uint16_t start, uint16_t end, uint8_t* data, bool writable);
+
+    // Route pages [start, end] through a handler
+    void mapIo(uint16_t start, uint16_t end, const IoHandler& handler);
+
+    // Route writes to pages [start, end], e.g. mapper registers over ROM,
+    // through a handler while reads stay direct
+    void mapWriteHandler(uint16_t start, uint16_t end, const IoHandler& handler);
+
+    // Point pages [start, end] at read-only data such as a cartridge bank.
+    // Nothing is copied, so switching banks is a pointer swap; writes go to
+    // the page's I/O handler.
+    void mapRom(uint16_t start, uint16_t end, const uint8_t* data);
+
+    // True for addresses backed by cartridge ROM, which the CPU can't modify
+    bool isRom(uint16_t address) const { return address >= prgRomStart; }
+
+    // Save or restore RAM and SRAM. ROM mappings belong to the mapper's
+    // state. Loading invalidates all decoded code.
+    void saveState(std::ostream& out) const;
+    bool loadState(std::istream& in);
+
+    /////////////////////////////////////
+    // Snapshots
+    /////////////////////////////////////
+
+    // Store RAM and SRAM as shared pages, copying only pages written since
+    // the last capture or restore. From the first capture on, RAM and SRAM
+    // pages are write-protected in the page table after every capture, so
+    // the first write to each page takes the slow path once to mark it
+    // dirty and plain writes cost nothing extra.
+    void capture(StateSnapshot& snapshot);
+
+    // Copy back the pages that differ from the snapshot and invalidate any
+    // code decoded from them
+    bool restore(const StateSnapshot& snapshot);
+
+    /////////////////////////////////////
+    // Decoded code tracking
+    /////////////////////////////////////
+
+    // Mark a RAM page as holding decoded instructions so writes to it are
+    // tracked. Internal RAM mirrors are watched along with it.
+    void watchCodePage(uint8_t page);
+
+    // Mark every page in [start, end] as dirty, e.g. after a bank switch
+    void invalidateCode(uint16_t start, uint16_t end);
+
+    // True when a page holding decoded code has changed
+    bool hasDirtyCode() const { return codeDirty; }
+
+    // Return and clear the dirty page bits for pages [64 * word, 64 * word + 63]
+    uint64_t takeDirtyCodePages(uint32_t word);
+
+    // Bitmap of pages holding decoded code, one bit per page
+    const uint64_t* getCodePages() const { return codePages; }
+
 private:
-    int8_t data[65535]; // 16-bit address
+    void storePage(uint8_t* page, uint16_t address, uint8_t value)
+    {
+        page[address & 0xFF] = value;
+
+        // Writes over decoded code mark the page dirty so the decode cache
+        // drops the stale instructions before running them again
+        const uint8_t pageNum = address >> 8;
+        if (codePages[pageNum >> 6] & (1ull << (pageNum & 63)))
+        {
+            markCodeDirty(pageNum);
+        }
+    }
+
+    uint8_t readIo(uint16_t address);
+
+    void writeIo(uint16_t address, uint8_t value);
+
+    // Mark a written code page and any page aliasing it dirty
+    void markCodeDirty(uint8_t page);
+
+    // Point a page's write entry at data, or trap its first write when data
+    // is a snapshot-tracked page that hasn't changed since the last capture
+    void setWritePage(uint32_t page, uint8_t* data);
+
+    // Mark the snapshot page behind data dirty. Returns false when data
+    // isn't tracked.
+    bool markSnapshotDirty(const uint8_t* data);
+
+    bool isSnapshotClean(const uint8_t* data) const;
+
+    // Trap the first write to every clean tracked page
+    void protectWrites();
+
+    // Lift the trap on a written page and every page aliasing it
+    void unprotect(uint32_t page);
+
+    // A page's real mapping while the debugger traps it
+    struct DebugPage {
+        Memory* memory;
+        uint8_t* read;
+        uint8_t* write;
+        IoHandler handler;
+        bool trapped;
+    };
+
+    void setReadPage(uint32_t page, uint8_t* data);
+
+    void setHandler(uint32_t page, const IoHandler& handler);
+
+    void trapPage(uint32_t page);
+
+    void untrapPage(uint32_t page);
+
+    bool isTrapped(uint32_t page) const { return debugPages && debugPages[page].trapped; }
+
+    // Handlers of trapped pages: check the watchpoint, then do the access
+    static uint8_t debugRead(void* context, uint16_t address);
+    static void debugWrite(void* context, uint16_t address, uint8_t value);
+
+    PageTable pageTable;
+    IoHandler handlers[numPages];
+
+    uint8_t ram[internalRamSize];
+    uint8_t sram[sramSize];
+
+    // One bit per 256-byte page
+    uint64_t codePages[4];
+    uint64_t dirtyCodePages[4];
+    bool codeDirty;
+
+    Snapshot::PageTracker ramTracker;
+    Snapshot::PageTracker sramTracker;
+
+    // Write entries held back from the page table until the page's first
+    // write after a capture
+    uint8_t* protectedWrite[numPages];
+    bool snapshotsEnabled;
+
+#if NES_TRACE
+    Tracer* tracer;
+#endif
+
+    Debugger* debugger;
+    std::unique_ptr<DebugPage[]> debugPages;    // Allocated on first use
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,14 +1,596 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <memory>
 #include "Console.h"
+#include "RomImage.h"
+#include "Rewind.h"
+#include "Tracer.h"
+#include "Fleet.h"
+#include "SaveState.h"
+#include "ColourConverter.h"
+#include "FramePipeline.h"
+#include "AudioSink.h"
 
-int main()
+namespace {
+
+struct Options {
+    std::string romPath;
+    uint64_t frames;
+    uint64_t cycles;        // Overrides frames when non-zero
+    std::string inputPath;
+    std::string loadStatePath;
+    std::string saveStatePath;
+    bool jit;
+    bool idleSkip;
+    bool render;            // Draw every frame instead of running headless
+    bool tileCache;
+    uint32_t frameSkip;     // Frames run headless between drawn ones
+    bool convert;           // Convert every frame to pixelFormat
+    NesPpu::PixelFormat pixelFormat;
+    bool pipeline;          // Convert on a render thread
+    std::string videoPath;
+    std::string audioPath;
+    uint32_t sampleRate;
+    uint32_t instances;     // More than one runs a Fleet
+    uint32_t threads;       // Fleet workers, 0 for one per hardware thread
+    uint64_t rewindBudget;  // Bytes of rewind history to record, 0 for none
+    std::string tracePath;
+    std::vector<std::pair<uint16_t, uint16_t>> traceRanges;
+    uint32_t traceSampleRate;
+    std::vector<uint16_t> breakpoints;
+    std::vector<std::pair<uint16_t, uint16_t>> watchRanges;
+    std::vector<uint8_t> watchTypes;
+};
+
+void printUsage()
 {
-    Console nes;
+    std::cout << "Usage: nes <rom.nes> [options]\n"
+        << "  --frames N         Run N frames (default 600)\n"
+        << "  --cycles N         Run N CPU cycles instead of a frame count\n"
+        << "  --input FILE       Controller 1 buttons, one hex byte per frame\n"
+        << "  --load-state FILE  Start from a saved state\n"
+        << "  --save-state FILE  Save the final state\n"
+        << "  --jit              Translate hot blocks to native code\n"
+        << "  --no-idle-skip     Run idle loops instead of fast-forwarding them\n"
+        << "  --render           Draw every frame and report a hash of the last one\n"
+        << "  --no-tile-cache    Decode CHR bitplanes on every line instead of caching tiles\n"
+        << "  --frame-skip N     Draw one frame in N + 1 and run the rest headless (turns on --render)\n"
+        << "  --convert FORMAT   Render and convert every frame to rgba, bgra or rgb565\n"
+        << "  --pipeline         Convert frames on a render thread while the next is emulated\n"
+        << "  --video FILE       Write the frames the render thread converts to FILE as raw video\n"
+        << "                     (turns on --pipeline)\n"
+        << "  --audio FILE       Stream audio to FILE: WAV if it ends in .wav, raw 16-bit PCM otherwise\n"
+        << "  --sample-rate N    Audio sample rate (default 44100)\n"
+        << "  --instances N      Run N independent consoles on a thread pool\n"
+        << "  --threads N        Worker threads for --instances (default: all cores)\n"
+        << "  --rewind MB        Record rewind history every frame in MB of memory\n"
+        << "  --trace FILE       Write bus accesses to FILE (needs NES_TRACE; turns off --jit)\n"
+        << "  --trace-range A-B  Only trace hex addresses A to B; may be repeated\n"
+        << "  --trace-sample N   Trace one of every N accesses\n"
+        << "  --break ADDR       Stop when PC reaches hex ADDR; may be repeated\n"
+        << "  --watch A-B[:rw]   Stop on reads (r) and/or writes (w) of hex A to B\n";
+}
 
-    nes.initialize();
+bool parseOptions(int argc, char* argv[], Options& options)
+{
+    options.frames = 600;
+    options.cycles = 0;
+    options.jit = false;
+    options.idleSkip = true;
+    options.render = false;
+    options.tileCache = true;
+    options.frameSkip = 0;
+    options.convert = false;
+    options.pixelFormat = NesPpu::rgba8888;
+    options.pipeline = false;
+    options.sampleRate = NesApu::defaultSampleRate;
+    options.instances = 1;
+    options.threads = 0;
+    options.rewindBudget = 0;
+    options.traceSampleRate = 1;
 
-    getchar();
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--frames" && hasValue)
+        {
+            options.frames = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--cycles" && hasValue)
+        {
+            options.cycles = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--input" && hasValue)
+        {
+            options.inputPath = argv[++i];
+        }
+        else if (arg == "--load-state" && hasValue)
+        {
+            options.loadStatePath = argv[++i];
+        }
+        else if (arg == "--save-state" && hasValue)
+        {
+            options.saveStatePath = argv[++i];
+        }
+        else if (arg == "--instances" && hasValue)
+        {
+            options.instances = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            options.threads = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--rewind" && hasValue)
+        {
+            options.rewindBudget = std::strtoull(argv[++i], nullptr, 10) << 20;
+        }
+        else if (arg == "--trace" && hasValue)
+        {
+            options.tracePath = argv[++i];
+        }
+        else if (arg == "--trace-range" && hasValue)
+        {
+            char* end = nullptr;
+            const unsigned long start = std::strtoul(argv[++i], &end, 16);
+            const unsigned long last = (*end == '-') ? std::strtoul(end + 1, nullptr, 16) : start;
+            options.traceRanges.emplace_back(static_cast<uint16_t>(start), static_cast<uint16_t>(last));
+        }
+        else if (arg == "--trace-sample" && hasValue)
+        {
+            options.traceSampleRate = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--break" && hasValue)
+        {
+            options.breakpoints.push_back(static_cast<uint16_t>(std::strtoul(argv[++i], nullptr, 16)));
+        }
+        else if (arg == "--watch" && hasValue)
+        {
+            char* end = nullptr;
+            const unsigned long start = std::strtoul(argv[++i], &end, 16);
+            const unsigned long last = (*end == '-') ? std::strtoul(end + 1, &end, 16) : start;
+            uint8_t types = watchRead | watchWrite;
+            if (*end == ':')
+            {
+                const std::string kinds(end + 1);
+                types = (kinds.find('r') != std::string::npos ? watchRead : 0)
+                    | (kinds.find('w') != std::string::npos ? watchWrite : 0);
+            }
+            options.watchRanges.emplace_back(static_cast<uint16_t>(start), static_cast<uint16_t>(last));
+            options.watchTypes.push_back(types);
+        }
+        else if (arg == "--convert" && hasValue)
+        {
+            const std::string format = argv[++i];
+            if (format == "rgba")
+            {
+                options.pixelFormat = NesPpu::rgba8888;
+            }
+            else if (format == "bgra")
+            {
+                options.pixelFormat = NesPpu::bgra8888;
+            }
+            else if (format == "rgb565")
+            {
+                options.pixelFormat = NesPpu::rgb565;
+            }
+            else
+            {
+                std::cout << "Unknown pixel format " << format << '\n';
+                return false;
+            }
+            options.convert = true;
+            options.render = true;
+        }
+        else if (arg == "--frame-skip" && hasValue)
+        {
+            options.frameSkip = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            options.render = true;
+        }
+        else if (arg == "--video" && hasValue)
+        {
+            options.videoPath = argv[++i];
+            options.pipeline = true;
+        }
+        else if (arg == "--audio" && hasValue)
+        {
+            options.audioPath = argv[++i];
+        }
+        else if (arg == "--sample-rate" && hasValue)
+        {
+            options.sampleRate = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--jit")
+        {
+            options.jit = true;
+        }
+        else if (arg == "--no-idle-skip")
+        {
+            options.idleSkip = false;
+        }
+        else if (arg == "--render")
+        {
+            options.render = true;
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipeline = true;
+        }
+        else if (arg == "--no-tile-cache")
+        {
+            options.tileCache = false;
+        }
+        else if (arg[0] != '-' && options.romPath.empty())
+        {
+            options.romPath = arg;
+        }
+        else
+        {
+            std::cout << "Unknown option " << arg << '\n';
+            return false;
+        }
+    }
+    if (options.pipeline)
+    {
+        options.convert = true;
+        options.render = true;
+    }
+    return !options.romPath.empty() && options.instances > 0 && options.sampleRate > 0;
+}
+
+// One byte of buttons per line in hex. Blank lines and lines starting
+// with # are skipped.
+bool readInput(const std::string& path, std::vector<uint8_t>& input)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cout << "Error opening input file " << path << '\n';
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        input.push_back(static_cast<uint8_t>(std::strtoul(line.c_str(), nullptr, 16)));
+    }
+    return true;
+}
+
+// Describe why the debugger stopped the run
+void printStop(const DebugEvent& event, const NesCpu::Cpu& cpu, uint64_t frame)
+{
+    if (event.type == debugBreakpoint)
+    {
+        std::printf("stopped: breakpoint at $%04X\n", event.pc);
+    }
+    else
+    {
+        std::printf("stopped: %s $%04X = $%02X by the instruction at $%04X\n",
+            event.type == debugReadWatch ? "read of" : "write to", event.address, event.value, event.pc);
+    }
+    std::printf("  frame %" PRIu64 ", cycle %" PRIu64 ", A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X\n",
+        frame, event.cycle, cpu.A, cpu.X, cpu.Y, cpu.SP, cpu.getStatus(false), cpu.PC);
+}
+
+// Create a console running the shared ROM image, from the optional starting
+// state
+std::unique_ptr<Console> createConsole(const Options& options, const std::shared_ptr<const RomImage>& rom)
+{
+    // Consoles are too large for the stack
+    std::unique_ptr<Console> nes(new Console());
+    nes->initialize(rom);
+    nes->setJitEnabled(options.jit);
+    nes->setIdleSkipEnabled(options.idleSkip);
+    nes->setTileCacheEnabled(options.tileCache);
+
+    if (!options.loadStatePath.empty())
+    {
+        std::ifstream stateFile(options.loadStatePath, std::ios::binary);
+        if (!stateFile.is_open() || !nes->loadState(stateFile))
+        {
+            std::cout << "Error loading state " << options.loadStatePath << '\n';
+            return nullptr;
+        }
+    }
+    return nes;
+}
+
+// Run options.instances consoles for options.frames frames each and report
+// the aggregate rate
+int runFleet(const Options& options, const std::shared_ptr<const RomImage>& rom, const std::vector<uint8_t>& input)
+{
+    if (options.cycles != 0 || !options.saveStatePath.empty() || !options.audioPath.empty())
+    {
+        std::cout << "--cycles, --save-state and --audio aren't supported with --instances\n";
+        return 1;
+    }
+
+    Fleet fleet;
+    for (uint32_t i = 0; i < options.instances; ++i)
+    {
+        // Every instance reads the one mapped image
+        std::unique_ptr<Console> console = createConsole(options, rom);
+        if (!console)
+        {
+            return 1;
+        }
+        fleet.add(std::move(console));
+    }
+
+    const FleetStats stats = fleet.run(options.frames, options.threads, input.empty() ? nullptr : &input);
+
+    // Every instance runs the same ROM and input, so they must agree
+    const uint64_t ramHash = fleet.getConsole(0).hashRam();
+    uint32_t mismatches = 0;
+    for (size_t i = 1; i < fleet.size(); ++i)
+    {
+        mismatches += fleet.getConsole(i).hashRam() != ramHash ? 1 : 0;
+    }
+
+    std::printf("instances: %u\n", options.instances);
+    std::printf("workers: %zu\n", stats.framesPerWorker.size());
+    std::printf("frames: %" PRIu64 "\n", stats.frames);
+    std::printf("seconds: %.3f\n", stats.seconds);
+    std::printf("aggregate frames/s: %.1f\n", stats.seconds > 0 ? stats.frames / stats.seconds : 0.0);
+    std::printf("steals: %" PRIu64 "\n", stats.steals);
+    std::printf("ram hash: %016" PRIx64 " (%u instances differ)\n", ramHash, mismatches);
+    return mismatches == 0 ? 0 : 1;
+}
 
-    return 0;
 }
 
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        return 1;
+    }
+
+    const std::shared_ptr<const RomImage> rom = RomImage::open(options.romPath);
+    if (!rom)
+    {
+        std::cout << "Error opening ROM " << options.romPath << '\n';
+        return 1;
+    }
+
+    std::vector<uint8_t> input;
+    if (!options.inputPath.empty() && !readInput(options.inputPath, input))
+    {
+        return 1;
+    }
+
+    if (options.instances > 1)
+    {
+        return runFleet(options, rom, input);
+    }
+
+    std::unique_ptr<Console> nes = createConsole(options, rom);
+    if (!nes)
+    {
+        return 1;
+    }
+
+    // Run uncapped with no video or audio, one frame of cycles at a time so
+    // input changes on frame boundaries
+    const uint64_t totalCycles = options.cycles != 0 ? options.cycles : options.frames * cpuCyclesPerFrame;
+    const uint64_t startCycle = nes->getCpu().cycles;
+    const uint64_t startFrame = nes->getFrameCount();
+    const uint64_t startSkipped = nes->getCpu().skippedCycles;
+
+    std::unique_ptr<Rewind> rewind;
+    if (options.rewindBudget != 0)
+    {
+        rewind.reset(new Rewind(options.rewindBudget));
+    }
+
+    // Native code bypasses the bus accessors, so traces are interpreted
+    std::unique_ptr<Tracer> tracer;
+    if (!options.tracePath.empty())
+    {
+        tracer.reset(new Tracer());
+        for (const std::pair<uint16_t, uint16_t>& range : options.traceRanges)
+        {
+            tracer->addRange(range.first, range.second);
+        }
+        tracer->setSampleRate(options.traceSampleRate);
+        if (!nes->setTracer(tracer.get()))
+        {
+            std::cout << "Tracing isn't compiled in; rebuild with -DNES_TRACE=1\n";
+            return 1;
+        }
+        if (!tracer->start(options.tracePath))
+        {
+            return 1;
+        }
+        nes->setJitEnabled(false);
+    }
+
+    // A pipeline converts frames on its own thread; otherwise finished
+    // frames are converted here as soon as they're complete
+    std::unique_ptr<FramePipeline> pipeline;
+    std::unique_ptr<NesPpu::Frame> frame;
+    std::unique_ptr<NesPpu::ColourConverter> converter;
+    std::unique_ptr<NesPpu::Image> image;
+    const size_t imagePitch = NesPpu::screenWidth * NesPpu::bytesPerPixel(options.pixelFormat);
+    if (options.pipeline)
+    {
+        pipeline.reset(new FramePipeline(options.pixelFormat));
+        if (!pipeline->start(options.videoPath))
+        {
+            return 1;
+        }
+        nes->setFramePipeline(pipeline.get());
+    }
+    else if (options.render)
+    {
+        frame.reset(new NesPpu::Frame());
+        nes->setFrame(frame.get());
+    }
+    if (options.convert && !pipeline)
+    {
+        converter.reset(new NesPpu::ColourConverter(options.pixelFormat));
+        image.reset(new NesPpu::Image());
+    }
+
+    std::unique_ptr<AudioSink> audio;
+    if (!options.audioPath.empty())
+    {
+        audio.reset(new AudioSink());
+        if (!audio->open(options.audioPath, options.sampleRate))
+        {
+            return 1;
+        }
+        nes->setAudioSink(audio.get());
+    }
+
+    std::unique_ptr<Debugger> debugger;
+    if (!options.breakpoints.empty() || !options.watchRanges.empty())
+    {
+        debugger.reset(new Debugger());
+        for (uint16_t address : options.breakpoints)
+        {
+            debugger->setBreakpoint(address);
+        }
+        for (size_t i = 0; i < options.watchRanges.size(); ++i)
+        {
+            debugger->setWatchpoint(options.watchRanges[i].first, options.watchRanges[i].second, options.watchTypes[i]);
+        }
+        nes->setDebugger(debugger.get());
+    }
+
+    nes->setFrameSkip(options.frameSkip);
+    const uint64_t startRendered = nes->getRenderedFrameCount();
+
+    // Time spent on drawn and skipped frames, for separate rates
+    double renderedSeconds = 0;
+    double skippedSeconds = 0;
+
+    const auto startTime = std::chrono::steady_clock::now();
+    uint64_t budgeted = 0;
+    while (budgeted < totalCycles)
+    {
+        const uint64_t frameIndex = nes->getFrameCount() - startFrame;
+        nes->setController(0, frameIndex < input.size() ? input[frameIndex] : 0);
+        if (rewind)
+        {
+            rewind->record(*nes);
+        }
+
+        const bool drawing = nes->isDrawingFrame();
+        const uint64_t renderedBefore = nes->getRenderedFrameCount();
+        const auto frameStart = std::chrono::steady_clock::now();
+        const uint64_t budget = std::min<uint64_t>(cpuCyclesPerFrame, totalCycles - budgeted);
+        nes->run(static_cast<int64_t>(budget));
+        budgeted += budget;
+        if (converter && nes->getRenderedFrameCount() != renderedBefore)
+        {
+            converter->convert(*frame, image->bytes, imagePitch);
+        }
+        const double frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frameStart).count();
+        (drawing ? renderedSeconds : skippedSeconds) += frameSeconds;
+
+        if (debugger && debugger->isStopped())
+        {
+            printStop(debugger->getEvent(), nes->getCpu(), nes->getFrameCount() - startFrame);
+            break;
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (tracer)
+    {
+        nes->setTracer(nullptr);
+        tracer->stop();
+    }
+    if (pipeline)
+    {
+        nes->setFramePipeline(nullptr);
+        pipeline->stop();
+    }
+    if (audio)
+    {
+        nes->setAudioSink(nullptr);
+        audio->close();
+    }
+    const uint64_t cyclesRun = nes->getCpu().cycles - startCycle;
+    const uint64_t framesRun = nes->getFrameCount() - startFrame;
+    const uint64_t framesRendered = nes->getRenderedFrameCount() - startRendered;
+    const uint64_t skipped = nes->getCpu().skippedCycles - startSkipped;
+
+    std::ostringstream state;
+    nes->saveState(state);
+    const std::string stateBytes = state.str();
+    const uint64_t stateHash = SaveState::hash(reinterpret_cast<const uint8_t*>(stateBytes.data()), stateBytes.size());
+
+    if (!options.saveStatePath.empty())
+    {
+        std::ofstream stateFile(options.saveStatePath, std::ios::binary);
+        stateFile.write(stateBytes.data(), stateBytes.size());
+        if (!stateFile)
+        {
+            std::cout << "Error saving state " << options.saveStatePath << '\n';
+            return 1;
+        }
+    }
+
+    std::printf("frames: %" PRIu64 "\n", framesRun);
+    std::printf("cycles: %" PRIu64 " (%" PRIu64 " idle-skipped)\n", cyclesRun, skipped);
+    std::printf("seconds: %.3f\n", seconds);
+    std::printf("frames/s: %.1f\n", seconds > 0 ? framesRun / seconds : 0.0);
+    if (options.frameSkip != 0)
+    {
+        const uint64_t framesSkipped = framesRun - framesRendered;
+        std::printf("rendered: %" PRIu64 " frames, %.1f frames/s\n", framesRendered,
+            renderedSeconds > 0 ? framesRendered / renderedSeconds : 0.0);
+        std::printf("skipped: %" PRIu64 " frames, %.1f frames/s\n", framesSkipped,
+            skippedSeconds > 0 ? framesSkipped / skippedSeconds : 0.0);
+    }
+    std::printf("emulated MHz: %.2f\n", seconds > 0 ? cyclesRun / seconds / 1e6 : 0.0);
+    std::printf("ram hash: %016" PRIx64 "\n", nes->hashRam());
+    std::printf("state hash: %016" PRIx64 "\n", stateHash);
+    if (frame)
+    {
+        std::printf("frame hash: %016" PRIx64 "\n", SaveState::hash(frame->pixels, sizeof(frame->pixels)));
+    }
+    if (image)
+    {
+        std::printf("image hash: %016" PRIx64 "\n", SaveState::hash(image->bytes, NesPpu::screenHeight * imagePitch));
+    }
+    if (pipeline)
+    {
+        std::printf("image hash: %016" PRIx64 "\n",
+            SaveState::hash(pipeline->getImage().bytes, NesPpu::screenHeight * pipeline->getPitch()));
+        std::printf("pipeline: %" PRIu64 " frames converted, %" PRIu64 " dropped\n",
+            pipeline->getFramesConverted(), pipeline->getFramesDropped());
+    }
+    if (audio)
+    {
+        std::printf("audio: %" PRIu64 " samples, hash %016" PRIx64 "\n", audio->getSamplesWritten(), audio->getHash());
+    }
+    if (tracer)
+    {
+        std::printf("trace: %" PRIu64 " records\n", tracer->getRecordCount());
+    }
+    if (rewind)
+    {
+        std::printf("rewind: %zu frames in %zu bytes (%.1f bytes/frame)\n", rewind->size(), rewind->memoryUsed(),
+            rewind->size() != 0 ? static_cast<double>(rewind->memoryUsed()) / rewind->size() : 0.0);
+    }
+
+    return 0;
+}
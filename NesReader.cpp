@@ -1,20 +1,20 @@
 #include <iostream>
-#include <exception>
-#include <type_traits>
 #include "NesReader.h"
 
 void NesReader::initialize(NesMapper::Mapper &mapper)
 {
     NesMapper::MapperInfo mapperInfo;
-    open();
-    readCartridge();
+    if (!romImage)
+    {
+        open();
+    }
     mapperInfo = readHeader();
     mapper.setMapperInfo(mapperInfo);
 }
 
-NesReader::uint8Vec* NesReader::getCartridgeData()
+ByteSpan NesReader::getCartridgeData() const
 {
-    return &cartridgeData;
+    return romImage ? romImage->getData() : ByteSpan();
 }
 
 void NesReader::setFilename(std::string name)
@@ -22,51 +22,30 @@ void NesReader::setFilename(std::string name)
     filename = name;
 }
 
-void NesReader::open()
+void NesReader::setRomImage(std::shared_ptr<const RomImage> image)
 {
-    fileStream.open(filename, std::ios::binary);
-
-    if (!fileStream.is_open())
-    {
-        std::cout << "Error opening file \n";
-    }
-    else
-    {
-        fileStream.seekg(0, std::ios_base::end);
-        fileSize = static_cast<size_t>(fileStream.tellg());
-        fileStream.seekg(0, std::ios_base::beg);
-    }
+    romImage = std::move(image);
 }
 
-void NesReader::readCartridge()
+void NesReader::open()
 {
-    cartridgeData.resize(fileSize);
-    try 
-    {
-        size_t count = 0;
-        while (!fileStream.eof())
-        {
-            uint8_t byte = static_cast<uint8_t>(fileStream.get());
-            cartridgeData[count++] = byte;
-        }
-    }
-    catch(std::exception &e)
-    {
-        std::cout << e.what() << '\n';
-    }
+    // Maps the file rather than copying it byte by byte
+    romImage = RomImage::open(filename);
 }
 
 NesMapper::MapperInfo NesReader::readHeader()
 {
-    NesMapper::MapperInfo mapperInfo;
+    NesMapper::MapperInfo mapperInfo{};
 
     // .nes file header is 16 bytes
     constexpr uint32_t headerSize = 16;
-    uint8_t header[headerSize];
-    for (uint32_t i = 0; i < headerSize; ++i)
+    const ByteSpan cartridgeData = getCartridgeData();
+    if (cartridgeData.size() < headerSize)
     {
-        header[i] = cartridgeData.at(i);
+        std::cout << "Invalid file format \n";
+        return mapperInfo;
     }
+    const uint8_t* header = cartridgeData.data();
 
     // Check that it is a .nes file
     const uint32_t expectedSize = 4;
@@ -118,6 +97,16 @@ NesMapper::MapperInfo NesReader::readHeader()
     mapperInfo.numPrgRomBanks = numPrgRomBanks;
     mapperInfo.numChrRomBanks = numChrRomBanks;
     mapperInfo.trainerPresent = trainerPresent;
+    // Four-screen carts bring their own nametable RAM and ignore the
+    // mirroring bit
+    if (ignoreMirroring)
+    {
+        mapperInfo.mirroring = NesPpu::mirrorFourScreen;
+    }
+    else
+    {
+        mapperInfo.mirroring = mirroringVertical ? NesPpu::mirrorVertical : NesPpu::mirrorHorizontal;
+    }
     return mapperInfo;
 }
 
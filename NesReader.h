@@ -1,41 +1,32 @@
 #ifndef NESREADER_HXX
 #define NESREADER_HXX
 
-#include <fstream>
 #include <string>
-#include <vector>
 #include <stdint.h>
 #include <memory>
 #include "Mapper.h"
+#include "RomImage.h"
 
 class NesReader {
 
 public:
-    typedef std::vector<uint8_t> uint8Vec;
-
     NesReader() : filename{}
-        , fileStream{}
-        , fileSize{}
-        , cartridgeData{}
+        , romImage{}
     {}
 
-    ~NesReader()
-    {
-        if (fileStream.is_open())
-        {
-            fileStream.close();
-        }
-    }
-
+    // Load the ROM named by setFilename() unless setRomImage() already gave
+    // one, then read its header into the mapper
     void initialize(NesMapper::Mapper &mapper);
 
-    uint8Vec* getCartridgeData();
+    // The whole .nes file. Valid for as long as this reader holds the image.
+    ByteSpan getCartridgeData() const;
 
     void setFilename(std::string name);
 
-    void open();
+    // Use an image that is already loaded, e.g. one shared by many consoles
+    void setRomImage(std::shared_ptr<const RomImage> image);
 
-    void readCartridge();
+    void open();
 
     NesMapper::MapperInfo readHeader();
 
@@ -44,9 +35,7 @@ public:
 
 private:
     std::string filename;
-    std::ifstream fileStream;
-    size_t fileSize;
-    uint8Vec cartridgeData;
+    std::shared_ptr<const RomImage> romImage;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include "Ppu.h"
+#include "TileCache.h"
+#include "SaveState.h"
+
+namespace {
+
+// What unmapped pattern table pages read as
+const uint8_t noChr[NesPpu::chrPageSize] = {};
+
+// Nametable RAM pages of each preset layout
+const uint8_t mirroringPages[][NesPpu::numNametables] = {
+    {0, 0, 1, 1},
+    {0, 1, 0, 1},
+    {0, 0, 0, 0},
+    {1, 1, 1, 1},
+    {0, 1, 2, 3}
+};
+
+}
+
+NesPpu::Ppu::Ppu() : ram{new uint8_t[Snapshot::pageSize + nametableRamSize]()}
+    , nametableBytes{nametableRamSize}
+    , chrRamBytes{}
+    , nametables{}
+    , nametablePages{}
+    , mirroring{mirrorHorizontal}
+    , oam{}
+    , spriteType{}
+    , control{}
+    , mask{}
+    , status{}
+    , oamAddress{}
+    , vramAddress{}
+    , tempAddress{}
+    , fineX{}
+    , writeToggle{}
+    , readBuffer{}
+    , openBus{}
+    , chrPages{}
+    , chrWritable{}
+    , ramTracker{ram.get(), ramSize() / Snapshot::pageSize}
+    , frame{}
+    , syncStep{}
+    , spriteZeroHitDot{noSync}
+    , overflowLines{}
+    , overflowLinesValid{}
+    , clockCycles{}
+    , clockFrameStart{}
+    , tileCache{}
+    , tileCacheEnabled{true}
+{
+    for (uint32_t page = 0; page < numChrPages; ++page)
+    {
+        chrPages[page] = const_cast<uint8_t*>(noChr);
+    }
+    std::copy(mirroringPages[mirroring], mirroringPages[mirroring] + numNametables, nametablePages);
+    updateNametables();
+}
+
+NesPpu::Ppu::~Ppu() = default;
+
+uint8_t* NesPpu::Ppu::locate(uint16_t address)
+{
+    if (address >= paletteStart)
+    {
+        address &= paletteSize - 1;
+        if ((address & 0x13) == 0x10)
+        {
+            address &= ~0x10;
+        }
+        return ram.get() + address;
+    }
+    return nametables[(address / nametableSize) % numNametables] + address % nametableSize;
+}
+
+uint8_t NesPpu::Ppu::read(uint16_t address)
+{
+    address &= vramSize - 1;
+    if (address < patternTableSize)
+    {
+        return chrPages[address / chrPageSize][address % chrPageSize];
+    }
+    return *locate(address);
+}
+
+void NesPpu::Ppu::write(uint16_t address, uint8_t value)
+{
+    address &= vramSize - 1;
+    uint8_t* target;
+    if (address < patternTableSize)
+    {
+        // CHR-ROM ignores writes
+        if (!chrWritable)
+        {
+            return;
+        }
+        uint8_t* page = chrPages[address / chrPageSize];
+        target = page + address % chrPageSize;
+        if (tileCache)
+        {
+            // The same RAM may be mapped at more than one page
+            const uint32_t tile = (address % chrPageSize) / tileBytes;
+            for (uint32_t i = 0; i < numChrPages; ++i)
+            {
+                if (chrPages[i] == page)
+                {
+                    tileCache->invalidateTile(i * tilesPerChrPage + tile);
+                }
+            }
+        }
+    }
+    else
+    {
+        target = locate(address);
+    }
+    *target = value;
+    // Writable CHR pages may point at the cart's own RAM
+    if (target >= ram.get() && target < ram.get() + ramSize())
+    {
+        ramTracker.markDirty(static_cast<uint32_t>(target - ram.get()) / Snapshot::pageSize);
+    }
+}
+
+uint8_t* NesPpu::Ppu::getAddress(uint16_t address)
+{
+    address &= vramSize - 1;
+    if (address < patternTableSize)
+    {
+        return chrPages[address / chrPageSize] + address % chrPageSize;
+    }
+    return locate(address);
+}
+
+void NesPpu::Ppu::mapChr(uint16_t address, const uint8_t* data, uint32_t size, bool writable)
+{
+    for (uint32_t offset = 0; offset < size && address + offset < patternTableSize; offset += chrPageSize)
+    {
+        // Writes only go through the pointer when the data is writable
+        const uint32_t page = (address + offset) / chrPageSize;
+        if (tileCache && chrPages[page] != data + offset)
+        {
+            tileCache->invalidatePage(page);
+        }
+        chrPages[page] = const_cast<uint8_t*>(data + offset);
+    }
+    chrWritable = writable;
+}
+
+void NesPpu::Ppu::setTileCacheEnabled(bool enabled)
+{
+    tileCacheEnabled = enabled;
+    if (!enabled)
+    {
+        tileCache.reset();
+    }
+}
+
+void NesPpu::Ppu::invalidateTiles()
+{
+    if (tileCache)
+    {
+        tileCache->invalidateAll();
+    }
+}
+
+void NesPpu::Ppu::mapChrRam()
+{
+    if (chrRamBytes < patternTableSize)
+    {
+        resizeRam(nametableBytes, patternTableSize);
+    }
+    mapChr(0, ram.get() + Snapshot::pageSize + nametableBytes, patternTableSize, true);
+}
+
+void NesPpu::Ppu::setMirroring(Mirroring mirroring)
+{
+    catchUp();
+    if (mirroring == mirrorFourScreen && nametableBytes < numNametables * nametableSize)
+    {
+        resizeRam(numNametables * nametableSize, chrRamBytes);
+    }
+    this->mirroring = mirroring;
+    std::copy(mirroringPages[mirroring], mirroringPages[mirroring] + numNametables, nametablePages);
+    updateNametables();
+}
+
+void NesPpu::Ppu::mapNametable(uint32_t nametable, uint32_t page)
+{
+    if (nametable >= numNametables || page >= nametableBytes / nametableSize)
+    {
+        return;
+    }
+    catchUp();
+    nametablePages[nametable] = static_cast<uint8_t>(page);
+    updateNametables();
+}
+
+void NesPpu::Ppu::updateNametables()
+{
+    for (uint32_t i = 0; i < numNametables; ++i)
+    {
+        nametables[i] = ram.get() + Snapshot::pageSize + nametablePages[i] * nametableSize;
+    }
+}
+
+void NesPpu::Ppu::resizeRam(uint32_t nametableBytes, uint32_t chrRamBytes)
+{
+    // The palette page stays first and the nametable RAM second, so only
+    // CHR-RAM moves relative to the start
+    std::unique_ptr<uint8_t[]> resized{new uint8_t[Snapshot::pageSize + nametableBytes + chrRamBytes]()};
+    uint8_t* oldChrRam = ram.get() + Snapshot::pageSize + this->nametableBytes;
+    uint8_t* newChrRam = resized.get() + Snapshot::pageSize + nametableBytes;
+    std::copy(ram.get(), ram.get() + Snapshot::pageSize + std::min(this->nametableBytes, nametableBytes), resized.get());
+    std::copy(oldChrRam, oldChrRam + std::min(this->chrRamBytes, chrRamBytes), newChrRam);
+    for (uint32_t page = 0; page < numChrPages; ++page)
+    {
+        if (chrPages[page] >= oldChrRam && chrPages[page] < oldChrRam + this->chrRamBytes)
+        {
+            chrPages[page] = newChrRam + (chrPages[page] - oldChrRam);
+        }
+    }
+
+    ram = std::move(resized);
+    this->nametableBytes = nametableBytes;
+    this->chrRamBytes = chrRamBytes;
+    ramTracker = Snapshot::PageTracker(ram.get(), ramSize() / Snapshot::pageSize);
+    updateNametables();
+}
+
+uint8_t NesPpu::Ppu::readRegister(uint16_t address)
+{
+    catchUp();
+    switch (address & 7)
+    {
+    case ppuStatusRegister & 7:
+    {
+        // The low bits are whatever was last on the PPU data bus. Reading
+        // clears VBlank and the write toggle.
+        const uint8_t value = (status & 0xE0) | (openBus & 0x1F);
+        status &= ~statusVblank;
+        writeToggle = false;
+        openBus = value;
+        return value;
+    }
+    case oamDataRegister & 7:
+        openBus = oam[oamAddress];
+        return openBus;
+    case vramDataRegister & 7:
+    {
+        // Palette reads are immediate; the buffer still fills from the
+        // nametable underneath
+        uint8_t value = readBuffer;
+        if ((vramAddress & (vramSize - 1)) >= paletteStart)
+        {
+            value = read(vramAddress);
+            readBuffer = read(vramAddress - 0x1000);
+        }
+        else
+        {
+            readBuffer = read(vramAddress);
+        }
+        vramAddress += (control & 0x04) ? 32 : 1;
+        openBus = value;
+        return value;
+    }
+    default:
+        // Write-only registers
+        return openBus;
+    }
+}
+
+void NesPpu::Ppu::writeRegister(uint16_t address, uint8_t value)
+{
+    catchUp();
+    openBus = value;
+    switch (address & 7)
+    {
+    case ppuControlRegister1 & 7:
+        control = value;
+        spriteType = (value & 0x20) ? _8x16 : _8x8;
+        overflowLinesValid = false;
+        // Nametable select goes to bits 10-11 of t
+        tempAddress = (tempAddress & ~0x0C00) | ((value & 0x03) << 10);
+        break;
+    case ppuControlRegister2 & 7:
+        mask = value;
+        break;
+    case oamAddressRegister & 7:
+        oamAddress = value;
+        break;
+    case oamDataRegister & 7:
+        oam[oamAddress++] = value;
+        overflowLinesValid = false;
+        break;
+    case scrollRegister & 7:
+        if (!writeToggle)
+        {
+            tempAddress = (tempAddress & ~0x001F) | (value >> 3);
+            fineX = value & 0x07;
+        }
+        else
+        {
+            tempAddress = (tempAddress & ~0x73E0) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+        }
+        writeToggle = !writeToggle;
+        break;
+    case vramAddressRegister & 7:
+        if (!writeToggle)
+        {
+            tempAddress = (tempAddress & 0x00FF) | ((value & 0x3F) << 8);
+        }
+        else
+        {
+            tempAddress = (tempAddress & 0xFF00) | value;
+            vramAddress = tempAddress;
+        }
+        writeToggle = !writeToggle;
+        break;
+    case vramDataRegister & 7:
+        write(vramAddress, value);
+        vramAddress += (control & 0x04) ? 32 : 1;
+        break;
+    default:
+        // $2002 is read only
+        break;
+    }
+}
+
+void NesPpu::Ppu::setSpriteType(SpriteType type)
+{
+    spriteType = type;
+    control = (type == _8x16) ? (control | 0x20) : (control & ~0x20);
+    overflowLinesValid = false;
+}
+
+void NesPpu::Ppu::setNmiEnabled(bool enabled)
+{
+    control = enabled ? (control | 0x80) : (control & ~0x80);
+}
+
+void NesPpu::Ppu::saveState(std::ostream& out) const
+{
+    SaveState::writeBytes(out, ram.get(), ramSize());
+    saveRegisters(out);
+}
+
+bool NesPpu::Ppu::loadState(std::istream& in)
+{
+    if (!SaveState::readBytes(in, ram.get(), ramSize()))
+    {
+        return false;
+    }
+    ramTracker.markAllDirty();
+    invalidateTiles();
+    return loadRegisters(in);
+}
+
+void NesPpu::Ppu::saveRegisters(std::ostream& out) const
+{
+    SaveState::write(out, oam);
+    SaveState::write(out, control);
+    SaveState::write(out, mask);
+    SaveState::write(out, status);
+    SaveState::write(out, oamAddress);
+    SaveState::write(out, vramAddress);
+    SaveState::write(out, tempAddress);
+    SaveState::write(out, fineX);
+    SaveState::write(out, writeToggle);
+    SaveState::write(out, readBuffer);
+    SaveState::write(out, openBus);
+    SaveState::write(out, syncStep);
+    SaveState::write(out, spriteZeroHitDot);
+    SaveState::write(out, mirroring);
+    SaveState::write(out, nametablePages);
+}
+
+bool NesPpu::Ppu::loadRegisters(std::istream& in)
+{
+    const bool ok = SaveState::read(in, oam)
+        && SaveState::read(in, control) && SaveState::read(in, mask)
+        && SaveState::read(in, status) && SaveState::read(in, oamAddress)
+        && SaveState::read(in, vramAddress) && SaveState::read(in, tempAddress)
+        && SaveState::read(in, fineX) && SaveState::read(in, writeToggle)
+        && SaveState::read(in, readBuffer) && SaveState::read(in, openBus)
+        && SaveState::read(in, syncStep) && SaveState::read(in, spriteZeroHitDot)
+        && SaveState::read(in, mirroring) && SaveState::read(in, nametablePages);
+    spriteType = (control & 0x20) ? _8x16 : _8x8;
+    overflowLinesValid = false;
+    // Pages past the RAM this cart has would come from another cart's state
+    for (uint32_t i = 0; i < numNametables; ++i)
+    {
+        nametablePages[i] %= nametableBytes / nametableSize;
+    }
+    updateNametables();
+    return ok;
+}
+
+void NesPpu::Ppu::capture(StateSnapshot& snapshot)
+{
+    ramTracker.capture(snapshot.vram);
+}
+
+bool NesPpu::Ppu::restore(const StateSnapshot& snapshot)
+{
+    std::vector<uint32_t> restored;
+    if (!ramTracker.restore(snapshot.vram, restored))
+    {
+        return false;
+    }
+    // CHR-RAM follows the nametable RAM
+    for (uint32_t page : restored)
+    {
+        if (page >= (Snapshot::pageSize + nametableBytes) / Snapshot::pageSize)
+        {
+            invalidateTiles();
+            break;
+        }
+    }
+    return true;
+}
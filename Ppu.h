@@ -2,6 +2,10 @@
 #define PPU_HXX
 
 #include <stdint.h>
+#include <istream>
+#include <ostream>
+#include <memory>
+#include "Snapshot.h"
 
 namespace NesPpu
 {
@@ -13,27 +17,325 @@ enum SpriteType : int8_t
 };
 
 static const uint16_t ppuControlRegister1 = 0x2000;
+static const uint16_t ppuControlRegister2 = 0x2001;
 static const uint16_t ppuStatusRegister = 0x2002;
+static const uint16_t oamAddressRegister = 0x2003;
+static const uint16_t oamDataRegister = 0x2004;
+static const uint16_t scrollRegister = 0x2005;
+static const uint16_t vramAddressRegister = 0x2006;
+static const uint16_t vramDataRegister = 0x2007;
+
+// The eight registers repeat every 8 bytes up to $3FFF
+static const uint16_t ppuRegisterEnd = 0x3FFF;
+
+// PPU address space is 14 bits
+static const uint32_t vramSize = 0x4000;
+static const uint32_t oamSize = 0x100;
+static const uint16_t paletteStart = 0x3F00;
+static const uint32_t paletteSize = 0x20;
+
+// Pattern tables ($0000-$1FFF) are mapped in 1 KB CHR pages
+static const uint32_t patternTableSize = 0x2000;
+static const uint32_t chrPageSize = 0x400;
+static const uint32_t numChrPages = patternTableSize / chrPageSize;
+
+// The four nametables ($2000-$2FFF, repeated up to $3EFF) are 1 KB pages of
+// nametable RAM. The console has two pages; four-screen carts add two more.
+static const uint32_t nametableSize = 0x400;
+static const uint32_t numNametables = 4;
+static const uint32_t nametableRamSize = 2 * nametableSize;
+
+// Which page of nametable RAM each nametable shows
+enum Mirroring : uint8_t
+{
+    mirrorHorizontal,       // $2000 = $2400, $2800 = $2C00
+    mirrorVertical,         // $2000 = $2800, $2400 = $2C00
+    mirrorSingleLower,      // All four show the first page
+    mirrorSingleUpper,      // All four show the second page
+    mirrorFourScreen        // Four pages, two of them on the cart
+};
+
+// Status bits
+static const uint8_t statusVblank = 0x80;
+static const uint8_t statusSpriteZeroHit = 0x40;
+static const uint8_t statusSpriteOverflow = 0x20;
+
+// Mask ($2001) bits
+static const uint8_t maskGreyscale = 0x01;
+static const uint8_t maskBackgroundLeft = 0x02;
+static const uint8_t maskSpritesLeft = 0x04;
+static const uint8_t maskBackground = 0x08;
+static const uint8_t maskSprites = 0x10;
+static const uint8_t maskEmphasis = 0xE0;
+
+// Frame geometry. The PPU draws one pixel per dot, three dots per CPU cycle.
+static const uint32_t screenWidth = 256;
+static const uint32_t screenHeight = 240;
+static const uint32_t dotsPerScanline = 341;
+static const uint32_t scanlinesPerFrame = 262;
+static const uint32_t preRenderScanline = 261;
+
+static const uint32_t numSprites = oamSize / 4;
+static const uint32_t maxSpritesPerLine = 8;
+
+// A finished picture: the NES colour (0-63) of every pixel, and the
+// emphasis bits of $2001 each line was drawn with
+struct Frame {
+    alignas(64) uint8_t pixels[screenHeight * screenWidth];
+    uint8_t emphasis[screenHeight];
+};
+
+class TileCache;
 
 class Ppu {
 
 public:
 
-    Ppu() : vram{}
-        , spriteType{}
-    {}
-       
-    int8_t read(uint16_t address);
+    Ppu();
+
+    ~Ppu();
+
+    // CHR and nametable pages point into this object's RAM
+    Ppu(const Ppu&) = delete;
+    Ppu& operator=(const Ppu&) = delete;
+
+    // PPU address space ($0000-$3FFF)
+    uint8_t read(uint16_t address);
+
+    void write(uint16_t address, uint8_t value);
+
+    // Writes through the pointer bypass snapshot tracking and the tile cache
+    uint8_t* getAddress(uint16_t address);
+
+    // Point the pattern tables at size bytes of CHR data starting at
+    // address, without copying. Writes are dropped unless writable. Decoded
+    // tiles of the pages that change are dropped.
+    void mapChr(uint16_t address, const uint8_t* data, uint32_t size, bool writable);
+
+    // Use 8 KB of CHR-RAM, for carts without CHR-ROM. The RAM is allocated
+    // the first time.
+    void mapChrRam();
+
+    // Lay the nametables out for the cart's wiring. Four-screen allocates
+    // the cart's extra 2 KB the first time. Mappers that switch mirroring
+    // call this at the write; lines up to then keep the old layout.
+    void setMirroring(Mirroring mirroring);
+
+    // Show page (0-3) of nametable RAM as nametable (0-3), for mappers with
+    // layouts the presets don't cover. Pages 2 and 3 need four-screen RAM.
+    void mapNametable(uint32_t nametable, uint32_t page);
+
+    Mirroring getMirroring() const { return mirroring; }
+
+    /////////////////////////////////////
+    // CPU-visible registers
+    /////////////////////////////////////
+
+    // Register access from the CPU bus, $2000-$3FFF
+    uint8_t readRegister(uint16_t address);
+
+    void writeRegister(uint16_t address, uint8_t value);
+
+    // One byte of OAM DMA ($4014)
+    void writeOam(uint8_t value)
+    {
+        oam[oamAddress++] = value;
+        overflowLinesValid = false;
+    }
+
+    // Enable 8x8 or 8x16 sprites (bit 5 of $2000)
+    void setSpriteType(SpriteType type);
+
+    // Enable or disable the NMI at the start of VBlank (bit 7 of $2000)
+    void setNmiEnabled(bool enabled);
+
+    bool nmiEnabled() const { return (control & 0x80) != 0; }
+
+    /////////////////////////////////////
+    // Frame timing
+    /////////////////////////////////////
+
+    // Scanline 241: set the VBlank flag
+    void beginVblank() { status |= statusVblank; }
+
+    // Pre-render scanline: clear VBlank, sprite 0 hit and sprite overflow
+    void endVblank()
+    {
+        status &= ~(statusVblank | statusSpriteZeroHit | statusSpriteOverflow);
+        spriteZeroHitDot = noSync;
+    }
+
+    /////////////////////////////////////
+    // Rendering
+    /////////////////////////////////////
+
+    // Draw into frame, or run headless with null. Headless lines still
+    // evaluate sprites for overflow and sprite 0 hit, but draw nothing.
+    void setFrame(Frame* frame) { this->frame = frame; }
+
+    Frame* getFrame() const { return frame; }
 
-    void write(uint16_t address, int8_t value);
+    // Draw from decoded tiles kept between lines (the default), or decode
+    // each tile row's bitplanes as it's drawn
+    void setTileCacheEnabled(bool enabled);
 
-    int8_t* getAddress(uint16_t address);
+    // Do the scanline work due up to PPU dot `dot` of the frame, counting
+    // from dot 0 of scanline 0. Each visible line is drawn whole at its
+    // first dot; the scroll counters step at dot 257 as on hardware.
+    void runTo(uint32_t dot);
+
+    // Where the CPU's cycle count and the cycle the frame started on come
+    // from. With a clock, register accesses first catch the scanline work
+    // up to the CPU, so the PPU can lag behind it between accesses.
+    void setClock(const uint64_t* cycles, const uint64_t* frameStartCycle)
+    {
+        clockCycles = cycles;
+        clockFrameStart = frameStartCycle;
+    }
+
+    // Do the scanline work due up to the CPU's current cycle. Anything that
+    // changes what the PPU draws has to call this first.
+    void catchUp()
+    {
+        if (clockCycles)
+        {
+            runTo(static_cast<uint32_t>((*clockCycles - *clockFrameStart) * 3));
+        }
+    }
+
+    // The next dot $2002 can change on without a register access: a pending
+    // sprite 0 hit, the next line sprite 0 could hit on or the next line
+    // with sprite overflow. noSync if nothing can change before the frame
+    // ends. A CPU idling on $2002 has to stop there to see the flag on time;
+    // a write to $2000, $2001 or OAM can bring the dot forward.
+    uint32_t nextSyncDot();
+
+    static const uint32_t noSync = 0xFFFFFFFF;
+
+    // Finish the frame's scanline work and start over at scanline 0
+    void endFrame();
+
+    void saveState(std::ostream& out) const;
+    bool loadState(std::istream& in);
+
+    // Everything but RAM: OAM, the register file and the nametable layout
+    void saveRegisters(std::ostream& out) const;
+    bool loadRegisters(std::istream& in);
+
+    // Store RAM as shared pages, copying only pages written since the last
+    // capture or restore
+    void capture(StateSnapshot& snapshot);
+
+    // Copy back the RAM pages that differ from the snapshot
+    bool restore(const StateSnapshot& snapshot);
 
 private:
-    int8_t vram[65535]; // 16-bit address
+    // Scanline work alternates drawing line n at its first dot and stepping
+    // the scroll counters at its dot 257. The pre-render line only steps.
+    static uint32_t stepDot(uint32_t step);
+
+    // How many steps of the frame are due by a dot
+    static uint32_t stepsDue(uint32_t dot);
+
+    bool renderingEnabled() const { return (mask & (maskBackground | maskSprites)) != 0; }
+
+    void drawScanline(uint32_t line);
+
+    // Dot 257: move v down a row and back to the left edge. On the
+    // pre-render line v also takes t's vertical scroll.
+    void endScanline(uint32_t line);
+
+    // Palette addresses (0-15, 0 where transparent) of the background
+    // line starting at v, before fine X scroll
+    void fetchBackground(uint8_t* line);
+
+    // Set overflowLines from OAM and the sprite size
+    void findOverflowLines();
+
+    // Fill sprites[] with the OAM indices on a line, in priority order, and
+    // set the overflow flag. Returns how many were found, up to eight.
+    uint32_t evaluateSprites(uint32_t line, uint8_t* sprites);
+
+    // Palette addresses (16-31, 0 where transparent) of the given sprites on
+    // a line, flagged with spriteBehind and spriteZero. pixels has room for
+    // a sprite at x = 255.
+    void drawSprites(uint32_t line, const uint8_t* sprites, uint32_t count, uint8_t* pixels);
+
+    // The tile cache, allocated on first use, or null when it's disabled
+    TileCache* getTileCache();
+
+    // Drop decoded copies of CHR-RAM written behind the cache's back
+    void invalidateTiles();
+
+    // The 32 palette entries with the sprite backdrop mirrors filled in and
+    // greyscale applied
+    void loadPalette(uint8_t* palette) const;
+
+    // Where a byte from $2000 up lives: in a nametable page, or in the
+    // palette, where $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C
+    uint8_t* locate(uint16_t address);
+
+    // Reallocate RAM with room for the given nametable RAM and CHR-RAM,
+    // keeping the contents and moving the pages that point into it
+    void resizeRam(uint32_t nametableBytes, uint32_t chrRamBytes);
+
+    // Point the nametables at their pages of RAM
+    void updateNametables();
+
+    uint32_t ramSize() const { return Snapshot::pageSize + nametableBytes + chrRamBytes; }
+
+    // One block so snapshots track it together: a page holding the
+    // palette, the nametable RAM, then CHR-RAM if the cart has any
+    std::unique_ptr<uint8_t[]> ram;
+    uint32_t nametableBytes;
+    uint32_t chrRamBytes;
+    uint8_t* nametables[numNametables];
+    uint8_t nametablePages[numNametables];
+    Mirroring mirroring;
+
+    uint8_t oam[oamSize];
     SpriteType spriteType;
+
+    uint8_t control;        // $2000
+    uint8_t mask;           // $2001
+    uint8_t status;         // $2002, bits 5-7
+    uint8_t oamAddress;     // $2003
+
+    // Loopy's v, t, x and w: current and temporary VRAM address, fine X
+    // scroll and the shared $2005/$2006 write toggle
+    uint16_t vramAddress;
+    uint16_t tempAddress;
+    uint8_t fineX;
+    bool writeToggle;
+
+    uint8_t readBuffer;     // $2007 reads are delayed by one
+    uint8_t openBus;        // Last value written to any register
+
+    // Pattern table pages, pointing at CHR-ROM or into RAM
+    uint8_t* chrPages[numChrPages];
+    bool chrWritable;
+
+    // Every RAM write goes through write(), which marks its page
+    Snapshot::PageTracker ramTracker;
+
+    Frame* frame;
+    uint32_t syncStep;      // Next piece of scanline work in the frame
+
+    // Dot the sprite 0 hit flag goes up on, found when the line was drawn
+    uint32_t spriteZeroHitDot;
+
+    // One bit per visible line with more than eight sprites on it, worked
+    // out again after OAM or the sprite size changes
+    uint64_t overflowLines[4];
+    bool overflowLinesValid;
+
+    const uint64_t* clockCycles;
+    const uint64_t* clockFrameStart;
+
+    std::unique_ptr<TileCache> tileCache;
+    bool tileCacheEnabled;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,712 @@
+#include <cstring>
+#include "Ppu.h"
+#include "TileCache.h"
+#include "Simd.h"
+
+namespace {
+
+// Tiles fetched per line: 32 on screen and one more for fine X scroll,
+// rounded up to a whole number of vector steps
+const uint32_t tilesPerLine = 36;
+
+// Scanline work: draw and step each visible line, then step the pre-render
+// line
+const uint32_t scrollStepDot = 257;
+const uint32_t lastSyncStep = 2 * NesPpu::screenHeight;
+
+const uint8_t spritePaletteStart = 0x10;
+
+const uint64_t everyByte = 0x0101010101010101ull;
+
+// OAM attribute bits
+const uint8_t attributePalette = 0x03;
+const uint8_t attributeBehind = 0x20;
+const uint8_t attributeFlipX = 0x40;
+const uint8_t attributeFlipY = 0x80;
+
+// Flags on sprite line pixels, above the palette address
+const uint8_t spriteBehind = 0x20;  // Drawn behind opaque background
+const uint8_t spriteZero = 0x40;    // From OAM entry 0
+const uint8_t paletteAddressMask = 0x1F;
+
+uint8_t reverseBits(uint8_t value)
+{
+    value = static_cast<uint8_t>((value & 0xF0) >> 4 | (value & 0x0F) << 4);
+    value = static_cast<uint8_t>((value & 0xCC) >> 2 | (value & 0x33) << 2);
+    return static_cast<uint8_t>((value & 0xAA) >> 1 | (value & 0x55) << 1);
+}
+
+// Copy one decoded row (eight pixels of 0-3) of each of count tiles and
+// add its palette bits (palette * 4) to the opaque pixels
+void paintTiles(const uint8_t* const* rows, const uint8_t* palette, uint32_t count, uint8_t* out)
+{
+    uint32_t tile = 0;
+#if NES_AVX2
+    const __m256i selectPalette = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; tile + 4 <= count; tile += 4)
+    {
+        int64_t row[4];
+        for (uint32_t i = 0; i < 4; ++i)
+        {
+            std::memcpy(&row[i], rows[tile + i], sizeof(row[i]));
+        }
+        uint32_t palette4;
+        std::memcpy(&palette4, palette + tile, sizeof(palette4));
+
+        const __m256i pixels = _mm256_set_epi64x(row[3], row[2], row[1], row[0]);
+        const __m256i palettes = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(palette4)), selectPalette);
+        const __m256i transparent = _mm256_cmpeq_epi8(pixels, zero);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + tile * NesPpu::tileWidth),
+            _mm256_or_si256(pixels, _mm256_andnot_si256(transparent, palettes)));
+    }
+#elif NES_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; tile + 2 <= count; tile += 2)
+    {
+        int64_t row[2];
+        std::memcpy(&row[0], rows[tile], sizeof(row[0]));
+        std::memcpy(&row[1], rows[tile + 1], sizeof(row[1]));
+
+        const __m128i pixels = _mm_set_epi64x(row[1], row[0]);
+        const __m128i palettes = _mm_set_epi64x(static_cast<long long>(palette[tile + 1] * everyByte),
+            static_cast<long long>(palette[tile] * everyByte));
+        const __m128i transparent = _mm_cmpeq_epi8(pixels, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + tile * NesPpu::tileWidth),
+            _mm_or_si128(pixels, _mm_andnot_si128(transparent, palettes)));
+    }
+#endif
+    for (; tile < count; ++tile)
+    {
+        for (uint32_t x = 0; x < NesPpu::tileWidth; ++x)
+        {
+            const uint8_t pixel = rows[tile][x];
+            out[tile * NesPpu::tileWidth + x] = pixel ? pixel | palette[tile] : 0;
+        }
+    }
+}
+
+uint32_t countBits(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return static_cast<uint32_t>(__builtin_popcountll(bits));
+#else
+    uint32_t count = 0;
+    for (; bits; bits &= bits - 1)
+    {
+        ++count;
+    }
+    return count;
+#endif
+}
+
+uint32_t lowestBit(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return static_cast<uint32_t>(__builtin_ctzll(bits));
+#else
+    uint32_t bit = 0;
+    for (; !(bits & 1); bits >>= 1)
+    {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// One bit per OAM entry, set where a sprite height lines tall covers the
+// line below row. OAM holds the line above each sprite's top.
+uint64_t spritesBelow(const uint8_t* oam, uint32_t row, uint32_t height)
+{
+#if NES_SSE2
+    // Sixteen entries a step: mask each entry down to its Y byte and pack
+    // twice to get the Y bytes in order, then compare all sixteen at once
+    const __m128i yMask = _mm_set1_epi32(0xFF);
+    const __m128i rowBytes = _mm_set1_epi8(static_cast<char>(row));
+    const __m128i lastRow = _mm_set1_epi8(static_cast<char>(height - 1));
+    uint64_t covered = 0;
+    for (uint32_t group = 0; group < NesPpu::numSprites / 16; ++group)
+    {
+        const __m128i* entries = reinterpret_cast<const __m128i*>(oam) + group * 4;
+        const __m128i y = _mm_packus_epi16(
+            _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(entries), yMask),
+                _mm_and_si128(_mm_loadu_si128(entries + 1), yMask)),
+            _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(entries + 2), yMask),
+                _mm_and_si128(_mm_loadu_si128(entries + 3), yMask)));
+
+        // y <= row, then row - y <= height - 1 without wrapping
+        const __m128i started = _mm_cmpeq_epi8(_mm_max_epu8(y, rowBytes), rowBytes);
+        const __m128i offset = _mm_sub_epi8(rowBytes, y);
+        const __m128i notEnded = _mm_cmpeq_epi8(_mm_min_epu8(offset, lastRow), offset);
+        covered |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_and_si128(started, notEnded))) << (group * 16);
+    }
+    return covered;
+#else
+    uint64_t covered = 0;
+    for (uint32_t i = 0; i < NesPpu::numSprites; ++i)
+    {
+        if (row - oam[i * 4] < height)
+        {
+            covered |= 1ull << i;
+        }
+    }
+    return covered;
+#endif
+}
+
+// Lay one sprite's eight decoded pixels (0-3) over a sprite line, tagged
+// with flags, where the line is still transparent. line may run up to
+// eight bytes past the screen.
+void mergeSpriteRow(const uint8_t* row, uint8_t flags, uint8_t* line)
+{
+#if NES_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pixels = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row));
+    const __m128i current = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(line));
+    const __m128i take = _mm_andnot_si128(_mm_cmpeq_epi8(pixels, zero), _mm_cmpeq_epi8(current, zero));
+    const __m128i tagged = _mm_or_si128(pixels, _mm_set1_epi8(static_cast<char>(flags)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(line), _mm_or_si128(current, _mm_and_si128(take, tagged)));
+#else
+    for (uint32_t x = 0; x < NesPpu::tileWidth; ++x)
+    {
+        if (row[x] && !line[x])
+        {
+            line[x] = flags | row[x];
+        }
+    }
+#endif
+}
+
+// First x where an opaque sprite 0 pixel is over opaque background, or
+// screenWidth for none. The hit never happens at x = 255.
+uint32_t findSpriteZeroHit(const uint8_t* background, const uint8_t* sprites)
+{
+    uint32_t x = 0;
+#if NES_AVX2
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i zeroFlag = _mm256_set1_epi8(spriteZero);
+    for (; x < NesPpu::screenWidth; x += 32)
+    {
+        const __m256i sprite = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sprites + x));
+        const __m256i back = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + x));
+        const __m256i hits = _mm256_andnot_si256(_mm256_cmpeq_epi8(back, zero),
+            _mm256_cmpeq_epi8(_mm256_and_si256(sprite, zeroFlag), zeroFlag));
+        const uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(hits));
+        if (bits)
+        {
+            x += lowestBit(bits);
+            break;
+        }
+    }
+#elif NES_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i zeroFlag = _mm_set1_epi8(spriteZero);
+    for (; x < NesPpu::screenWidth; x += 16)
+    {
+        const __m128i sprite = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprites + x));
+        const __m128i back = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + x));
+        const __m128i hits = _mm_andnot_si128(_mm_cmpeq_epi8(back, zero),
+            _mm_cmpeq_epi8(_mm_and_si128(sprite, zeroFlag), zeroFlag));
+        const uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(hits));
+        if (bits)
+        {
+            x += lowestBit(bits);
+            break;
+        }
+    }
+#else
+    while (x < NesPpu::screenWidth && !((sprites[x] & spriteZero) && background[x]))
+    {
+        ++x;
+    }
+#endif
+    return x < NesPpu::screenWidth - 1 ? x : NesPpu::screenWidth;
+}
+
+// Put sprite pixels in front of the background, or behind it where it's
+// opaque and the sprite is flagged. Both lines hold palette addresses.
+void composite(const uint8_t* background, const uint8_t* sprites, uint8_t* out)
+{
+    uint32_t x = 0;
+#if NES_AVX2
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i behindFlag = _mm256_set1_epi8(spriteBehind);
+    const __m256i addressMask = _mm256_set1_epi8(paletteAddressMask);
+    for (; x < NesPpu::screenWidth; x += 32)
+    {
+        const __m256i sprite = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sprites + x));
+        const __m256i back = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + x));
+        // Hidden where transparent, or flagged behind opaque background
+        const __m256i behind = _mm256_cmpeq_epi8(_mm256_and_si256(sprite, behindFlag), behindFlag);
+        const __m256i hidden = _mm256_or_si256(_mm256_cmpeq_epi8(sprite, zero),
+            _mm256_andnot_si256(_mm256_cmpeq_epi8(back, zero), behind));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x),
+            _mm256_blendv_epi8(_mm256_and_si256(sprite, addressMask), back, hidden));
+    }
+#elif NES_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behindFlag = _mm_set1_epi8(spriteBehind);
+    const __m128i addressMask = _mm_set1_epi8(paletteAddressMask);
+    for (; x < NesPpu::screenWidth; x += 16)
+    {
+        const __m128i sprite = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprites + x));
+        const __m128i back = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + x));
+        const __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(sprite, behindFlag), behindFlag);
+        const __m128i hidden = _mm_or_si128(_mm_cmpeq_epi8(sprite, zero),
+            _mm_andnot_si128(_mm_cmpeq_epi8(back, zero), behind));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_or_si128(_mm_and_si128(hidden, back),
+            _mm_andnot_si128(hidden, _mm_and_si128(sprite, addressMask))));
+    }
+#endif
+    for (; x < NesPpu::screenWidth; ++x)
+    {
+        const uint8_t sprite = sprites[x];
+        const uint8_t front = (sprite != 0) & (!(sprite & spriteBehind) | (background[x] == 0));
+        out[x] = front ? sprite & paletteAddressMask : background[x];
+    }
+}
+
+// Replace palette addresses (0-31) with the colours they hold
+void lookupColours(const uint8_t* addresses, const uint8_t* palette, uint8_t* colours, uint32_t count)
+{
+    uint32_t i = 0;
+#if NES_AVX2
+    // Each half of the palette is a 16-entry shuffle table
+    const __m256i background = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(palette)));
+    const __m256i sprite = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette + spritePaletteStart)));
+    const __m256i spriteBit = _mm256_set1_epi8(spritePaletteStart);
+    for (; i + 32 <= count; i += 32)
+    {
+        const __m256i address = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(addresses + i));
+        const __m256i isSprite = _mm256_cmpeq_epi8(_mm256_and_si256(address, spriteBit), spriteBit);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(colours + i), _mm256_blendv_epi8(
+            _mm256_shuffle_epi8(background, address), _mm256_shuffle_epi8(sprite, address), isSprite));
+    }
+#elif NES_SSSE3
+    const __m128i background = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette));
+    const __m128i sprite = _mm_loadu_si128(reinterpret_cast<const __m128i*>(palette + spritePaletteStart));
+    const __m128i spriteBit = _mm_set1_epi8(spritePaletteStart);
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i address = _mm_loadu_si128(reinterpret_cast<const __m128i*>(addresses + i));
+        const __m128i isSprite = _mm_cmpeq_epi8(_mm_and_si128(address, spriteBit), spriteBit);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(colours + i),
+            _mm_or_si128(_mm_andnot_si128(isSprite, _mm_shuffle_epi8(background, address)),
+                _mm_and_si128(isSprite, _mm_shuffle_epi8(sprite, address))));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        colours[i] = palette[addresses[i] & paletteAddressMask];
+    }
+}
+
+}
+
+uint32_t NesPpu::Ppu::stepDot(uint32_t step)
+{
+    if (step < lastSyncStep)
+    {
+        return (step / 2) * dotsPerScanline + (step & 1) * scrollStepDot;
+    }
+    return step == lastSyncStep ? preRenderScanline * dotsPerScanline + scrollStepDot : noSync;
+}
+
+uint32_t NesPpu::Ppu::stepsDue(uint32_t dot)
+{
+    const uint32_t line = dot / dotsPerScanline;
+    if (line < screenHeight)
+    {
+        return line * 2 + (dot % dotsPerScanline >= scrollStepDot ? 2 : 1);
+    }
+    return dot >= stepDot(lastSyncStep) ? lastSyncStep + 1 : lastSyncStep;
+}
+
+void NesPpu::Ppu::runTo(uint32_t dot)
+{
+    // Headless lines with rendering off don't do anything, so catching up
+    // through them is just a matter of counting
+    if (!frame && !renderingEnabled())
+    {
+        const uint32_t due = stepsDue(dot);
+        syncStep = due > syncStep ? due : syncStep;
+    }
+
+    while (syncStep <= lastSyncStep && stepDot(syncStep) <= dot)
+    {
+        if (syncStep == lastSyncStep)
+        {
+            endScanline(preRenderScanline);
+        }
+        else if (syncStep & 1)
+        {
+            endScanline(syncStep / 2);
+        }
+        else
+        {
+            drawScanline(syncStep / 2);
+        }
+        ++syncStep;
+    }
+
+    if (spriteZeroHitDot <= dot)
+    {
+        status |= statusSpriteZeroHit;
+        spriteZeroHitDot = noSync;
+    }
+}
+
+uint32_t NesPpu::Ppu::nextSyncDot()
+{
+    uint32_t dot = spriteZeroHitDot;
+
+    // First line not drawn yet. Nothing is evaluated on lines drawn with
+    // rendering off.
+    uint32_t line = (syncStep + 1) / 2;
+    if (line >= screenHeight || !renderingEnabled())
+    {
+        return dot;
+    }
+
+    // Lines sprite 0 covers, while a hit is still possible
+    const uint32_t height = spriteType == _8x16 ? 16 : 8;
+    if ((mask & maskBackground) && (mask & maskSprites) && !(status & statusSpriteZeroHit)
+        && spriteZeroHitDot == noSync)
+    {
+        const uint32_t top = oam[0] + 1u;
+        const uint32_t first = line > top ? line : top;
+        if (first < top + height && first < screenHeight)
+        {
+            dot = first * dotsPerScanline;
+        }
+    }
+
+    if (!(status & statusSpriteOverflow))
+    {
+        if (!overflowLinesValid)
+        {
+            findOverflowLines();
+        }
+        for (; line < screenHeight; line = (line | 63) + 1)
+        {
+            const uint64_t lines = overflowLines[line / 64] >> (line % 64);
+            if (lines)
+            {
+                const uint32_t overflowDot = (line + lowestBit(lines)) * dotsPerScanline;
+                dot = overflowDot < dot ? overflowDot : dot;
+                break;
+            }
+        }
+    }
+    return dot;
+}
+
+void NesPpu::Ppu::findOverflowLines()
+{
+    // Count the sprites on each line from where each one starts and ends.
+    // OAM holds the line above each sprite's top.
+    const uint32_t height = spriteType == _8x16 ? 16 : 8;
+    int32_t changes[screenHeight + 1] = {};
+    for (uint32_t i = 0; i < numSprites; ++i)
+    {
+        const uint32_t top = oam[i * 4] + 1u;
+        if (top < screenHeight)
+        {
+            ++changes[top];
+            --changes[top + height < screenHeight ? top + height : screenHeight];
+        }
+    }
+
+    int32_t count = 0;
+    for (uint64_t& word : overflowLines)
+    {
+        word = 0;
+    }
+    for (uint32_t line = 0; line < screenHeight; ++line)
+    {
+        count += changes[line];
+        if (count > static_cast<int32_t>(maxSpritesPerLine))
+        {
+            overflowLines[line / 64] |= 1ull << (line % 64);
+        }
+    }
+    overflowLinesValid = true;
+}
+
+void NesPpu::Ppu::endFrame()
+{
+    runTo(noSync);
+    syncStep = 0;
+}
+
+void NesPpu::Ppu::drawScanline(uint32_t line)
+{
+    uint8_t* colours = frame ? frame->pixels + line * screenWidth : nullptr;
+    if (frame)
+    {
+        frame->emphasis[line] = mask & maskEmphasis;
+    }
+
+    uint8_t palette[paletteSize];
+    if (!renderingEnabled())
+    {
+        // The screen shows the backdrop colour
+        if (colours)
+        {
+            loadPalette(palette);
+            std::memset(colours, palette[0], screenWidth);
+        }
+        return;
+    }
+
+    uint8_t sprites[maxSpritesPerLine];
+    const uint32_t count = evaluateSprites(line, sprites);
+    const bool showBackground = (mask & maskBackground) != 0;
+    const bool showSprites = (mask & maskSprites) != 0;
+
+    // Sprite 0 can only hit where both layers are shown. Headless lines
+    // draw nothing else.
+    const bool testSpriteZero = showBackground && showSprites && count != 0 && sprites[0] == 0
+        && !(status & statusSpriteZeroHit) && spriteZeroHitDot == noSync;
+    if (!colours && !testSpriteZero)
+    {
+        return;
+    }
+
+    alignas(32) uint8_t background[tilesPerLine * tileWidth];
+    alignas(32) uint8_t spriteLine[screenWidth + tileWidth];
+    std::memset(spriteLine, 0, sizeof(spriteLine));
+    if (showSprites)
+    {
+        drawSprites(line, sprites, colours ? count : 1, spriteLine);
+    }
+    if (showBackground)
+    {
+        fetchBackground(background);
+    }
+    else
+    {
+        std::memset(background, 0, sizeof(background));
+    }
+
+    uint8_t* backgroundLine = background + fineX;
+    if (!(mask & maskBackgroundLeft))
+    {
+        std::memset(backgroundLine, 0, tileWidth);
+    }
+    if (!(mask & maskSpritesLeft))
+    {
+        std::memset(spriteLine, 0, tileWidth);
+    }
+
+    if (testSpriteZero)
+    {
+        // The flag goes up as the pixel is output, on dot x + 1, and the
+        // CPU sees it from then on
+        const uint32_t x = findSpriteZeroHit(backgroundLine, spriteLine);
+        if (x != screenWidth)
+        {
+            spriteZeroHitDot = line * dotsPerScanline + x + 1;
+        }
+    }
+
+    if (colours)
+    {
+        alignas(32) uint8_t addresses[screenWidth];
+        composite(backgroundLine, spriteLine, addresses);
+        loadPalette(palette);
+        lookupColours(addresses, palette, colours, screenWidth);
+    }
+}
+
+void NesPpu::Ppu::endScanline(uint32_t line)
+{
+    if (!renderingEnabled())
+    {
+        return;
+    }
+
+    // Fine Y, carrying into coarse Y. Coarse Y wraps to the nametable below
+    // after row 29; rows 30 and 31 are attributes and wrap in place.
+    if ((vramAddress & 0x7000) != 0x7000)
+    {
+        vramAddress += 0x1000;
+    }
+    else
+    {
+        vramAddress &= ~0x7000;
+        uint16_t coarseY = (vramAddress >> 5) & 0x1F;
+        if (coarseY == 29)
+        {
+            coarseY = 0;
+            vramAddress ^= 0x0800;
+        }
+        else if (coarseY == 31)
+        {
+            coarseY = 0;
+        }
+        else
+        {
+            ++coarseY;
+        }
+        vramAddress = (vramAddress & ~0x03E0) | (coarseY << 5);
+    }
+
+    // Coarse X and the horizontal nametable bit come back from t
+    vramAddress = (vramAddress & ~0x041F) | (tempAddress & 0x041F);
+    if (line == preRenderScanline)
+    {
+        vramAddress = (vramAddress & ~0x7BE0) | (tempAddress & 0x7BE0);
+    }
+}
+
+void NesPpu::Ppu::fetchBackground(uint8_t* line)
+{
+    uint16_t tiles[tilesPerLine];
+    uint8_t palette[tilesPerLine];
+
+    // The line crosses into the next nametable to the right at most once.
+    // Within one, the row of tiles and its row of attributes are fixed.
+    const uint32_t patternTable = (control & 0x10) << 4;
+    uint16_t nametable = vramAddress & 0x0C00;
+    uint32_t coarseX = vramAddress & 0x1F;
+    const uint32_t coarseY = (vramAddress >> 5) & 0x1F;
+    const uint32_t attributeShift = (coarseY & 2) << 1;
+    for (uint32_t tile = 0; tile < tilesPerLine; )
+    {
+        const uint8_t* page = nametables[nametable / nametableSize];
+        const uint8_t* names = page + coarseY * 32;
+        const uint8_t* attributes = page + 0x3C0 + (coarseY >> 2) * 8;
+        for (; coarseX < 32 && tile < tilesPerLine; ++coarseX, ++tile)
+        {
+            tiles[tile] = static_cast<uint16_t>(patternTable | names[coarseX]);
+            const uint32_t shift = attributeShift | (coarseX & 2);
+            palette[tile] = static_cast<uint8_t>(((attributes[coarseX >> 2] >> shift) & 3) << 2);
+        }
+        coarseX = 0;
+        nametable ^= 0x0400;
+    }
+
+    const uint32_t fineY = (vramAddress >> 12) & 7;
+    if (TileCache* cache = getTileCache())
+    {
+        const uint8_t* rows[tilesPerLine];
+        for (uint32_t tile = 0; tile < tilesPerLine; ++tile)
+        {
+            rows[tile] = cache->getTile(tiles[tile], false, chrPages) + fineY * tileWidth;
+        }
+        paintTiles(rows, palette, tilesPerLine, line);
+        return;
+    }
+
+    uint8_t low[tilesPerLine];
+    uint8_t high[tilesPerLine];
+    for (uint32_t tile = 0; tile < tilesPerLine; ++tile)
+    {
+        // Both planes of a row are in the same 16-byte tile
+        const uint32_t address = tiles[tile] * tileBytes + fineY;
+        const uint8_t* row = chrPages[address / chrPageSize] + address % chrPageSize;
+        low[tile] = row[0];
+        high[tile] = row[tileWidth];
+    }
+    decodeTiles(low, high, palette, tilesPerLine, line);
+}
+
+uint32_t NesPpu::Ppu::evaluateSprites(uint32_t line, uint8_t* sprites)
+{
+    // Sprites start at least a line below their OAM Y, so line 0 has none
+    if (line == 0)
+    {
+        return 0;
+    }
+
+    const uint64_t covered = spritesBelow(oam, line - 1, spriteType == _8x16 ? 16 : 8);
+    uint32_t count = 0;
+    for (uint64_t rest = covered; rest && count < maxSpritesPerLine; rest &= rest - 1)
+    {
+        sprites[count++] = static_cast<uint8_t>(lowestBit(rest));
+    }
+    if (countBits(covered) > maxSpritesPerLine)
+    {
+        status |= statusSpriteOverflow;
+    }
+    return count;
+}
+
+void NesPpu::Ppu::drawSprites(uint32_t line, const uint8_t* sprites, uint32_t count, uint8_t* pixels)
+{
+    TileCache* cache = getTileCache();
+    const uint32_t height = spriteType == _8x16 ? 16 : 8;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint8_t* entry = oam + sprites[i] * 4;
+        const uint8_t tile = entry[1];
+        const uint8_t attributes = entry[2];
+        const uint32_t x = entry[3];
+
+        uint32_t row = line - 1 - entry[0];
+        if (attributes & attributeFlipY)
+        {
+            row = height - 1 - row;
+        }
+
+        // 8x16 sprites take their pattern table from bit 0 of the tile
+        // number and stack two tiles
+        const uint16_t address = spriteType == _8x16
+            ? ((tile & 1) << 12) | ((tile & 0xFE) << 4) | ((row & 8) << 1) | (row & 7)
+            : ((control & 0x08) << 9) | (tile << 4) | row;
+        const uint8_t flags = spritePaletteStart | ((attributes & attributePalette) << 2)
+            | ((attributes & attributeBehind) ? spriteBehind : 0) | (sprites[i] == 0 ? spriteZero : 0);
+        const bool flipX = (attributes & attributeFlipX) != 0;
+
+        // Eight pixels of 0-3, from the tile cache or the bitplanes
+        uint8_t decoded[tileWidth];
+        const uint8_t* rowPixels = decoded;
+        if (cache)
+        {
+            rowPixels = cache->getTile(address / tileBytes, flipX, chrPages) + (address % tileBytes) * tileWidth;
+        }
+        else
+        {
+            const uint8_t* pattern = chrPages[address / chrPageSize] + address % chrPageSize;
+            const uint8_t low = flipX ? reverseBits(pattern[0]) : pattern[0];
+            const uint8_t high = flipX ? reverseBits(pattern[tileWidth]) : pattern[tileWidth];
+            for (uint32_t p = 0; p < tileWidth; ++p)
+            {
+                const uint32_t shift = 7 - p;
+                decoded[p] = ((low >> shift) & 1) | (((high >> shift) & 1) << 1);
+            }
+        }
+
+        // Earlier sprites win, so only fill pixels still transparent
+        mergeSpriteRow(rowPixels, flags, pixels + x);
+    }
+}
+
+NesPpu::TileCache* NesPpu::Ppu::getTileCache()
+{
+    if (tileCacheEnabled && !tileCache)
+    {
+        tileCache.reset(new TileCache());
+    }
+    return tileCache.get();
+}
+
+void NesPpu::Ppu::loadPalette(uint8_t* palette) const
+{
+    std::memcpy(palette, ram.get(), paletteSize);
+
+    // Sprite palettes share the backdrop entry
+    for (uint32_t i = spritePaletteStart; i < paletteSize; i += 4)
+    {
+        palette[i] = palette[i - spritePaletteStart];
+    }
+
+    const uint8_t colourMask = (mask & maskGreyscale) ? 0x30 : 0x3F;
+    for (uint32_t i = 0; i < paletteSize; ++i)
+    {
+        palette[i] &= colourMask;
+    }
+}
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cstring>
+#include "Rewind.h"
+
+namespace {
+
+// Zero runs shorter than this stay inside a literal run, where they cost
+// less than starting a new token
+const size_t minZeroRun = 4;
+
+void writeVarint(std::vector<uint8_t>& out, size_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool readVarint(const uint8_t*& in, const uint8_t* end, size_t& value)
+{
+    value = 0;
+    for (uint32_t shift = 0; in < end && shift < 64; shift += 7)
+    {
+        const uint8_t byte = *in++;
+        value |= static_cast<size_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run-length encodes an XOR delta as tokens of (zero run, literal count,
+// literal bytes). Trailing zeros are dropped since XORing them is a no-op.
+class DeltaEncoder {
+
+public:
+    explicit DeltaEncoder(std::vector<uint8_t>& out) : out(out)
+        , zeroRun{}
+        , literals{}
+        , trailingZeros{}
+    {}
+
+    void zeros(size_t count)
+    {
+        if (literals.empty())
+        {
+            zeroRun += count;
+        }
+        else
+        {
+            trailingZeros += count;
+        }
+    }
+
+    // XOR of current and previous; a null previous stores current as is
+    void bytes(const uint8_t* current, const uint8_t* previous, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const uint8_t delta = previous ? current[i] ^ previous[i] : current[i];
+            if (delta == 0)
+            {
+                zeros(1);
+                continue;
+            }
+            if (trailingZeros >= minZeroRun)
+            {
+                emit();
+                zeroRun = trailingZeros;
+            }
+            else
+            {
+                literals.insert(literals.end(), trailingZeros, 0);
+            }
+            trailingZeros = 0;
+            literals.push_back(delta);
+        }
+    }
+
+    void finish()
+    {
+        if (!literals.empty())
+        {
+            emit();
+        }
+    }
+
+private:
+    void emit()
+    {
+        writeVarint(out, zeroRun);
+        writeVarint(out, literals.size());
+        out.insert(out.end(), literals.begin(), literals.end());
+        zeroRun = 0;
+        literals.clear();
+    }
+
+    std::vector<uint8_t>& out;
+    size_t zeroRun;
+    std::vector<uint8_t> literals;
+    size_t trailingZeros;
+};
+
+void encodePages(DeltaEncoder& encoder, const std::vector<Snapshot::PagePtr>& current,
+    const std::vector<Snapshot::PagePtr>* previous)
+{
+    for (size_t page = 0; page < current.size(); ++page)
+    {
+        if (!previous)
+        {
+            encoder.bytes(current[page]->data(), nullptr, Snapshot::pageSize);
+        }
+        else if ((*previous)[page] == current[page])
+        {
+            // Shared page: unchanged since the previous frame
+            encoder.zeros(Snapshot::pageSize);
+        }
+        else
+        {
+            encoder.bytes(current[page]->data(), (*previous)[page]->data(), Snapshot::pageSize);
+        }
+    }
+}
+
+// Split a flat state back into pages
+const uint8_t* unflattenPages(const uint8_t* in, size_t count, std::vector<Snapshot::PagePtr>& pages)
+{
+    pages.resize(count);
+    for (size_t page = 0; page < count; ++page)
+    {
+        std::shared_ptr<Snapshot::Page> copy = std::make_shared<Snapshot::Page>();
+        std::memcpy(copy->data(), in, Snapshot::pageSize);
+        pages[page] = std::move(copy);
+        in += Snapshot::pageSize;
+    }
+    return in;
+}
+
+}
+
+Rewind::Rewind(size_t budget, uint32_t keyframeInterval) : ring{new uint8_t[budget]}
+    , ringSize{budget}
+    , entries{}
+    , head{}
+    , used{}
+    , keyframeInterval{std::max<uint32_t>(keyframeInterval, 1)}
+    , sinceKeyframe{}
+    , previous{}
+    , scratch{}
+{}
+
+void Rewind::record(Console& console)
+{
+    StateSnapshot current;
+    console.snapshot(current);
+
+    // History of a differently shaped machine can't be decoded against this one
+    if (!entries.empty() && !sameLayout(current))
+    {
+        clear();
+    }
+
+    bool keyframe = entries.empty() || sinceKeyframe >= keyframeInterval;
+    encode(current, keyframe);
+    if (!store(keyframe))
+    {
+        keyframe = true;
+        encode(current, true);
+        store(true);
+    }
+    sinceKeyframe = keyframe ? 1 : sinceKeyframe + 1;
+    previous = std::move(current);
+}
+
+bool Rewind::rewind(Console& console, size_t frames)
+{
+    if (frames >= entries.size())
+    {
+        return false;
+    }
+    const size_t target = entries.size() - 1 - frames;
+
+    // The oldest entry is always a keyframe
+    size_t keyframe = target;
+    while (!entries[keyframe].keyframe)
+    {
+        --keyframe;
+    }
+
+    std::vector<uint8_t> state(flatSize(previous), 0);
+    for (size_t index = keyframe; index <= target; ++index)
+    {
+        decode(index, state);
+    }
+
+    StateSnapshot snapshot;
+    const uint8_t* in = state.data();
+    snapshot.registers.assign(reinterpret_cast<const char*>(in), previous.registers.size());
+    in += previous.registers.size();
+    in = unflattenPages(in, previous.ram.size(), snapshot.ram);
+    in = unflattenPages(in, previous.sram.size(), snapshot.sram);
+    unflattenPages(in, previous.vram.size(), snapshot.vram);
+
+    if (!console.restore(snapshot))
+    {
+        return false;
+    }
+
+    while (entries.size() > target + 1)
+    {
+        used -= entries.back().size;
+        entries.pop_back();
+    }
+    head = (entries.back().offset + entries.back().size) % ringSize;
+    sinceKeyframe = static_cast<uint32_t>(target - keyframe + 1);
+    previous = std::move(snapshot);
+    return true;
+}
+
+void Rewind::clear()
+{
+    entries.clear();
+    head = 0;
+    used = 0;
+    sinceKeyframe = 0;
+}
+
+void Rewind::encode(const StateSnapshot& current, bool keyframe)
+{
+    scratch.clear();
+    DeltaEncoder encoder(scratch);
+    const StateSnapshot* base = keyframe ? nullptr : &previous;
+    encoder.bytes(reinterpret_cast<const uint8_t*>(current.registers.data()),
+        base ? reinterpret_cast<const uint8_t*>(base->registers.data()) : nullptr, current.registers.size());
+    encodePages(encoder, current.ram, base ? &base->ram : nullptr);
+    encodePages(encoder, current.sram, base ? &base->sram : nullptr);
+    encodePages(encoder, current.vram, base ? &base->vram : nullptr);
+    encoder.finish();
+}
+
+bool Rewind::store(bool keyframe)
+{
+    if (scratch.size() > ringSize)
+    {
+        // Doesn't fit at all; start over with the next frame
+        clear();
+        return true;
+    }
+
+    while (used + scratch.size() > ringSize)
+    {
+        used -= entries.front().size;
+        entries.pop_front();
+    }
+    // A chain without its keyframe can't be decoded
+    while (!entries.empty() && !entries.front().keyframe)
+    {
+        used -= entries.front().size;
+        entries.pop_front();
+    }
+    if (!keyframe && entries.empty())
+    {
+        return false;
+    }
+
+    const size_t first = std::min(scratch.size(), ringSize - head);
+    std::memcpy(ring.get() + head, scratch.data(), first);
+    std::memcpy(ring.get(), scratch.data() + first, scratch.size() - first);
+    entries.push_back(Entry{head, scratch.size(), keyframe});
+    head = (head + scratch.size()) % ringSize;
+    used += scratch.size();
+    return true;
+}
+
+void Rewind::decode(size_t index, std::vector<uint8_t>& state)
+{
+    const Entry& entry = entries[index];
+    scratch.resize(entry.size);
+    const size_t first = std::min(entry.size, ringSize - entry.offset);
+    std::memcpy(scratch.data(), ring.get() + entry.offset, first);
+    std::memcpy(scratch.data() + first, ring.get(), entry.size - first);
+
+    const uint8_t* in = scratch.data();
+    const uint8_t* end = in + scratch.size();
+    size_t position = 0;
+    while (in < end)
+    {
+        size_t zeroRun = 0;
+        size_t count = 0;
+        if (!readVarint(in, end, zeroRun) || !readVarint(in, end, count))
+        {
+            return;
+        }
+        position += zeroRun;
+        count = std::min({count, static_cast<size_t>(end - in), state.size() - std::min(position, state.size())});
+        for (size_t i = 0; i < count; ++i)
+        {
+            state[position + i] ^= in[i];
+        }
+        position += count;
+        in += count;
+    }
+}
+
+size_t Rewind::flatSize(const StateSnapshot& snapshot)
+{
+    return snapshot.registers.size()
+        + (snapshot.ram.size() + snapshot.sram.size() + snapshot.vram.size()) * Snapshot::pageSize;
+}
+
+bool Rewind::sameLayout(const StateSnapshot& snapshot) const
+{
+    return snapshot.registers.size() == previous.registers.size() && snapshot.ram.size() == previous.ram.size()
+        && snapshot.sram.size() == previous.sram.size() && snapshot.vram.size() == previous.vram.size();
+}
@@ -0,0 +1,88 @@
+#ifndef REWIND_HXX
+#define REWIND_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "Console.h"
+#include "Snapshot.h"
+
+// Default history budget and how often a full state is stored. At 60 frames
+// per second the interval bounds a seek to one second of deltas.
+static const size_t defaultRewindBudget = 64 << 20;
+static const uint32_t defaultKeyframeInterval = 60;
+
+// Frame-by-frame history of a console in a fixed-size ring buffer. Each
+// frame is stored as the XOR of its state with the previous frame's,
+// run-length encoded; since most of the machine doesn't change between
+// frames the delta is almost all zeros. Every keyframeInterval frames a
+// full state (a delta against zeros) starts a new chain, so seeking decodes
+// at most keyframeInterval entries. When the buffer is full the oldest
+// chain is dropped.
+class Rewind {
+
+public:
+    explicit Rewind(size_t budget = defaultRewindBudget, uint32_t keyframeInterval = defaultKeyframeInterval);
+
+    // Append the console's current state as the newest frame
+    void record(Console& console);
+
+    // Restore the state recorded frames entries before the newest (0 is the
+    // newest) and drop everything newer, so recording carries on from there.
+    // Returns false if the history doesn't reach that far.
+    bool rewind(Console& console, size_t frames);
+
+    void clear();
+
+    // Frames that can be restored
+    size_t size() const { return entries.size(); }
+
+    // Bytes of the ring buffer holding history
+    size_t memoryUsed() const { return used; }
+
+    size_t capacity() const { return ringSize; }
+
+private:
+    struct Entry {
+        size_t offset;      // Start in the ring; entries may wrap
+        size_t size;
+        bool keyframe;
+    };
+
+    // Encode current against previous, or against zeros for a keyframe,
+    // into scratch
+    void encode(const StateSnapshot& current, bool keyframe);
+
+    // Copy scratch into the ring, evicting old chains to make room. Returns
+    // false if a delta lost its keyframe and has to be re-encoded.
+    bool store(bool keyframe);
+
+    // XOR entry index into state
+    void decode(size_t index, std::vector<uint8_t>& state);
+
+    // Bytes in the flat form of a snapshot: registers, then RAM, SRAM and
+    // vram pages
+    static size_t flatSize(const StateSnapshot& snapshot);
+
+    bool sameLayout(const StateSnapshot& snapshot) const;
+
+    // Left uninitialized so the OS commits pages only as history grows
+    std::unique_ptr<uint8_t[]> ring;
+    size_t ringSize;
+    std::deque<Entry> entries;
+    size_t head;
+    size_t used;
+
+    uint32_t keyframeInterval;
+    uint32_t sinceKeyframe;
+
+    // The newest recorded state. Its pages are shared with the console's
+    // next snapshot wherever they didn't change, which the encoder uses to
+    // skip them.
+    StateSnapshot previous;
+    std::vector<uint8_t> scratch;
+};
+
+#endif
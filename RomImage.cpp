@@ -0,0 +1,90 @@
+#include <iostream>
+#include <fstream>
+#include "RomImage.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NES_HAS_MMAP 1
+#else
+#define NES_HAS_MMAP 0
+#endif
+
+RomImage::~RomImage()
+{
+#if NES_HAS_MMAP
+    if (mapping)
+    {
+        munmap(mapping, length);
+    }
+#endif
+}
+
+std::shared_ptr<const RomImage> RomImage::open(const std::string& path)
+{
+    std::shared_ptr<RomImage> image(new RomImage());
+    if (!image->map(path) && !image->readAll(path))
+    {
+        std::cout << "Error opening file \n";
+        return nullptr;
+    }
+    return image;
+}
+
+bool RomImage::map(const std::string& path)
+{
+#if NES_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    void* address = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping keeps the file alive on its own
+    close(fd);
+
+    if (address == MAP_FAILED)
+    {
+        return false;
+    }
+    mapping = address;
+    bytes = static_cast<const uint8_t*>(address);
+    length = static_cast<size_t>(info.st_size);
+    return true;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+bool RomImage::readAll(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    const std::streamoff size = file.tellg();
+    if (size < 0)
+    {
+        return false;
+    }
+    buffer.resize(static_cast<size_t>(size));
+    file.seekg(0, std::ios_base::beg);
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), size))
+    {
+        return false;
+    }
+    bytes = buffer.data();
+    length = buffer.size();
+    return true;
+}
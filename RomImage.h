@@ -0,0 +1,77 @@
+#ifndef ROMIMAGE_HXX
+#define ROMIMAGE_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A read-only view of bytes owned elsewhere
+class ByteSpan {
+
+public:
+    ByteSpan() : bytes{}
+        , length{}
+    {}
+
+    ByteSpan(const uint8_t* data, size_t size) : bytes{data}
+        , length{size}
+    {}
+
+    const uint8_t* data() const { return bytes; }
+
+    size_t size() const { return length; }
+
+    bool empty() const { return length == 0; }
+
+    const uint8_t& operator[](size_t index) const { return bytes[index]; }
+
+    const uint8_t* begin() const { return bytes; }
+
+    const uint8_t* end() const { return bytes + length; }
+
+private:
+    const uint8_t* bytes;
+    size_t length;
+};
+
+// The bytes of a ROM file, loaded once and never modified. The file is
+// memory-mapped read-only where the platform supports it, so pages are
+// shared with the OS page cache and only touched as the game reads them;
+// otherwise it is read in one bulk read. Consoles hold the image through a
+// shared_ptr, so any number of them can run one copy.
+class RomImage {
+
+public:
+    ~RomImage();
+
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    // Load a ROM file. Returns null if it can't be opened or read.
+    static std::shared_ptr<const RomImage> open(const std::string& path);
+
+    ByteSpan getData() const { return ByteSpan(bytes, length); }
+
+    // True when the bytes are a file mapping rather than a heap copy
+    bool isMapped() const { return mapping != nullptr; }
+
+private:
+    RomImage() : bytes{}
+        , length{}
+        , mapping{}
+        , buffer{}
+    {}
+
+    bool map(const std::string& path);
+
+    bool readAll(const std::string& path);
+
+    const uint8_t* bytes;
+    size_t length;
+    void* mapping;
+    std::vector<uint8_t> buffer;
+};
+
+#endif
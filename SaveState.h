@@ -0,0 +1,57 @@
+#ifndef SAVESTATE_HXX
+#define SAVESTATE_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <istream>
+#include <ostream>
+
+// Raw binary serialization shared by the components of a save state. Values
+// are stored in host byte order; states are meant for the machine and build
+// that made them.
+namespace SaveState {
+
+// "NESS" followed by the format version
+static const uint32_t magic = 0x5353454E;
+static const uint32_t version = 7;
+
+template<typename T>
+void write(std::ostream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+bool read(std::istream& in, T& value)
+{
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return static_cast<bool>(in);
+}
+
+// A block whose size is only known at run time
+inline void writeBytes(std::ostream& out, const uint8_t* data, size_t size)
+{
+    out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+}
+
+inline bool readBytes(std::istream& in, uint8_t* data, size_t size)
+{
+    in.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(size));
+    return static_cast<bool>(in);
+}
+
+// 64-bit FNV-1a, used to compare states between runs
+inline uint64_t hash(const uint8_t* data, size_t size, uint64_t seed = 0xCBF29CE484222325ull)
+{
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= data[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+}
+
+#endif
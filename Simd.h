@@ -0,0 +1,74 @@
+#ifndef SIMD_HXX
+#define SIMD_HXX
+
+// Vector instruction sets the build targets. Code takes the widest path it
+// has and falls back to scalar; build with -mavx2 (or -march=native) to get
+// the 256-bit paths.
+//
+// GCC and Clang on x86-64 can also build single functions for SSSE3 and
+// AVX2 with NES_TARGET and pick one at run time with cpuHasSsse3() and
+// cpuHasAvx2(), for code with no good SSE2 path.
+#if defined(__AVX2__)
+#define NES_AVX2 1
+#else
+#define NES_AVX2 0
+#endif
+
+#if defined(__SSSE3__) || NES_AVX2
+#define NES_SSSE3 1
+#else
+#define NES_SSSE3 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || NES_SSSE3
+#define NES_SSE2 1
+#else
+#define NES_SSE2 0
+#endif
+
+#if NES_SSE2
+#include <immintrin.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define NES_SIMD_DISPATCH 1
+#define NES_TARGET(isa) __attribute__((target(isa)))
+#else
+#define NES_SIMD_DISPATCH 0
+#define NES_TARGET(isa)
+#endif
+
+// Whether SSSE3 and AVX2 functions are built, either for the whole build or
+// behind NES_TARGET
+#define NES_HAVE_SSSE3 (NES_SSSE3 || NES_SIMD_DISPATCH)
+#define NES_HAVE_AVX2 (NES_AVX2 || NES_SIMD_DISPATCH)
+
+namespace Simd
+{
+
+// Whether the CPU running the build can take those functions
+inline bool cpuHasSsse3()
+{
+#if NES_SSSE3
+    return true;
+#elif NES_SIMD_DISPATCH
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+inline bool cpuHasAvx2()
+{
+#if NES_AVX2
+    return true;
+#elif NES_SIMD_DISPATCH
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+}
+
+#endif
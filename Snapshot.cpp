@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <cstring>
+#include "Snapshot.h"
+
+Snapshot::PageTracker::PageTracker(uint8_t* data, uint32_t numPages) : data{data}
+    , numPages{numPages}
+    , dirty((numPages + 63) / 64)
+    , base(numPages)
+{
+    markAllDirty();
+}
+
+void Snapshot::PageTracker::markAllDirty()
+{
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        markDirty(page);
+    }
+}
+
+uint32_t Snapshot::PageTracker::capture(std::vector<PagePtr>& pages)
+{
+    uint32_t copied = 0;
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        if (isDirty(page) || !base[page])
+        {
+            std::shared_ptr<Page> copy = std::make_shared<Page>();
+            std::memcpy(copy->data(), data + page * pageSize, pageSize);
+            base[page] = std::move(copy);
+            ++copied;
+        }
+    }
+    std::fill(dirty.begin(), dirty.end(), 0);
+    pages = base;
+    return copied;
+}
+
+bool Snapshot::PageTracker::restore(const std::vector<PagePtr>& pages, std::vector<uint32_t>& restored)
+{
+    if (pages.size() != numPages)
+    {
+        return false;
+    }
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        if (!pages[page])
+        {
+            return false;
+        }
+    }
+
+    // A page untouched since the last capture already matches any snapshot
+    // that shares that capture's page
+    for (uint32_t page = 0; page < numPages; ++page)
+    {
+        if (isDirty(page) || base[page] != pages[page])
+        {
+            std::memcpy(data + page * pageSize, pages[page]->data(), pageSize);
+            restored.push_back(page);
+        }
+    }
+    std::fill(dirty.begin(), dirty.end(), 0);
+    base = pages;
+    return true;
+}
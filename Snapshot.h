@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_HXX
+#define SNAPSHOT_HXX
+
+#include <stdint.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Snapshot {
+
+// Snapshots copy memory in 256-byte pages
+static const uint32_t pageSize = 0x100;
+
+typedef std::array<uint8_t, pageSize> Page;
+
+// Pages are immutable once captured, so snapshots share every page that
+// didn't change between them
+typedef std::shared_ptr<const Page> PagePtr;
+
+// Tracks which pages of a block of memory were written since the last
+// capture or restore. A capture copies only those pages and shares the rest
+// with the previous capture; a restore copies back only pages that differ.
+class PageTracker {
+
+public:
+    PageTracker(uint8_t* data, uint32_t numPages);
+
+    void markDirty(uint32_t page) { dirty[page >> 6] |= 1ull << (page & 63); }
+
+    bool isDirty(uint32_t page) const { return (dirty[page >> 6] & (1ull << (page & 63))) != 0; }
+
+    // E.g. after the whole block is loaded from a stream
+    void markAllDirty();
+
+    // Store the current contents in pages. Returns the number of pages copied.
+    uint32_t capture(std::vector<PagePtr>& pages);
+
+    // Make the memory match pages. restored gets the index of every page that
+    // was copied back. Returns false if pages is the wrong size.
+    bool restore(const std::vector<PagePtr>& pages, std::vector<uint32_t>& restored);
+
+private:
+    uint8_t* data;
+    uint32_t numPages;
+    std::vector<uint64_t> dirty;
+
+    // Contents as of the last capture or restore
+    std::vector<PagePtr> base;
+};
+
+}
+
+// The whole machine at one instant. Memory is held as shared pages; the
+// registers of every component are kept in save-state format.
+struct StateSnapshot {
+    std::string registers;
+    std::vector<Snapshot::PagePtr> ram;
+    std::vector<Snapshot::PagePtr> sram;
+    std::vector<Snapshot::PagePtr> vram;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include <cstring>
+#include "TileCache.h"
+#include "Simd.h"
+
+namespace {
+
+// One bit per byte, bit 7 in the first: the leftmost pixel comes first
+const uint64_t pixelBits = 0x0102040810204080ull;
+const uint64_t everyByte = 0x0101010101010101ull;
+
+}
+
+void NesPpu::decodeTiles(const uint8_t* low, const uint8_t* high, const uint8_t* palette, uint32_t count, uint8_t* out)
+{
+    uint32_t tile = 0;
+#if NES_AVX2
+    // Four tiles a step. Both planes of all four go to every 64-bit lane and
+    // a shuffle spreads each tile's byte over its eight pixels; comparing
+    // against one bit per byte then yields 0 or -1 per pixel and plane.
+    const __m256i selectLow = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i selectHigh = _mm256_add_epi8(selectLow, _mm256_set1_epi8(4));
+    const __m256i bits = _mm256_set1_epi64x(static_cast<long long>(pixelBits));
+    const __m256i zero = _mm256_setzero_si256();
+    for (; tile + 4 <= count; tile += 4)
+    {
+        uint32_t low4;
+        uint32_t high4;
+        uint32_t palette4;
+        std::memcpy(&low4, low + tile, sizeof(low4));
+        std::memcpy(&high4, high + tile, sizeof(high4));
+        std::memcpy(&palette4, palette + tile, sizeof(palette4));
+
+        const __m256i planes = _mm256_set1_epi64x(static_cast<long long>(low4 | static_cast<uint64_t>(high4) << 32));
+        const __m256i lowSet = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(planes, selectLow), bits), bits);
+        const __m256i highSet = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(planes, selectHigh), bits), bits);
+        // 0 - low - 2 * high, with each set bit as -1
+        const __m256i pixels = _mm256_sub_epi8(_mm256_sub_epi8(zero, lowSet), _mm256_add_epi8(highSet, highSet));
+
+        const __m256i palettes = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(palette4)), selectLow);
+        const __m256i transparent = _mm256_cmpeq_epi8(pixels, zero);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + tile * tileWidth),
+            _mm256_or_si256(pixels, _mm256_andnot_si256(transparent, palettes)));
+    }
+#elif NES_SSE2
+    // Two tiles a step, broadcasting each tile's bytes with a multiply
+    const __m128i bits = _mm_set1_epi64x(static_cast<long long>(pixelBits));
+    const __m128i zero = _mm_setzero_si128();
+    for (; tile + 2 <= count; tile += 2)
+    {
+        const __m128i lowBytes = _mm_set_epi64x(static_cast<long long>(low[tile + 1] * everyByte),
+            static_cast<long long>(low[tile] * everyByte));
+        const __m128i highBytes = _mm_set_epi64x(static_cast<long long>(high[tile + 1] * everyByte),
+            static_cast<long long>(high[tile] * everyByte));
+        const __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(lowBytes, bits), bits);
+        const __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(highBytes, bits), bits);
+        const __m128i pixels = _mm_sub_epi8(_mm_sub_epi8(zero, lowSet), _mm_add_epi8(highSet, highSet));
+
+        const __m128i palettes = _mm_set_epi64x(static_cast<long long>(palette[tile + 1] * everyByte),
+            static_cast<long long>(palette[tile] * everyByte));
+        const __m128i transparent = _mm_cmpeq_epi8(pixels, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + tile * tileWidth),
+            _mm_or_si128(pixels, _mm_andnot_si128(transparent, palettes)));
+    }
+#endif
+    for (; tile < count; ++tile)
+    {
+        for (uint32_t x = 0; x < tileWidth; ++x)
+        {
+            const uint32_t shift = 7 - x;
+            const uint8_t pixel = ((low[tile] >> shift) & 1) | (((high[tile] >> shift) & 1) << 1);
+            out[tile * tileWidth + x] = pixel ? pixel | palette[tile] : 0;
+        }
+    }
+}
+
+void NesPpu::TileCache::invalidateAll()
+{
+    for (uint64_t& word : valid)
+    {
+        word = 0;
+    }
+}
+
+void NesPpu::TileCache::decode(uint32_t tile, uint8_t* const* chrPages)
+{
+    const uint32_t address = tile * tileBytes;
+    const uint8_t* pattern = chrPages[address / chrPageSize] + address % chrPageSize;
+
+    // The eight rows as eight one-row tiles with no palette
+    const uint8_t noPalette[tileWidth] = {};
+    decodeTiles(pattern, pattern + tileWidth, noPalette, tileWidth, pixels[tile]);
+
+    for (uint32_t row = 0; row < tilePixels; row += tileWidth)
+    {
+        for (uint32_t x = 0; x < tileWidth; ++x)
+        {
+            flippedPixels[tile][row + x] = pixels[tile][row + tileWidth - 1 - x];
+        }
+    }
+
+    valid[tile >> 6] |= 1ull << (tile & 63);
+    ++decodes;
+}
@@ -0,0 +1,67 @@
+#ifndef TILECACHE_HXX
+#define TILECACHE_HXX
+
+#include <stdint.h>
+#include "Ppu.h"
+
+namespace NesPpu
+{
+
+// Pattern tiles are 8x8 pixels of 2 bits, stored as two 8-byte bitplanes
+static const uint32_t tileWidth = 8;
+static const uint32_t tileBytes = 16;
+static const uint32_t tilePixels = tileWidth * tileWidth;
+static const uint32_t numTiles = patternTableSize / tileBytes;
+static const uint32_t tilesPerChrPage = chrPageSize / tileBytes;
+
+// Expand one row of each of count tiles, given as its two bitplanes and
+// palette bits (palette * 4), into a palette address per pixel, leftmost
+// first. Pixel value 0 is transparent and stays 0 whatever the palette.
+void decodeTiles(const uint8_t* low, const uint8_t* high, const uint8_t* palette, uint32_t count, uint8_t* out);
+
+// The 512 tiles of both pattern tables decoded to one byte (0-3) per
+// pixel, as mapped by the PPU's CHR pages, and mirrored left to right for
+// flipped sprites. Tiles are decoded on first use and kept until the
+// PPU writes CHR-RAM under them or maps other CHR over them.
+class TileCache {
+
+public:
+    TileCache() : valid{}
+        , decodes{}
+    {}
+
+    // Rows of the tile at pattern address tile * 16, eight pixels each,
+    // reading CHR through chrPages if it isn't decoded
+    const uint8_t* getTile(uint32_t tile, bool flipped, uint8_t* const* chrPages)
+    {
+        if (!(valid[tile >> 6] & (1ull << (tile & 63))))
+        {
+            decode(tile, chrPages);
+        }
+        return flipped ? flippedPixels[tile] : pixels[tile];
+    }
+
+    void invalidateTile(uint32_t tile) { valid[tile >> 6] &= ~(1ull << (tile & 63)); }
+
+    // The 64 tiles of one 1 KB CHR page
+    void invalidatePage(uint32_t page) { valid[page] = 0; }
+
+    void invalidateAll();
+
+    // Tiles decoded since construction
+    uint64_t getDecodes() const { return decodes; }
+
+private:
+    void decode(uint32_t tile, uint8_t* const* chrPages);
+
+    alignas(64) uint8_t pixels[numTiles][tilePixels];
+    alignas(64) uint8_t flippedPixels[numTiles][tilePixels];
+
+    // One bit per tile; a word covers one CHR page
+    uint64_t valid[numTiles / 64];
+    uint64_t decodes;
+};
+
+}
+
+#endif
@@ -0,0 +1,174 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include "Tracer.h"
+
+Tracer::Tracer(size_t ringRecords) : ring{}
+    , ringMask{}
+    , head{0}
+    , tail{0}
+    , cachedTail{}
+    , filter{}
+    , filtered{}
+    , typeMask{traceRead | traceWrite}
+    , sampleRate{1}
+    , sampleCount{}
+    , recorded{}
+    , cycles{}
+    , pc{}
+    , file{}
+    , drainThread{}
+    , stopping{false}
+{
+    // Round up to a power of two so positions wrap with a mask
+    size_t size = 1;
+    while (size < ringRecords)
+    {
+        size <<= 1;
+    }
+    ring.reset(new TraceRecord[size]);
+    ringMask = size - 1;
+
+    for (uint64_t& bits : filter)
+    {
+        bits = ~0ull;
+    }
+}
+
+Tracer::~Tracer()
+{
+    stop();
+}
+
+void Tracer::setClock(const uint64_t* cycles, const uint16_t* pc)
+{
+    this->cycles = cycles;
+    this->pc = pc;
+}
+
+void Tracer::addRange(uint16_t start, uint16_t end)
+{
+    if (!filtered)
+    {
+        for (uint64_t& bits : filter)
+        {
+            bits = 0;
+        }
+        filtered = true;
+    }
+    for (uint32_t address = start; address <= end; ++address)
+    {
+        filter[address >> 6] |= 1ull << (address & 63);
+    }
+}
+
+bool Tracer::start(const std::string& path)
+{
+    stop();
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+        std::cout << "Error opening trace file " << path << '\n';
+        return false;
+    }
+    const uint32_t recordSize = sizeof(TraceRecord);
+    file.write(reinterpret_cast<const char*>(&traceMagic), sizeof(traceMagic));
+    file.write(reinterpret_cast<const char*>(&traceVersion), sizeof(traceVersion));
+    file.write(reinterpret_cast<const char*>(&recordSize), sizeof(recordSize));
+
+    recorded = 0;
+    sampleCount = 0;
+    stopping.store(false);
+    drainThread = std::thread(&Tracer::drain, this);
+    return true;
+}
+
+void Tracer::stop()
+{
+    if (drainThread.joinable())
+    {
+        stopping.store(true, std::memory_order_release);
+        drainThread.join();
+    }
+    if (file.is_open())
+    {
+        file.close();
+    }
+}
+
+void Tracer::push(uint16_t address, uint8_t value, TraceType type)
+{
+    if (!drainThread.joinable())
+    {
+        return;
+    }
+
+    const uint64_t position = head.load(std::memory_order_relaxed);
+    if (position - cachedTail > ringMask)
+    {
+        // Full: wait for the drain thread rather than lose the access
+        cachedTail = tail.load(std::memory_order_acquire);
+        while (position - cachedTail > ringMask)
+        {
+            std::this_thread::yield();
+            cachedTail = tail.load(std::memory_order_acquire);
+        }
+    }
+
+    TraceRecord& entry = ring[position & ringMask];
+    entry.cycle = cycles ? *cycles : 0;
+    entry.pc = pc ? *pc : 0;
+    entry.address = address;
+    entry.value = value;
+    entry.type = type;
+    entry.padding[0] = 0;
+    entry.padding[1] = 0;
+    head.store(position + 1, std::memory_order_release);
+    ++recorded;
+}
+
+void Tracer::drain()
+{
+    // Yield a while before sleeping so a producer waiting on a full ring
+    // isn't held up for a whole sleep
+    const uint32_t spinPolls = 256;
+    uint32_t idlePolls = 0;
+    for (;;)
+    {
+        // Read the flag before head so a final pass sees every record
+        const bool finished = stopping.load(std::memory_order_acquire);
+        const uint64_t from = tail.load(std::memory_order_relaxed);
+        const uint64_t to = head.load(std::memory_order_acquire);
+        if (from != to)
+        {
+            writeRecords(from, to);
+            tail.store(to, std::memory_order_release);
+            idlePolls = 0;
+        }
+        else if (finished)
+        {
+            break;
+        }
+        else if (++idlePolls < spinPolls)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    file.flush();
+}
+
+void Tracer::writeRecords(uint64_t from, uint64_t to)
+{
+    // At most two contiguous pieces when the range wraps
+    while (from != to)
+    {
+        const size_t start = static_cast<size_t>(from & ringMask);
+        const size_t count = static_cast<size_t>(std::min<uint64_t>(to - from, ringMask + 1 - start));
+        file.write(reinterpret_cast<const char*>(&ring[start]), count * sizeof(TraceRecord));
+        from += count;
+    }
+}
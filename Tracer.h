@@ -0,0 +1,126 @@
+#ifndef TRACER_HXX
+#define TRACER_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Bus tracing is compiled in with -DNES_TRACE=1. Without it Memory has no
+// tracer hook at all.
+#ifndef NES_TRACE
+#define NES_TRACE 0
+#endif
+
+// Access kinds, also used as the filter mask
+enum TraceType : uint8_t
+{
+    traceRead = 1,
+    traceWrite = 2
+};
+
+// One bus access as stored in a trace file
+struct TraceRecord {
+    uint64_t cycle;     // CPU cycle count of the instruction making the access
+    uint16_t pc;        // Program counter at the time of the access
+    uint16_t address;
+    uint8_t value;
+    uint8_t type;       // TraceType
+    uint8_t padding[2];
+};
+
+static_assert(sizeof(TraceRecord) == 16, "Trace files store 16-byte records");
+
+// Trace file header: "NEST", format version and record size, followed by
+// records in host byte order
+static const uint32_t traceMagic = 0x5453454E;
+static const uint32_t traceVersion = 1;
+
+// Records bus accesses into a single-producer single-consumer ring that a
+// background thread drains to a file. The emulator thread is the only
+// producer; it never takes a lock and only waits when the ring is full, so
+// no access is lost. Filters and sampling run before anything is written.
+class Tracer {
+
+public:
+    explicit Tracer(size_t ringRecords = defaultRingRecords);
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static const size_t defaultRingRecords = 1 << 16;
+
+    // Where the cycle count and PC of each record come from
+    void setClock(const uint64_t* cycles, const uint16_t* pc);
+
+    // Only trace accesses in [start, end]. With no ranges every address is
+    // traced.
+    void addRange(uint16_t start, uint16_t end);
+
+    // Trace reads, writes or both (a mask of TraceType)
+    void setTypes(uint8_t types) { typeMask = types; }
+
+    // Keep one of every rate accesses that pass the filters
+    void setSampleRate(uint32_t rate) { sampleRate = rate > 0 ? rate : 1; }
+
+    // Open the file and start the drain thread. Returns false if the file
+    // can't be opened.
+    bool start(const std::string& path);
+
+    // Drain what is left and close the file
+    void stop();
+
+    void record(uint16_t address, uint8_t value, TraceType type)
+    {
+        if (!(typeMask & type) || !(filter[address >> 6] & (1ull << (address & 63))))
+        {
+            return;
+        }
+        if (++sampleCount < sampleRate)
+        {
+            return;
+        }
+        sampleCount = 0;
+        push(address, value, type);
+    }
+
+    // Records written to the ring since start()
+    uint64_t getRecordCount() const { return recorded; }
+
+private:
+    void push(uint16_t address, uint8_t value, TraceType type);
+
+    // Drain thread: copy records from the ring to the file until stopped
+    void drain();
+
+    // Write ring records [from, to) to the file
+    void writeRecords(uint64_t from, uint64_t to);
+
+    std::unique_ptr<TraceRecord[]> ring;
+    size_t ringMask;
+
+    // Producer and consumer positions, on separate cache lines
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) uint64_t cachedTail;    // Producer's last view of tail
+
+    uint64_t filter[0x10000 / 64];      // One bit per address
+    bool filtered;                      // True once a range is added
+    uint8_t typeMask;
+    uint32_t sampleRate;
+    uint32_t sampleCount;
+    uint64_t recorded;
+
+    const uint64_t* cycles;
+    const uint16_t* pc;
+
+    std::ofstream file;
+    std::thread drainThread;
+    std::atomic<bool> stopping;
+};
+
+#endif